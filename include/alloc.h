@@ -0,0 +1,93 @@
+#ifndef ROSCHA_ALLOC_H
+#define ROSCHA_ALLOC_H
+
+#include <stddef.h>
+
+/*
+ * Allocator used for all the memory roscha allocates: objects, hmaps, vectors,
+ * sds strings, parsed templates, etc. ctx is passed to each of the functions.
+ * realloc is called with a NULL ptr to allocate new memory and free is never
+ * called with NULL.
+ */
+struct roscha_allocator {
+	void *(*malloc)(void *ctx, size_t size);
+	void *(*realloc)(void *ctx, void *ptr, size_t size);
+	void (*free)(void *ctx, void *ptr);
+	void *ctx;
+};
+
+/*
+ * Set the allocator used by roscha; passing NULL restores the default one
+ * which uses the C library. The allocator should be set before creating any
+ * roscha objects or environments, since memory has to be freed by the same
+ * allocator that allocated it. The struct is not copied and should outlive its
+ * use.
+ */
+void roscha_set_allocator(const struct roscha_allocator *);
+
+/* Get the allocator currently in use */
+const struct roscha_allocator *roscha_get_allocator(void);
+
+/*
+ * A request heap: a bump allocator meant to hold everything that is created
+ * while handling a single request, e.g. the variables of a page and the
+ * rendered output, and to release it all at once.
+ *
+ * While a heap is entered, all the allocations made by roscha on the calling
+ * thread come from the heap, and freeing that memory is a no-op. Memory that
+ * was allocated outside the heap is still resized and freed by the allocator
+ * that owns it. Objects created in a heap are not reference counted, so they
+ * are never torn down individually; roscha_object_persist makes a reference
+ * counted copy of one that must outlive the request.
+ *
+ * Heap memory must only be freed or resized while the heap is entered, and
+ * environments and templates should be created outside of it.
+ */
+struct roscha_heap;
+
+/* Allocate a new, empty heap */
+struct roscha_heap *roscha_heap_new(void);
+
+/*
+ * Make the heap the target of roscha allocations on the calling thread,
+ * replacing the previously entered one, if any.
+ */
+void roscha_heap_enter(struct roscha_heap *);
+
+/*
+ * Stop allocating from the heap on the calling thread; returns the heap that
+ * was entered, if any, so that it can be entered again later.
+ */
+struct roscha_heap *roscha_heap_leave(void);
+
+/* Returns the heap entered on the calling thread or NULL */
+struct roscha_heap *roscha_heap_current(void);
+
+/* Number of bytes allocated from the heap, including bookkeeping */
+size_t roscha_heap_size(const struct roscha_heap *);
+
+/*
+ * Release everything allocated from the heap at once, keeping its largest
+ * chunk of memory around for reuse by the next request.
+ */
+void roscha_heap_reset(struct roscha_heap *);
+
+/* Release everything allocated from the heap and the heap itself */
+void roscha_heap_destroy(struct roscha_heap *);
+
+/*
+ * Allocate memory with the current allocator, or from the heap if one is
+ * entered.
+ */
+void *roscha_malloc(size_t size);
+
+/* Allocate zeroed memory for n elements with the current allocator */
+void *roscha_calloc(size_t n, size_t size);
+
+/* Resize memory allocated with the current allocator */
+void *roscha_realloc(void *ptr, size_t size);
+
+/* Free memory allocated with the current allocator */
+void roscha_free(void *ptr);
+
+#endif
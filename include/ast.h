@@ -20,6 +20,9 @@ enum tag_type {
 	TAG_FOR,
 	TAG_BLOCK,
 	TAG_EXTENDS,
+	TAG_INCLUDE,
+	TAG_MACRO,
+	TAG_CACHE,
 	/* keyword-only tags */
 	TAG_BREAK,
 	TAG_CLOSE,
@@ -34,10 +37,17 @@ enum expression_type {
 	EXPRESSION_INFIX,
 	EXPRESSION_MAPKEY,
 	EXPRESSION_INDEX,
+	EXPRESSION_FILTER,
+	EXPRESSION_CALL,
 };
 
 struct ident {
 	struct token token;
+	/*
+	 * 1 + the index of the macro parameter the identifier refers to, or 0 if
+	 * it is looked up in the template variables.
+	 */
+	size_t slot;
 };
 
 struct integer {
@@ -73,6 +83,36 @@ struct indexkey {
 	struct token       token;
 	struct expression *left;
 	struct expression *key;
+	/* A map key of a variable, e.g. user.name or user.address.city */
+	bool path;
+};
+
+/* Maximum number of arguments a filter can be called with */
+#define FILTER_MAX_ARGS 8
+
+/* value | name or value | name(args...) */
+struct filter {
+	struct token       token;
+	struct expression *left;
+	struct ident       name;
+	/* vector of expressions, NULL if called without parenthesis */
+	struct vector *args;
+};
+
+/* Maximum number of parameters of a macro */
+#define MACRO_MAX_PARAMS 16
+
+/* name(args...), a macro call */
+struct call {
+	struct token token;
+	struct ident name;
+	/* vector of expressions */
+	struct vector *args;
+	/*
+	 * The called macro, resolved once the whole template is parsed; NULL for
+	 * the built-in range(start, stop, step).
+	 */
+	struct macro *macro;
 };
 
 struct expression {
@@ -86,6 +126,8 @@ struct expression {
 		struct prefix   prefix;
 		struct infix    infix;
 		struct indexkey indexkey;
+		struct filter   filter;
+		struct call     call;
 	};
 };
 
@@ -118,6 +160,8 @@ struct tblock {
 	struct token   token;
 	struct ident   name;
 	struct vector *subblocks;
+	/* Index into resolved block tables; assigned by the environment */
+	size_t id;
 };
 
 /* {% extends ... %} */
@@ -126,14 +170,53 @@ struct parent {
 	struct string *name;
 };
 
+/* {% include ... %} */
+struct include {
+	struct token       token;
+	struct expression *name;
+	/*
+	 * The included template when name is a string, resolved by the
+	 * environment whenever templates are added; NULL if it isn't loaded.
+	 */
+	struct template *tmpl;
+	/* tmpl ends up including the template this tag is in */
+	bool cycle;
+};
+
+/* {% macro name(params...) %} */
+struct macro {
+	struct token token;
+	struct ident name;
+	/* vector of struct ident, with their slots set */
+	struct vector *params;
+	struct vector *subblocks;
+};
+
+/* {% cache key ttl %}, its output is kept in the environment's cache */
+struct fragment {
+	struct token       token;
+	struct expression *key;
+	/* Seconds to keep the output for; NULL to keep it until evicted */
+	struct expression *ttl;
+	/*
+	 * Put before the value of key to tell apart the cache tags of all the
+	 * templates, "name:line:column:"
+	 */
+	sds            prefix;
+	struct vector *subblocks;
+};
+
 /* {% ... %} blocks */
 struct tag {
 	union {
-		struct token  token;
-		struct cond   cond;
-		struct loop   loop;
-		struct tblock tblock;
-		struct parent parent;
+		struct token    token;
+		struct cond     cond;
+		struct loop     loop;
+		struct tblock   tblock;
+		struct parent   parent;
+		struct include  include;
+		struct macro    macro;
+		struct fragment fragment;
 	};
 	enum tag_type type;
 };
@@ -142,6 +225,8 @@ struct tag {
 struct variable {
 	struct token       token;
 	struct expression *expression;
+	/* Marked with | safe; never auto-escaped */
+	bool safe;
 };
 
 /* blocks with content that doesn't need evaluation */
@@ -175,20 +260,35 @@ struct template
 	char *name;
 	/*
 	 * The source text of the template before parsing. Should be free'd manually
-	 * by the caller of roscha_env_render.
+	 * by the caller of roscha_env_render. NULL if the template was streamed.
 	 */
 	char *source;
+	/*
+	 * vector of sds holding text the AST points to besides source: the
+	 * literals of a streamed template and the content folded when it was
+	 * added to an environment; NULL if there is none.
+	 */
+	struct vector *pool;
 	/*
 	 * struct that holds references to {% block ... %} tags, for easier/faster
 	 * access to said blocks.
 	 */
 	struct hmap *tblocks;
 	/*
-	 * Holds a child template if there is one. Populated during evaluation,
-	 * NULL'ed after evaluation, since a parent template can have different
-	 * children depending on the context.
+	 * The template at the top of the extends chain, whose blocks are the ones
+	 * rendered; NULL if a parent is missing or the chain is cyclic. Resolved
+	 * by the environment whenever templates are added, along with resolved.
 	 */
-	struct template *child;
+	const struct template *root;
+	/*
+	 * The {% block ... %} tags to render, indexed by tblock id; for each name
+	 * the one of the most derived template in the chain that has it.
+	 */
+	struct tblock **resolved;
+	/* vector of the struct include tags anywhere in the template */
+	struct vector *includes;
+	/* Scratch mark used by the environment when walking templates */
+	size_t mark;
 	/* vector of blocks */
 	struct vector *blocks;
 };
@@ -207,6 +307,13 @@ sds block_string(struct block *, sds str);
 
 sds template_string(struct template *, sds str);
 
+/*
+ * Deep copy of the template, named name, with copies of all the text it
+ * points to, so it outlives the source of the original. The blocks are
+ * unresolved, like in a template that was just parsed.
+ */
+struct template *template_clone(const struct template *, char *name);
+
 /* Free all memory related with the objects */
 
 void branch_destroy(struct branch *);
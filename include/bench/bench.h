@@ -0,0 +1,38 @@
+#ifndef BENCH_H
+#define BENCH_H
+#include <stdio.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Each benchmark prints one tab separated line: its name, the number of
+ * iterations and the nanoseconds per iteration.
+ */
+
+/* Sink for results, so that the compiler can't drop the benchmarked code */
+static volatile size_t bench_sink;
+
+#define BENCH_KEEP(x) (bench_sink += (size_t)(x))
+
+static inline double
+bench_now(void)
+{
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Run bench_func(iters), which should do iters iterations of its work */
+#define RUN_BENCH(bench_func, iters) \
+	do { \
+		double _start = bench_now(); \
+		bench_func(iters); \
+		double _ns = bench_now() - _start; \
+		printf("%s\t%zu\t%.2f\n", #bench_func, (size_t)(iters), \
+		       _ns / (iters)); \
+	} while (0)
+
+#define INIT_BENCH() \
+	printf("# %s\nname\titers\tns/op\n", __FILE__)
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef ROSCHA_CACHE_H
+#define ROSCHA_CACHE_H
+
+#include "sds/sds.h"
+
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * A memory bounded LRU cache of rendered output, used by {% cache %} tags.
+ * Keys and values are copied into the cache, which never allocates from a
+ * request heap. All the functions lock the cache, so it can be shared by
+ * environments rendering on several threads.
+ */
+struct roscha_cache;
+
+/* Counters of a cache, see roscha_cache_stats */
+struct roscha_cache_stats {
+	size_t hits;
+	size_t misses;
+	/* Entries dropped to make room for new ones; expired ones aren't counted */
+	size_t evictions;
+	size_t entries;
+	/* Memory held by the entries, including bookkeeping */
+	size_t size;
+	size_t max_size;
+};
+
+/*
+ * Allocate a new cache holding up to max_size bytes of entries, including
+ * their keys and bookkeeping.
+ */
+struct roscha_cache *roscha_cache_new(size_t max_size);
+
+/* Change the memory cap, evicting the least recently used entries to fit */
+void roscha_cache_set_max_size(struct roscha_cache *, size_t max_size);
+
+/*
+ * Append the value stored for key to out and return it, or return NULL without
+ * touching out if the key isn't cached or its entry has expired.
+ */
+sds roscha_cache_get(struct roscha_cache *, const char *key, size_t keylen,
+                     sds out);
+
+/*
+ * Store a copy of val for key, replacing the previous entry, for ttl seconds
+ * or until evicted if ttl is 0. Entries that don't fit in the cache at all
+ * aren't stored.
+ */
+void roscha_cache_put(struct roscha_cache *, const char *key, size_t keylen,
+                      const char *val, size_t vallen, time_t ttl);
+
+/* Copy the counters of the cache to stats */
+void roscha_cache_stats(struct roscha_cache *, struct roscha_cache_stats *);
+
+/* Drop all entries, e.g. after reloading templates; keeps the counters */
+void roscha_cache_clear(struct roscha_cache *);
+
+/* Free the cache and all its entries */
+void roscha_cache_destroy(struct roscha_cache *);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef ROSCHA_ESCAPE_H
+#define ROSCHA_ESCAPE_H
+
+#include "sds/sds.h"
+
+#include <stddef.h>
+
+/*
+ * Concatenate len bytes of s to str, replacing the HTML special characters
+ * <>&"' with their entities.
+ */
+sds escape_html(sds str, const char *s, size_t len);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef ROSCHA_FILTER_H
+#define ROSCHA_FILTER_H
+
+#include "hmap.h"
+#include "roscha.h"
+
+/*
+ * Add the built-in filters to filters, a hmap of names to
+ * struct roscha_filter.
+ */
+void filter_add_builtins(struct hmap *filters);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef ROSCHA_FORMAT_H
+#define ROSCHA_FORMAT_H
+
+#include "sds/sds.h"
+
+#include <stdint.h>
+
+/* Number of decimal digits needed to print val */
+unsigned format_digits(uint64_t val);
+
+/* Concatenate the decimal representation of val to str */
+sds format_int(sds str, int64_t val);
+
+#endif
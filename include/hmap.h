@@ -1,6 +1,7 @@
 #ifndef ROSCHA_HASHMAP_H
 #define ROSCHA_HASHMAP_H
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 #include "slice.h"
@@ -11,13 +12,36 @@
 
 typedef void (hmap_cb)(const struct slice *key, void *value);
 
+/*
+ * Insertion ordered hashmap. The key-value pairs are stored densely in the
+ * order they were inserted, and a separate open addressing table of indices
+ * into the entries is used for lookups, so that iterating over the map is a
+ * linear scan in a predictable order. The map grows once the entries fill up
+ * two thirds of the index table.
+ */
 struct hmap {
-	struct hnode **buckets;
-	size_t         cap;
-	size_t         size;
+	/* Open addressing table of indices into entries */
+	uint32_t *index;
+	/* Number of slots in the index table; always a power of two */
+	size_t cap;
+	/* Insertion ordered entries; removed ones are left as tombstones */
+	struct hentry *entries;
+	/* Number of used entries, including tombstones */
+	size_t len;
+	/* Number of index slots that are not empty, including deleted ones */
+	size_t fill;
+	/* Number of key-value pairs in the map */
+	size_t size;
 };
 
-struct hmap_iter;
+/*
+ * Iterator over the key-value pairs of a hmap. Doesn't need to be allocated,
+ * usually it is declared on the stack and initialized with hmap_iter_init.
+ */
+struct hmap_iter {
+	struct hmap *map;
+	size_t       index;
+};
 
 /* allocate a new hmap */
 struct hmap *hmap_new_with_cap(size_t cap);
@@ -48,11 +72,11 @@ void *hmap_removes(struct hmap *hm, const struct slice *key);
 /* Same as hmap_removes but pass a C string instead */
 void *hmap_remove(struct hmap *hm, const char *key);
 
-/* Iterate over keys in the hmap */
+/* Iterate over keys in the hmap in insertion order */
 void hmap_walk(struct hmap *hm, hmap_cb);
 
-/* Allocate a new hmap iterator */
-struct hmap_iter *hmap_iter_new(struct hmap *);
+/* Initialize an iterator over the hmap, starting from the first key */
+void hmap_iter_init(struct hmap_iter *iter, struct hmap *);
 
 /* Get the next key, value */
 bool hmap_iter_next(struct hmap_iter *iter, const struct slice **key,
@@ -60,9 +84,6 @@ bool hmap_iter_next(struct hmap_iter *iter, const struct slice **key,
 
 #define hmap_iter_foreach(it, k, v) while (hmap_iter_next(it, k, v))
 
-/* Free a hmap iterator */
-void hmap_iter_free(struct hmap_iter *iter);
-
 /* free hmap related memory calling a function before freeing each node */
 void hmap_destroy(struct hmap *hm, hmap_cb cb);
 
@@ -3,10 +3,17 @@
 
 #include "slice.h"
 #include "token.h"
+#include "vector.h"
 
 #include <sys/types.h>
 #include <stdbool.h>
 
+/*
+ * Reads up to len bytes of input into buf, like read(2). Returns the number of
+ * bytes read, 0 at the end of the input, or -1 on error.
+ */
+typedef ssize_t (*lexer_read_f)(void *ctx, char *buf, size_t len);
+
 /* The lexer */
 struct lexer {
 	/* Source input */
@@ -19,11 +26,35 @@ struct lexer {
 	bool   in_content;
 	size_t line;
 	size_t column;
+	/*
+	 * Set when the input is streamed with lexer_new_stream; input then points
+	 * to buf, which holds a window of the source.
+	 */
+	lexer_read_f read;
+	void        *ctx;
+	char        *buf;
+	/* Size of buf, not counting the terminating NUL */
+	size_t cap;
+	/* read returned 0, or -1 in which case read_error is set too */
+	bool eof;
+	bool read_error;
+	/*
+	 * vector of sds chunks the literals of streamed tokens are copied to, since
+	 * buf is reused. Whoever keeps the tokens should take it over.
+	 */
+	struct vector *pool;
 };
 
 /* Allocate a new lexer with input as the source */
 struct lexer *lexer_new(const char *input);
 
+/*
+ * Allocate a new lexer that reads its input in chunks with read, holding at
+ * most about bufsize bytes of it at a time, unless a single token is longer.
+ * Content is split into several tokens if it doesn't fit.
+ */
+struct lexer *lexer_new_stream(lexer_read_f read, void *ctx, size_t bufsize);
+
 /* Get the next token from the lexer */
 struct token lexer_next_token(struct lexer *);
 
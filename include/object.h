@@ -1,6 +1,7 @@
 #ifndef ROSCHA_OBJECT_H
 #define ROSCHA_OBJECT_H
 
+#include "alloc.h"
 #include "hmap.h"
 #include "slice.h"
 #include "vector.h"
@@ -8,8 +9,16 @@
 #include "sds/sds.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
+/*
+ * Maximum length of a string that can be stored inline inside the object; it
+ * is chosen so that the short string takes the same space in the union as a
+ * slice.
+ */
+#define ROSCHA_SSTR_CAP 22
+
 /* Types of roscha objects */
 enum roscha_type {
 	/* Only used internally; a variable that hasn't been set or defined. Does
@@ -24,15 +33,35 @@ enum roscha_type {
 	ROSCHA_STRING,
 	/* A slice of a string; basically functions the same as a string */
 	ROSCHA_SLICE,
+	/*
+	 * A short text string stored inline in the object itself; functions the
+	 * same as a string but doesn't need a separate allocation.
+	 */
+	ROSCHA_SSTR,
 	/* A vector of roscha objects */
 	ROSCHA_VECTOR,
 	/* A hashmap of roscha objects */
 	ROSCHA_HMAP,
+	/*
+	 * A sequence of integers from range(start, stop, step), whose items are
+	 * computed when iterated or indexed instead of stored.
+	 */
+	ROSCHA_RANGE,
 };
 
 /* A reference counted object for use in the environment */
 struct roscha_object {
 	enum roscha_type type;
+	/*
+	 * Allocated in a request heap; the reference count is ignored and the
+	 * object is released together with the heap.
+	 */
+	bool heap;
+	/*
+	 * Markup that was already escaped, such as the output of a macro call;
+	 * never escaped again.
+	 */
+	bool   safe;
 	size_t refcount;
 	union {
 		/*
@@ -47,16 +76,33 @@ struct roscha_object {
 		sds string;
 		/* String slice */
 		struct slice slice;
+		/* Short string, NUL terminated */
+		struct {
+			uint8_t len;
+			char    str[ROSCHA_SSTR_CAP + 1];
+		} sstr;
 		/* vector of roscha_objects */
 		struct vector *vector;
 		/* hashmap of roscha_objects */
 		struct hmap *hmap;
+		/* Integer range; step goes first and is never 0, so it is truthy */
+		struct {
+			int64_t step;
+			int64_t start;
+			int64_t stop;
+		} range;
 	};
 };
 
 /* Concatenate the textual representation of the object to an sds string */
 sds roscha_object_string(const struct roscha_object *, sds str);
 
+/*
+ * Set slice to the contents of a string-like object, i.e. a string, a short
+ * string or a slice. Returns false if the object is not string-like.
+ */
+bool roscha_object_slice(const struct roscha_object *, struct slice *);
+
 /* Return the textual representation of the type */
 const char *roscha_type_print(enum roscha_type);
 
@@ -64,8 +110,20 @@ const char *roscha_type_print(enum roscha_type);
 struct roscha_object *roscha_object_new_int(int64_t val);
 struct roscha_object *roscha_object_new_string(sds str);
 struct roscha_object *roscha_object_new_slice(struct slice);
+/*
+ * Create a string object copying len bytes from str. Strings of up to
+ * ROSCHA_SSTR_CAP bytes are stored inline in the object as a ROSCHA_SSTR, longer
+ * ones are copied to a new sds string.
+ */
+struct roscha_object *roscha_object_new_sstr(const char *str, size_t len);
 struct roscha_object *roscha_object_new_vector(struct vector *);
 struct roscha_object *roscha_object_new_hmap(struct hmap *);
+/* Create a range object; step must not be 0 */
+struct roscha_object *roscha_object_new_range(int64_t start, int64_t stop,
+                                              int64_t step);
+
+/* Number of items of a range object */
+size_t roscha_range_len(const struct roscha_object *);
 
 #define roscha_object_new(v) _Generic((v), \
 		int: roscha_object_new_int, \
@@ -87,6 +145,15 @@ roscha_object_ref(struct roscha_object *obj)
 /* Decrement reference count of object */
 void roscha_object_unref(struct roscha_object *);
 
+/*
+ * Escape hatch for objects created in a request heap that need to outlive it:
+ * returns a reference counted deep copy of the object allocated outside of
+ * any heap. Map keys and the strings slice objects point to are not copied.
+ * For objects that are not in a heap the reference count is incremented and
+ * the same object is returned.
+ */
+struct roscha_object *roscha_object_persist(struct roscha_object *);
+
 /*
  * Helper macro to create a roscha object wrapper and push to the vector in one
  * line.
@@ -8,6 +8,15 @@
 #include "vector.h"
 #include "sds/sds.h"
 
+/* How to trim the start of the content following a tag */
+enum parser_trim {
+	TRIM_NONE,
+	/* Only the first newline, for trim_blocks */
+	TRIM_NEWLINE,
+	/* All whitespace, for -%} and -}} */
+	TRIM_SPACE,
+};
+
 struct parser {
 	/* The name of the template; transfered to resulting template AST */
 	char *name;
@@ -24,8 +33,30 @@ struct parser {
 	 * resulting AST upon finishing parsing.
 	 */
 	struct hmap *tblocks;
+	/* vector of struct include, transfered to the AST like tblocks */
+	struct vector *includes;
+	/*
+	 * hmap of the struct macro defined in the template, and vector of the
+	 * struct call to resolve against them once the template is parsed.
+	 */
+	struct hmap   *macros;
+	struct vector *calls;
+	/* The macro whose body is being parsed, if any */
+	struct macro *macro;
+	/*
+	 * vector of the slices of the loop items in scope in the macro body being
+	 * parsed, which hide the parameters of the same name.
+	 */
+	struct vector *shadowed;
 	/* vector of sds */
 	struct vector *errors;
+	/* Whitespace control options; see struct roscha_env */
+	bool trim_blocks;
+	bool lstrip_blocks;
+	/* The content block right before the current tag, if any */
+	struct block *prev_content;
+	/* How to trim the next content block */
+	enum parser_trim trim_next;
 };
 
 typedef struct expression *(*prefix_parse_f)(struct parser *);
@@ -34,21 +65,16 @@ typedef struct expression *(*infix_parse_f)(struct parser *, struct expression *
 /* Allocate a new parser */
 struct parser *parser_new(char *name, char *input);
 
+/*
+ * Allocate a new parser that reads its input in chunks with read; see
+ * lexer_new_stream.
+ */
+struct parser *parser_new_stream(char *name, lexer_read_f read, void *ctx);
+
 /* Parse template into an AST */
 struct template *parser_parse_template(struct parser *);
 
 /* Free all memory asociated with the parser */
 void parser_destroy(struct parser *);
 
-/*
- * Initialize variables needed for parsing; may be used by several parsers.
- */
-void parser_init(void);
-
-/*
- * Free all static memory related to parsing; called when parsing/evaluation is
- * no longer needed
- */
-void parser_deinit(void);
-
 #endif
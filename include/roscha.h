@@ -1,48 +1,158 @@
 #ifndef ROSCHA_H
 #define ROSCHA_H
 
+#include "alloc.h"
+#include "cache.h"
 #include "object.h"
 
+#include <sys/types.h>
+
+/*
+ * A filter that can be applied to values in templates with
+ * {{ value | name }} or {{ value | name(args...) }}; args is a vector of
+ * roscha objects, empty if the filter was called without arguments. At least
+ * one of the functions has to be set; the missing one is derived from the
+ * other.
+ */
+struct roscha_filter {
+	/*
+	 * Return a new reference to the filtered value, or NULL if the arguments
+	 * are invalid.
+	 */
+	struct roscha_object *(*value)(struct roscha_object *in,
+	                               struct vector        *args);
+	/*
+	 * Concatenate the filtered value to out; used when the result is written
+	 * to the render output, so no intermediate object is needed. Return NULL
+	 * without touching out if the arguments are invalid.
+	 */
+	sds (*write)(sds out, struct roscha_object *in, struct vector *args);
+};
+
 /* The environment for evaluation templates */
 struct roscha_env {
 	/* Template variables; reference counted hmap of roscha objects */
 	struct roscha_object *vars;
 	/* vector of sds with error messages */
 	struct vector *errors;
+	/*
+	 * HTML-escape the output of {{ }} variables, unless marked with | safe.
+	 * Off by default.
+	 */
+	bool autoescape;
+	/*
+	 * Whitespace control applied when parsing templates, so they have to be set
+	 * before adding them. trim_blocks removes the first newline after a {% %}
+	 * tag, lstrip_blocks strips spaces and tabs from the start of a line up to
+	 * a {% %} tag.
+	 */
+	bool trim_blocks;
+	bool lstrip_blocks;
+	/*
+	 * Cache for the output of {% cache %} tags, which are rendered every time
+	 * while it is NULL. Not owned by the environment, so one cache can be
+	 * shared by several environments, e.g. one per thread.
+	 */
+	struct roscha_cache *cache;
+	/*
+	 * Cache for whole renders, NULL by default. While set, each render records
+	 * the variable paths it reads, e.g. user.name or items, and later renders
+	 * of the template return the cached output if they all have the same
+	 * values. Filters are assumed to only depend on their arguments.
+	 */
+	struct roscha_cache *render_cache;
 	/* internal */
 	struct roscha_ *internal;
 };
 
 /*
- * Initialize variables needed for parsing; may be used by several roscha
- * parsers.
+ * Kept for compatibility; roscha has no global state to initialize or free, so
+ * these do nothing. Templates can be parsed concurrently from several threads,
+ * as long as each thread uses its own environment.
  */
 void roscha_init(void);
-
-/*
- * Free all static memory related to roscha; called when parsing/evaluation is
- * no longer needed
- */
 void roscha_deinit(void);
 
 /* Allocate a new environment */
 struct roscha_env *roscha_env_new(void);
 
 /*
- * Parse and add a template to the environment. Returns false upon encountering
- * a parsing error.
+ * Parse and add a template to the environment, replacing the one with the same
+ * name. Returns false upon encountering a parsing error.
  */
 bool roscha_env_add_template(struct roscha_env *, char *name, char *body);
 
+/*
+ * Reads up to len bytes of a template into buf, like read(2) on ctx. Returns
+ * the number of bytes read, 0 at the end of the template, or -1 on error.
+ */
+typedef ssize_t (*roscha_read_f)(void *ctx, char *buf, size_t len);
+
+/*
+ * Like roscha_env_add_template, but the body is read in chunks with read, so
+ * it can come from a pipe. Only the parts of the template kept by the AST are
+ * copied; the source is never held whole in memory.
+ */
+bool roscha_env_add_template_stream(struct roscha_env *, char *name,
+                                    roscha_read_f read, void *ctx);
+
+/*
+ * Add the template name again as spec_name, with the variables of consts, an
+ * hmap object, substituted; e.g. the site name or feature flags, which are
+ * the same for every render. Expressions and if conditions that only depend
+ * on them are evaluated once here, dead branches dropped and the remaining
+ * content merged, so rendering spec_name skips that work. Only name itself
+ * is specialized, not the templates it extends or includes, and the consts
+ * shouldn't share names with loop variables of those. spec_name is a copy,
+ * which doesn't depend on name or its source afterwards. Returns false on
+ * errors.
+ */
+bool roscha_env_specialize(struct roscha_env *, const char *name,
+                           char *spec_name, struct roscha_object *consts);
+
 /*
  * Load and parse templates from dir (non-recursively). All non-dir files are
  * read and parsed. Returns false if an error occurred.
  */
 bool roscha_env_load_dir(struct roscha_env *, const char *path);
 
+/*
+ * Add a filter or replace the one with the same name, including the built-in
+ * upper, lower, trim, truncate, replace, length and safe filters. Neither the
+ * name nor the struct are copied, so both should outlive the environment.
+ */
+void roscha_env_add_filter(struct roscha_env *, const char *name,
+                           const struct roscha_filter *);
+
 /* Render/evaluate the template */
 sds roscha_env_render(struct roscha_env *, const char *name);
 
+/* A range of the output of a template that changed between two renders */
+struct roscha_change {
+	/* Where the range starts in the previous output, and its length there */
+	size_t start;
+	size_t len;
+	/* The text that replaces it */
+	sds text;
+};
+
+/*
+ * Render the template keeping its output split in segments, one per block at
+ * the top level of the template and of its {% block %} tags, along with the
+ * variable paths each segment read. Later calls only render again the
+ * segments where one of those paths changed value, e.g. after a
+ * roscha_hmap_set.
+ *
+ * Returns the whole output if changes is NULL. Otherwise returns NULL and
+ * pushes to changes a struct roscha_change for each segment whose output
+ * changed, in order, which gives the new output when applied to the previous
+ * one from the last to the first; on the first call every segment is a
+ * change. The caller frees the changes with roscha_free and their text with
+ * sdsfree.
+ */
+sds roscha_env_render_incremental(struct roscha_env *, const char *name,
+                                  struct vector *changes);
+
 struct vector *roscha_env_check_errors(struct roscha_env *env);
 
 /*
@@ -0,0 +1,39 @@
+#ifndef ROSCHA_SIMD_H
+#define ROSCHA_SIMD_H
+
+#include <stdint.h>
+
+/*
+ * Helpers for scanning strings SIMD_WIDTH bytes at a time, comparing each of
+ * them against a byte and getting the result as a bit mask. SIMD_WIDTH is
+ * left undefined when neither SSE2 nor AVX2 are available, in which case only
+ * scalar code should be used.
+ */
+#if defined(__GNUC__) && defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_WIDTH 32
+typedef __m256i simd_vec;
+#define simd_set1(c)    _mm256_set1_epi8(c)
+#define simd_load(p)    _mm256_loadu_si256((const __m256i *)(p))
+#define simd_eq(v, c)   _mm256_cmpeq_epi8(v, c)
+#define simd_or(a, b)   _mm256_or_si256(a, b)
+#define simd_mask(v)    (uint32_t) _mm256_movemask_epi8(v)
+#elif defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define SIMD_WIDTH 16
+typedef __m128i simd_vec;
+#define simd_set1(c)    _mm_set1_epi8(c)
+#define simd_load(p)    _mm_loadu_si128((const __m128i *)(p))
+#define simd_eq(v, c)   _mm_cmpeq_epi8(v, c)
+#define simd_or(a, b)   _mm_or_si128(a, b)
+#define simd_mask(v)    (uint32_t) _mm_movemask_epi8(v)
+#endif
+
+#ifdef SIMD_WIDTH
+/* Index of the first and last set bits of a non-zero mask */
+#define simd_first(m) ((unsigned)__builtin_ctz(m))
+#define simd_last(m)  (31u - (unsigned)__builtin_clz(m))
+#define simd_count(m) ((unsigned)__builtin_popcount(m))
+#endif
+
+#endif
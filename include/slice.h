@@ -3,6 +3,7 @@
 
 #include "sds/sds.h"
 
+#include <stdbool.h>
 #include <string.h>
 #include <sys/types.h>
 
@@ -25,9 +26,18 @@ void slice_set(struct slice *, const char *str, size_t start, size_t end);
 /* Get the length of the slice */
 size_t slice_len(const struct slice *);
 
-/* Returns 0 if equal, 1 if a > b, -1 if a < b */
+/*
+ * Returns 0 if equal, 1 if a > b, -1 if a < b; shorter slices sort first. Use
+ * slice_eq when only equality matters.
+ */
 int slice_cmp(const struct slice *restrict a, const struct slice *restrict b);
 
+/* Whether both slices have the same contents */
+bool slice_eq(const struct slice *restrict a, const struct slice *restrict b);
+
+/* Hash the contents of the slice */
+size_t slice_hash(const struct slice *);
+
 /* Copy the slice from src to dst; dst should already be allocated */
 void slice_cpy(struct slice *dst, const struct slice *src);
 
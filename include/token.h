@@ -40,6 +40,9 @@ enum token_type {
 	TOKEN_RBRACKET,
 	TOKEN_POUND,
 	TOKEN_PERCENT,
+	TOKEN_PIPE,
+	/* - right after {{ or {%, or right before }} or %} */
+	TOKEN_TRIM,
 	/* Keywords */
 	TOKEN_FOR,
 	TOKEN_IN,
@@ -52,8 +55,13 @@ enum token_type {
 	TOKEN_ELSE,
 	TOKEN_ENDIF,
 	TOKEN_EXTENDS,
+	TOKEN_INCLUDE,
 	TOKEN_BLOCK,
 	TOKEN_ENDBLOCK,
+	TOKEN_MACRO,
+	TOKEN_ENDMACRO,
+	TOKEN_CACHE,
+	TOKEN_ENDCACHE,
 	/* The document content */
 	TOKEN_CONTENT,
 };
@@ -66,10 +74,7 @@ struct token {
 	size_t          column;
 };
 
-/* Intialize our keywords hashmap */
-void token_init_keywords(void);
-
-/* Get the token type for a keyword, if it is a registered keyword. */
+/* Get the token type for a keyword, or TOKEN_IDENT if it isn't one */
 enum token_type token_lookup_ident(const struct slice *ident);
 
 /* Return a C string with the token type name */
@@ -78,7 +83,4 @@ const char *token_type_print(enum token_type);
 /* Concatenate this token to a sds string */
 sds token_string(struct token *, sds str);
 
-/* Free memory allocated by the keywords hashmap */
-void token_free_keywords(void);
-
 #endif
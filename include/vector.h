@@ -24,6 +24,6 @@ void *vector_pop(struct vector *);
 void vector_free(struct vector *);
 
 #define vector_foreach(vec, i, val) \
-	for (i = 0, val = vec->values[i]; i < vec->len; i++, val = vec->values[i])
+	for (i = 0; i < vec->len && ((val = vec->values[i]), true); i++)
 
 #endif
@@ -0,0 +1,266 @@
+#include "alloc.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+/* Size of the first chunk of a heap; following ones double up to the max */
+#define HEAP_CHUNK_MIN (64 * 1024)
+#define HEAP_CHUNK_MAX (4 * 1024 * 1024)
+
+/* Heap allocations are 8 byte aligned and preceded by their size */
+#define HEAP_ALIGN 8
+#define HEAP_HDR   sizeof(size_t)
+
+struct heap_chunk {
+	struct heap_chunk *next;
+	/* bytes available in data */
+	size_t size;
+	/* bytes of data handed out */
+	size_t used;
+	char   data[];
+};
+
+struct roscha_heap {
+	/* Most recent chunk first */
+	struct heap_chunk *chunks;
+	/* Total bytes handed out, including headers */
+	size_t used;
+};
+
+static void *
+libc_malloc(void *ctx, size_t size)
+{
+	return malloc(size);
+}
+
+static void *
+libc_realloc(void *ctx, void *ptr, size_t size)
+{
+	return realloc(ptr, size);
+}
+
+static void
+libc_free(void *ctx, void *ptr)
+{
+	free(ptr);
+}
+
+static const struct roscha_allocator libc_allocator = {
+	.malloc  = libc_malloc,
+	.realloc = libc_realloc,
+	.free    = libc_free,
+	.ctx     = NULL,
+};
+
+static const struct roscha_allocator *allocator = &libc_allocator;
+
+static _Thread_local struct roscha_heap *heap = NULL;
+
+static inline void *
+base_malloc(size_t size)
+{
+	return allocator->malloc(allocator->ctx, size);
+}
+
+static inline void
+base_free(void *ptr)
+{
+	allocator->free(allocator->ctx, ptr);
+}
+
+static bool
+heap_owns(const struct roscha_heap *h, const void *ptr)
+{
+	const char *p = ptr;
+	for (struct heap_chunk *c = h->chunks; c; c = c->next) {
+		if (p >= c->data && p < c->data + c->size) return true;
+	}
+	return false;
+}
+
+static inline size_t
+heap_ptr_size(const void *ptr)
+{
+	return *(const size_t *)((const char *)ptr - HEAP_HDR);
+}
+
+static inline bool
+heap_is_last(const struct roscha_heap *h, const void *ptr)
+{
+	const struct heap_chunk *c = h->chunks;
+	return (const char *)ptr + heap_ptr_size(ptr) == c->data + c->used;
+}
+
+static void *
+heap_alloc(struct roscha_heap *h, size_t size)
+{
+	size = (size + HEAP_ALIGN - 1) & ~(size_t)(HEAP_ALIGN - 1);
+	size_t             need = size + HEAP_HDR;
+	struct heap_chunk *c    = h->chunks;
+	if (!c || c->size - c->used < need) {
+		size_t csize = c ? c->size * 2 : HEAP_CHUNK_MIN;
+		if (csize > HEAP_CHUNK_MAX) csize = HEAP_CHUNK_MAX;
+		if (csize < need) csize = need;
+		c = base_malloc(sizeof(*c) + csize);
+		if (!c) return NULL;
+		c->size   = csize;
+		c->used   = 0;
+		c->next   = h->chunks;
+		h->chunks = c;
+	}
+	char *p = c->data + c->used;
+	*(size_t *)p = size;
+	c->used += need;
+	h->used += need;
+	return p + HEAP_HDR;
+}
+
+static void *
+heap_realloc(struct roscha_heap *h, void *ptr, size_t size)
+{
+	size_t old = heap_ptr_size(ptr);
+	if (size <= old) return ptr;
+
+	/* The last allocation can be grown in place if the chunk has room */
+	struct heap_chunk *c = h->chunks;
+	size = (size + HEAP_ALIGN - 1) & ~(size_t)(HEAP_ALIGN - 1);
+	if (heap_is_last(h, ptr) && c->size - c->used >= size - old) {
+		*(size_t *)((char *)ptr - HEAP_HDR) = size;
+		c->used += size - old;
+		h->used += size - old;
+		return ptr;
+	}
+
+	void *new = heap_alloc(h, size);
+	if (new) memcpy(new, ptr, old);
+	return new;
+}
+
+static void
+heap_free(struct roscha_heap *h, void *ptr)
+{
+	/* Only the last allocation can be given back */
+	if (heap_is_last(h, ptr)) {
+		size_t size = heap_ptr_size(ptr) + HEAP_HDR;
+		h->chunks->used -= size;
+		h->used -= size;
+	}
+}
+
+struct roscha_heap *
+roscha_heap_new(void)
+{
+	struct roscha_heap *h = base_malloc(sizeof(*h));
+	if (!h) return NULL;
+	h->chunks = NULL;
+	h->used   = 0;
+	return h;
+}
+
+void
+roscha_heap_enter(struct roscha_heap *h)
+{
+	heap = h;
+}
+
+struct roscha_heap *
+roscha_heap_leave(void)
+{
+	struct roscha_heap *h = heap;
+	heap                  = NULL;
+	return h;
+}
+
+struct roscha_heap *
+roscha_heap_current(void)
+{
+	return heap;
+}
+
+size_t
+roscha_heap_size(const struct roscha_heap *h)
+{
+	return h->used;
+}
+
+void
+roscha_heap_reset(struct roscha_heap *h)
+{
+	/* The first chunk is the newest and so the biggest one */
+	struct heap_chunk *keep = h->chunks;
+	if (!keep) return;
+	struct heap_chunk *c = keep->next;
+	while (c) {
+		struct heap_chunk *next = c->next;
+		base_free(c);
+		c = next;
+	}
+	keep->next = NULL;
+	keep->used = 0;
+	h->chunks  = keep;
+	h->used    = 0;
+}
+
+void
+roscha_heap_destroy(struct roscha_heap *h)
+{
+	if (heap == h) heap = NULL;
+	struct heap_chunk *c = h->chunks;
+	while (c) {
+		struct heap_chunk *next = c->next;
+		base_free(c);
+		c = next;
+	}
+	base_free(h);
+}
+
+void
+roscha_set_allocator(const struct roscha_allocator *a)
+{
+	allocator = a ? a : &libc_allocator;
+}
+
+const struct roscha_allocator *
+roscha_get_allocator(void)
+{
+	return allocator;
+}
+
+void *
+roscha_malloc(size_t size)
+{
+	if (heap) return heap_alloc(heap, size);
+	return allocator->malloc(allocator->ctx, size);
+}
+
+void *
+roscha_calloc(size_t n, size_t size)
+{
+	if (size && n > SIZE_MAX / size) return NULL;
+	void *ptr = roscha_malloc(n * size);
+	if (ptr) memset(ptr, 0, n * size);
+	return ptr;
+}
+
+void *
+roscha_realloc(void *ptr, size_t size)
+{
+	if (heap) {
+		if (ptr == NULL) return heap_alloc(heap, size);
+		if (heap_owns(heap, ptr)) return heap_realloc(heap, ptr, size);
+	}
+	return allocator->realloc(allocator->ctx, ptr, size);
+}
+
+void
+roscha_free(void *ptr)
+{
+	if (ptr == NULL) return;
+	if (heap && heap_owns(heap, ptr)) {
+		heap_free(heap, ptr);
+		return;
+	}
+	allocator->free(allocator->ctx, ptr);
+}
@@ -1,4 +1,6 @@
 #include "ast.h"
+#include "alloc.h"
+#include "format.h"
 #include "slice.h"
 #include "vector.h"
 
@@ -27,7 +29,7 @@ ident_string(struct ident *ident, sds str)
 static inline sds
 integer_string(struct integer *i, sds str)
 {
-	return sdscatfmt(str, "%I", i->value);
+	return format_int(str, i->value);
 }
 
 static inline sds
@@ -87,6 +89,42 @@ index_string(struct indexkey *index, sds str)
 	return str;
 }
 
+static inline sds
+filter_string(struct filter *filter, sds str)
+{
+	str = sdscat(str, "(");
+	str = expression_string(filter->left, str);
+	str = sdscat(str, " | ");
+	str = ident_string(&filter->name, str);
+	if (filter->args) {
+		size_t             i;
+		struct expression *arg;
+		str = sdscat(str, "(");
+		vector_foreach (filter->args, i, arg) {
+			if (i > 0) str = sdscat(str, ", ");
+			str = expression_string(arg, str);
+		}
+		str = sdscat(str, ")");
+	}
+	str = sdscat(str, ")");
+	return str;
+}
+
+static inline sds
+call_string(struct call *call, sds str)
+{
+	size_t             i;
+	struct expression *arg;
+	str = ident_string(&call->name, str);
+	str = sdscat(str, "(");
+	vector_foreach (call->args, i, arg) {
+		if (i > 0) str = sdscat(str, ", ");
+		str = expression_string(arg, str);
+	}
+	str = sdscat(str, ")");
+	return str;
+}
+
 sds
 expression_string(struct expression *expr, sds str)
 {
@@ -107,6 +145,10 @@ expression_string(struct expression *expr, sds str)
 		return mapkey_string(&expr->indexkey, str);
 	case EXPRESSION_INDEX:
 		return index_string(&expr->indexkey, str);
+	case EXPRESSION_FILTER:
+		return filter_string(&expr->filter, str);
+	case EXPRESSION_CALL:
+		return call_string(&expr->call, str);
 	}
 	return str;
 }
@@ -168,6 +210,48 @@ parent_string(struct parent *prnt, sds str)
 	return str;
 }
 
+static inline sds
+include_string(struct include *inc, sds str)
+{
+	str = sdscat(str, "{% include ");
+	str = expression_string(inc->name, str);
+	str = sdscat(str, " %}");
+	return str;
+}
+
+static inline sds
+macro_string(struct macro *macro, sds str)
+{
+	size_t        i;
+	struct ident *param;
+	str = sdscat(str, "{% macro ");
+	str = ident_string(&macro->name, str);
+	str = sdscat(str, "(");
+	vector_foreach (macro->params, i, param) {
+		if (i > 0) str = sdscat(str, ", ");
+		str = ident_string(param, str);
+	}
+	str = sdscat(str, ") %}\n");
+	str = subblocks_string(macro->subblocks, str);
+	str = sdscat(str, "\n{% endmacro %}");
+	return str;
+}
+
+static inline sds
+fragment_string(struct fragment *frag, sds str)
+{
+	str = sdscat(str, "{% cache ");
+	str = expression_string(frag->key, str);
+	if (frag->ttl) {
+		str = sdscat(str, " ");
+		str = expression_string(frag->ttl, str);
+	}
+	str = sdscat(str, " %}\n");
+	str = subblocks_string(frag->subblocks, str);
+	str = sdscat(str, "\n{% endcache %}");
+	return str;
+}
+
 sds
 tag_string(struct tag *tag, sds str)
 {
@@ -180,6 +264,12 @@ tag_string(struct tag *tag, sds str)
 		return tblock_string(&tag->tblock, str);
 	case TAG_EXTENDS:
 		return parent_string(&tag->parent, str);
+	case TAG_INCLUDE:
+		return include_string(&tag->include, str);
+	case TAG_MACRO:
+		return macro_string(&tag->macro, str);
+	case TAG_CACHE:
+		return fragment_string(&tag->fragment, str);
 	case TAG_BREAK:
 		str = sdscat(str, "{% ");
 		str = slice_string(&tag->token.literal, str);
@@ -195,6 +285,9 @@ variable_string(struct variable *var, sds str)
 {
 	str = sdscat(str, "{{ ");
 	str = expression_string(var->expression, str);
+	if (var->safe) {
+		str = sdscat(str, " | safe");
+	}
 	str = sdscat(str, " }}");
 	return str;
 }
@@ -227,9 +320,245 @@ template_string(struct template *tmpl, sds str)
 	return subblocks_string(tmpl->blocks, str);
 }
 
+/* Size of the chunks of text of a cloned template */
+#define CLONE_POOL_CHUNK 4096
+
+/* State of a template_clone */
+struct clone {
+	/* Name of the copy */
+	const char *name;
+	/* vector of sds holding the text of the copy */
+	struct vector *pool;
+	/* The macros of the copy by name, and the calls to point to them */
+	struct hmap   *macros;
+	struct vector *calls;
+	/* Filled in like the parser does for a new template */
+	struct hmap   *tblocks;
+	struct vector *includes;
+};
+
+static struct vector *subblocks_clone(struct clone *, const struct vector *);
+
+/* Point the slice to a copy of its text in the pool */
+static void
+slice_clone(struct clone *c, struct slice *s)
+{
+	if (s->str == NULL) return;
+	size_t len   = slice_len(s);
+	sds    chunk = NULL;
+	if (c->pool->len > 0) {
+		chunk = c->pool->values[c->pool->len - 1];
+	}
+	if (chunk == NULL || sdsavail(chunk) < len + 1) {
+		size_t size = len + 1 > CLONE_POOL_CHUNK ? len + 1 : CLONE_POOL_CHUNK;
+		chunk       = sdsMakeRoomFor(sdsempty(), size);
+		vector_push(c->pool, chunk);
+	}
+	size_t at = sdslen(chunk);
+	memcpy(chunk + at, s->str + s->start, len);
+	chunk[at + len] = '\0';
+	sdsIncrLen(chunk, len + 1);
+
+	s->str   = chunk;
+	s->start = at;
+	s->end   = at + len;
+}
+
+static struct expression *
+expression_clone(struct clone *c, const struct expression *expr)
+{
+	if (!expr) return NULL;
+	struct expression *copy = roscha_malloc(sizeof(*copy));
+	*copy                   = *expr;
+	slice_clone(c, &copy->token.literal);
+
+	size_t             i;
+	struct expression *arg;
+	switch (expr->type) {
+	case EXPRESSION_STRING:
+		slice_clone(c, &copy->string.value);
+		break;
+	case EXPRESSION_PREFIX:
+		slice_clone(c, &copy->prefix.operator);
+		copy->prefix.right = expression_clone(c, expr->prefix.right);
+		break;
+	case EXPRESSION_INFIX:
+		slice_clone(c, &copy->infix.operator);
+		copy->infix.left  = expression_clone(c, expr->infix.left);
+		copy->infix.right = expression_clone(c, expr->infix.right);
+		break;
+	case EXPRESSION_INDEX:
+	case EXPRESSION_MAPKEY:
+		copy->indexkey.left = expression_clone(c, expr->indexkey.left);
+		copy->indexkey.key  = expression_clone(c, expr->indexkey.key);
+		break;
+	case EXPRESSION_FILTER:
+		slice_clone(c, &copy->filter.name.token.literal);
+		copy->filter.left = expression_clone(c, expr->filter.left);
+		if (expr->filter.args) {
+			copy->filter.args = vector_new();
+			vector_foreach (expr->filter.args, i, arg) {
+				vector_push(copy->filter.args, expression_clone(c, arg));
+			}
+		}
+		break;
+	case EXPRESSION_CALL:
+		slice_clone(c, &copy->call.name.token.literal);
+		copy->call.args = vector_new();
+		vector_foreach (expr->call.args, i, arg) {
+			vector_push(copy->call.args, expression_clone(c, arg));
+		}
+		if (expr->call.macro) vector_push(c->calls, &copy->call);
+		break;
+	case EXPRESSION_IDENT:
+	case EXPRESSION_INT:
+	case EXPRESSION_BOOL:
+	default:
+		break;
+	}
+
+	return copy;
+}
+
+static struct branch *
+branch_clone(struct clone *c, const struct branch *brnch)
+{
+	struct branch *copy = roscha_malloc(sizeof(*copy));
+	*copy               = *brnch;
+	slice_clone(c, &copy->token.literal);
+	copy->condition = expression_clone(c, brnch->condition);
+	copy->subblocks = subblocks_clone(c, brnch->subblocks);
+	if (brnch->next) copy->next = branch_clone(c, brnch->next);
+	return copy;
+}
+
+/* Copy the parts of the tag that point elsewhere; the rest is already copied */
+static void
+tag_clone(struct clone *c, struct tag *copy, const struct tag *tag)
+{
+	switch (tag->type) {
+	case TAG_IF:
+		copy->cond.root = branch_clone(c, tag->cond.root);
+		break;
+	case TAG_FOR:
+		slice_clone(c, &copy->loop.item.token.literal);
+		copy->loop.seq       = expression_clone(c, tag->loop.seq);
+		copy->loop.subblocks = subblocks_clone(c, tag->loop.subblocks);
+		break;
+	case TAG_BLOCK:
+		slice_clone(c, &copy->tblock.name.token.literal);
+		copy->tblock.subblocks = subblocks_clone(c, tag->tblock.subblocks);
+		break;
+	case TAG_EXTENDS:
+		copy->parent.name  = roscha_malloc(sizeof(*copy->parent.name));
+		*copy->parent.name = *tag->parent.name;
+		slice_clone(c, &copy->parent.name->token.literal);
+		slice_clone(c, &copy->parent.name->value);
+		break;
+	case TAG_INCLUDE:
+		copy->include.name  = expression_clone(c, tag->include.name);
+		copy->include.tmpl  = NULL;
+		copy->include.cycle = false;
+		vector_push(c->includes, &copy->include);
+		break;
+	case TAG_MACRO: {
+		size_t        i;
+		struct ident *param;
+		slice_clone(c, &copy->macro.name.token.literal);
+		copy->macro.params = vector_new();
+		vector_foreach (tag->macro.params, i, param) {
+			struct ident *pcopy = roscha_malloc(sizeof(*pcopy));
+			*pcopy              = *param;
+			slice_clone(c, &pcopy->token.literal);
+			vector_push(copy->macro.params, pcopy);
+		}
+		copy->macro.subblocks = subblocks_clone(c, tag->macro.subblocks);
+		hmap_sets(c->macros, copy->macro.name.token.literal, &copy->macro);
+		break;
+	}
+	case TAG_CACHE:
+		/* The prefix tells apart the fragments of the copy */
+		copy->fragment.key    = expression_clone(c, tag->fragment.key);
+		copy->fragment.ttl    = expression_clone(c, tag->fragment.ttl);
+		copy->fragment.prefix = sdscatfmt(sdsempty(), "%s:%U:%U:", c->name,
+		                                  (unsigned long long)tag->token.line,
+		                                  (unsigned long long)tag->token.column);
+		copy->fragment.subblocks = subblocks_clone(c, tag->fragment.subblocks);
+		break;
+	case TAG_BREAK:
+	default:
+		break;
+	}
+}
+
+static struct block *
+block_clone(struct clone *c, const struct block *blk)
+{
+	struct block *copy = roscha_malloc(sizeof(*copy));
+	*copy              = *blk;
+	slice_clone(c, &copy->token.literal);
+	switch (blk->type) {
+	case BLOCK_VARIABLE:
+		copy->variable.expression = expression_clone(c, blk->variable.expression);
+		break;
+	case BLOCK_TAG:
+		tag_clone(c, &copy->tag, &blk->tag);
+		if (blk->tag.type == TAG_BLOCK) {
+			hmap_sets(c->tblocks, copy->tag.tblock.name.token.literal, copy);
+		}
+		break;
+	case BLOCK_CONTENT:
+	default:
+		break;
+	}
+	return copy;
+}
+
+static struct vector *
+subblocks_clone(struct clone *c, const struct vector *subblks)
+{
+	struct vector *copy = vector_new();
+	size_t         i;
+	struct block  *blk;
+	vector_foreach (subblks, i, blk) {
+		vector_push(copy, block_clone(c, blk));
+	}
+	return copy;
+}
+
+struct template *
+template_clone(const struct template *tmpl, char *name)
+{
+	struct template *copy = roscha_calloc(1, sizeof(*copy));
+	struct clone     c    = {
+		.name     = name,
+		.pool     = vector_new(),
+		.macros   = hmap_new(),
+		.calls    = vector_new(),
+		.tblocks  = hmap_new(),
+		.includes = vector_new(),
+	};
+	copy->name   = name;
+	copy->blocks = subblocks_clone(&c, tmpl->blocks);
+
+	size_t       i;
+	struct call *call;
+	vector_foreach (c.calls, i, call) {
+		call->macro = hmap_gets(c.macros, &call->name.token.literal);
+	}
+	hmap_free(c.macros);
+	vector_free(c.calls);
+
+	copy->pool     = c.pool;
+	copy->tblocks  = c.tblocks;
+	copy->includes = c.includes;
+	return copy;
+}
+
 void
 expression_destroy(struct expression *expr)
 {
+	if (!expr) return;
 	switch (expr->type) {
 	case EXPRESSION_PREFIX:
 		expression_destroy(expr->prefix.right);
@@ -242,6 +571,27 @@ expression_destroy(struct expression *expr)
 	case EXPRESSION_MAPKEY:
 		expression_destroy(expr->indexkey.left);
 		expression_destroy(expr->indexkey.key);
+		break;
+	case EXPRESSION_FILTER:
+		expression_destroy(expr->filter.left);
+		if (expr->filter.args) {
+			size_t             i;
+			struct expression *arg;
+			vector_foreach (expr->filter.args, i, arg) {
+				expression_destroy(arg);
+			}
+			vector_free(expr->filter.args);
+		}
+		break;
+	case EXPRESSION_CALL: {
+		size_t             i;
+		struct expression *arg;
+		vector_foreach (expr->call.args, i, arg) {
+			expression_destroy(arg);
+		}
+		vector_free(expr->call.args);
+		break;
+	}
 	case EXPRESSION_IDENT:
 	case EXPRESSION_INT:
 	case EXPRESSION_BOOL:
@@ -249,7 +599,7 @@ expression_destroy(struct expression *expr)
 	default:
 		break;
 	}
-	free(expr);
+	roscha_free(expr);
 }
 
 static inline void
@@ -269,7 +619,7 @@ branch_destroy(struct branch *brnch)
 	if (brnch->condition) expression_destroy(brnch->condition);
 	subblocks_destroy(brnch->subblocks);
 	if (brnch->next) branch_destroy(brnch->next);
-	free(brnch);
+	roscha_free(brnch);
 }
 
 void
@@ -287,7 +637,26 @@ tag_destroy(struct tag *tag)
 		subblocks_destroy(tag->tblock.subblocks);
 		break;
 	case TAG_EXTENDS:
-		free(tag->parent.name);
+		roscha_free(tag->parent.name);
+		break;
+	case TAG_INCLUDE:
+		expression_destroy(tag->include.name);
+		break;
+	case TAG_MACRO: {
+		size_t        i;
+		struct ident *param;
+		vector_foreach (tag->macro.params, i, param) {
+			roscha_free(param);
+		}
+		vector_free(tag->macro.params);
+		subblocks_destroy(tag->macro.subblocks);
+		break;
+	}
+	case TAG_CACHE:
+		expression_destroy(tag->fragment.key);
+		expression_destroy(tag->fragment.ttl);
+		sdsfree(tag->fragment.prefix);
+		subblocks_destroy(tag->fragment.subblocks);
 		break;
 	case TAG_BREAK:
 	default:
@@ -309,14 +678,25 @@ block_destroy(struct block *blk)
 	default:
 		break;
 	}
-	free(blk);
+	roscha_free(blk);
 }
 
 void
 template_destroy(struct template *tmpl)
 {
+	/* the name is allocated by the caller, not by roscha */
 	free(tmpl->name);
 	subblocks_destroy(tmpl->blocks);
 	hmap_free(tmpl->tblocks);
-	free(tmpl);
+	roscha_free(tmpl->resolved);
+	vector_free(tmpl->includes);
+	if (tmpl->pool != NULL) {
+		size_t i;
+		sds    chunk;
+		vector_foreach (tmpl->pool, i, chunk) {
+			sdsfree(chunk);
+		}
+		vector_free(tmpl->pool);
+	}
+	roscha_free(tmpl);
 }
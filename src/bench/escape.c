@@ -0,0 +1,74 @@
+#include "bench/bench.h"
+#include "escape.h"
+
+#include <string.h>
+
+#define ITERS 100000
+
+static char text[4096];
+
+/* Byte at a time escaping, for comparison */
+static sds
+escape_naive(sds str, const char *s, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		switch (s[i]) {
+		case '&':
+			str = sdscat(str, "&amp;");
+			break;
+		case '<':
+			str = sdscat(str, "&lt;");
+			break;
+		case '>':
+			str = sdscat(str, "&gt;");
+			break;
+		case '"':
+			str = sdscat(str, "&quot;");
+			break;
+		case '\'':
+			str = sdscat(str, "&#39;");
+			break;
+		default:
+			str = sdscatlen(str, s + i, 1);
+		}
+	}
+	return str;
+}
+
+static void
+bench_escape_naive(size_t n)
+{
+	sds out = sdsempty();
+	for (size_t i = 0; i < n; i++) {
+		sdsclear(out);
+		out = escape_naive(out, text, sizeof(text));
+	}
+	BENCH_KEEP(sdslen(out));
+	sdsfree(out);
+}
+
+static void
+bench_escape_html(size_t n)
+{
+	sds out = sdsempty();
+	for (size_t i = 0; i < n; i++) {
+		sdsclear(out);
+		out = escape_html(out, text, sizeof(text));
+	}
+	BENCH_KEEP(sdslen(out));
+	sdsfree(out);
+}
+
+int
+main(void)
+{
+	INIT_BENCH();
+	/* Mostly plain text, with a special character every 200 bytes or so */
+	const char *words = "lorem ipsum dolor sit amet, consectetur adipiscing ";
+	size_t      wlen  = strlen(words);
+	for (size_t i = 0; i < sizeof(text); i++) {
+		text[i] = i % 197 == 0 ? '&' : words[i % wlen];
+	}
+	RUN_BENCH(bench_escape_naive, ITERS);
+	RUN_BENCH(bench_escape_html, ITERS);
+}
@@ -0,0 +1,45 @@
+#include "bench/bench.h"
+#include "format.h"
+
+#include <stdint.h>
+
+#define ITERS 10000000
+
+/* A mix of the sizes of numbers found in tables: ids, counts, prices... */
+static int64_t numbers[] = {
+	7, 42, 365, 1024, 65535, 1000000, 2147483647, -15, -123456, 9007199254740993,
+};
+
+#define NNUMBERS (sizeof(numbers) / sizeof(numbers[0]))
+
+static void
+bench_sdscatfmt(size_t n)
+{
+	sds out = sdsempty();
+	for (size_t i = 0; i < n; i++) {
+		if (i % 1024 == 0) sdsclear(out);
+		out = sdscatfmt(out, "%I", numbers[i % NNUMBERS]);
+	}
+	BENCH_KEEP(sdslen(out));
+	sdsfree(out);
+}
+
+static void
+bench_format_int(size_t n)
+{
+	sds out = sdsempty();
+	for (size_t i = 0; i < n; i++) {
+		if (i % 1024 == 0) sdsclear(out);
+		out = format_int(out, numbers[i % NNUMBERS]);
+	}
+	BENCH_KEEP(sdslen(out));
+	sdsfree(out);
+}
+
+int
+main(void)
+{
+	INIT_BENCH();
+	RUN_BENCH(bench_sdscatfmt, ITERS);
+	RUN_BENCH(bench_format_int, ITERS);
+}
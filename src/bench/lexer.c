@@ -0,0 +1,39 @@
+#include "bench/bench.h"
+#include "lexer.h"
+#include "token.h"
+
+#define ITERS 10000000
+
+/* Mostly tags and expressions, little content */
+static const char *input =
+	"{% for item in items %}"
+	"{% if item.price * item.quantity > 100 and not item.discounted %}"
+	"{{ item.name }}{{ item.price * item.quantity - item.rebate / 2 }}"
+	"{% elif item.tags[0] == \"sale\" or item.featured %}"
+	"{{ item.name | upper }}{{ loop.index + 1 }}"
+	"{% else %}{{ item.description | truncate(80) }}{% endif %}"
+	"{% if loop.index >= 10 %}{% break %}{% endif %}"
+	"{% endfor %}";
+
+/* One iteration is one token */
+static void
+bench_lexer_tokens(size_t n)
+{
+	struct lexer *lexer = lexer_new(input);
+	for (size_t i = 0; i < n; i++) {
+		struct token token = lexer_next_token(lexer);
+		BENCH_KEEP(token.type);
+		if (token.type == TOKEN_EOF) {
+			lexer_destroy(lexer);
+			lexer = lexer_new(input);
+		}
+	}
+	lexer_destroy(lexer);
+}
+
+int
+main(void)
+{
+	INIT_BENCH();
+	RUN_BENCH(bench_lexer_tokens, ITERS);
+}
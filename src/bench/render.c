@@ -0,0 +1,347 @@
+#define _POSIX_C_SOURCE 200809L
+#include "bench/bench.h"
+#include "roscha.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Whole renders of realistic pages. Each workload prints one tab separated
+ * line: its name, the number of renders, ns/render, renders/s, output MB/s,
+ * allocations per render and its peak RSS in KiB. Workloads run in their own
+ * process, so that the peak RSS is theirs alone.
+ */
+
+/* Calls to malloc and realloc made by roscha */
+static size_t nallocs;
+
+static void *
+count_malloc(void *ctx, size_t size)
+{
+	nallocs++;
+	return malloc(size);
+}
+
+static void *
+count_realloc(void *ctx, void *ptr, size_t size)
+{
+	nallocs++;
+	return realloc(ptr, size);
+}
+
+static void
+count_free(void *ctx, void *ptr)
+{
+	free(ptr);
+}
+
+static const struct roscha_allocator count_allocator = {
+	.malloc  = count_malloc,
+	.realloc = count_realloc,
+	.free    = count_free,
+};
+
+static void
+render_bench(struct roscha_env *env, const char *bench, const char *name,
+             size_t iters)
+{
+	size_t bytes  = 0;
+	size_t allocs = nallocs;
+	double start  = bench_now();
+	for (size_t i = 0; i < iters; i++) {
+		sds out = roscha_env_render(env, name);
+		if (env->errors->len > 0) {
+			fprintf(stderr, "%s: %s\n", bench, (char *)env->errors->values[0]);
+			exit(1);
+		}
+		bytes += sdslen(out);
+		sdsfree(out);
+	}
+	double ns = bench_now() - start;
+	allocs    = nallocs - allocs;
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	printf("%s\t%zu\t%.0f\t%.0f\t%.2f\t%.1f\t%ld\n", bench, iters, ns / iters,
+	       iters / (ns / 1e9), bytes / (ns / 1e9) / 1e6, (double)allocs / iters,
+	       usage.ru_maxrss);
+}
+
+/* Four levels of extends, each overriding some blocks of its parent */
+static const char *blog_base =
+	"<!DOCTYPE html><html><head><title>{% block title %}{{ site.name }}"
+	"{% endblock %}</title>{% block head %}"
+	"<link rel=\"stylesheet\" href=\"{{ site.url }}/style.css\">"
+	"{% endblock %}</head><body><nav>{% block nav %}"
+	"<a href=\"{{ site.url }}\">{{ site.name }}</a>{% endblock %}</nav>"
+	"<main>{% block content %}{% endblock %}</main>"
+	"<footer>{% block footer %}&copy; {{ site.year }} {{ site.name }}"
+	"{% endblock %}</footer></body></html>";
+
+static const char *blog_layout =
+	"{% extends \"base\" %}"
+	"{% block nav %}{% for link in site.links %}"
+	"<a href=\"{{ site.url }}/{{ link.path }}\">{{ link.title }}</a>"
+	"{% endfor %}{% endblock %}"
+	"{% block content %}<div class=\"main\">{% block main %}{% endblock %}"
+	"</div><aside>{% block sidebar %}{% endblock %}</aside>{% endblock %}";
+
+static const char *blog_list =
+	"{% extends \"layout\" %}"
+	"{% block main %}{% for post in posts %}<article>"
+	"<h2><a href=\"{{ site.url }}/{{ post.slug }}\">{{ post.title }}</a></h2>"
+	"<p class=\"meta\">by {{ post.author.name }} on {{ post.date }}</p>"
+	"<p>{{ post.summary | truncate(120) }}</p><ul class=\"tags\">"
+	"{% for tag in post.tags %}<li>{{ tag }}</li>{% endfor %}</ul>"
+	"{% if post.comments > 0 %}<span>{{ post.comments }} comments</span>"
+	"{% else %}<span>No comments yet</span>{% endif %}</article>"
+	"{% endfor %}{% endblock %}"
+	"{% block sidebar %}<h3>Archive</h3>{% endblock %}";
+
+static const char *blog_page =
+	"{% extends \"list\" %}"
+	"{% block title %}Blog - {{ site.name }}{% endblock %}"
+	"{% block sidebar %}<h3>Hello, {{ user.name }}</h3>"
+	"{% if user.admin %}<a href=\"/admin\">Admin</a>{% endif %}"
+	"{% endblock %}";
+
+static void
+bench_blog(size_t iters)
+{
+	static const char *titles[] = { "About", "Archive", "Projects", "Contact" };
+	static const char *tags[]   = { "c", "templates", "performance", "<web>" };
+
+	struct roscha_env *env = roscha_env_new();
+	env->autoescape        = true;
+	roscha_env_add_template(env, strdup("base"), (char *)blog_base);
+	roscha_env_add_template(env, strdup("layout"), (char *)blog_layout);
+	roscha_env_add_template(env, strdup("list"), (char *)blog_list);
+	roscha_env_add_template(env, strdup("page"), (char *)blog_page);
+
+	struct roscha_object *site  = roscha_object_new(hmap_new());
+	struct roscha_object *links = roscha_object_new(vector_new());
+	roscha_hmap_set_new(site, "name", sdsnew("Roscha & friends"));
+	roscha_hmap_set_new(site, "url", sdsnew("https://example.org"));
+	roscha_hmap_set_new(site, "year", 2024);
+	for (size_t i = 0; i < 4; i++) {
+		struct roscha_object *link = roscha_object_new(hmap_new());
+		roscha_hmap_set_new(link, "title", sdsnew(titles[i]));
+		roscha_hmap_set_new(link, "path", sdsnew(titles[i]));
+		vector_push(links->vector, link);
+	}
+	hmap_set(site->hmap, "links", links);
+
+	struct roscha_object *posts = roscha_object_new(vector_new());
+	for (int i = 0; i < 10; i++) {
+		struct roscha_object *post   = roscha_object_new(hmap_new());
+		struct roscha_object *author = roscha_object_new(hmap_new());
+		struct roscha_object *ptags  = roscha_object_new(vector_new());
+		roscha_hmap_set_new(author, "name", sdsnew("Jane Doe"));
+		for (int j = 0; j <= i % 4; j++) {
+			roscha_vector_push_new(ptags, sdsnew(tags[j]));
+		}
+		roscha_hmap_set_new(post, "title",
+		                    sdscatfmt(sdsempty(), "Post number %i", i));
+		roscha_hmap_set_new(post, "slug", sdscatfmt(sdsempty(), "post-%i", i));
+		roscha_hmap_set_new(post, "date", sdsnew("2024-05-17"));
+		roscha_hmap_set_new(post, "summary",
+		                    sdsnew("A look at how a small template engine "
+		                           "written in C renders pages, where the time "
+		                           "goes and what can be done about it when "
+		                           "the same page is served over and over."));
+		roscha_hmap_set_new(post, "comments", i % 3);
+		hmap_set(post->hmap, "author", author);
+		hmap_set(post->hmap, "tags", ptags);
+		vector_push(posts->vector, post);
+	}
+	struct roscha_object *user = roscha_object_new(hmap_new());
+	roscha_hmap_set_new(user, "name", sdsnew("ana"));
+	roscha_hmap_set_new(user, "admin", 1);
+
+	hmap_set(env->vars->hmap, "site", site);
+	hmap_set(env->vars->hmap, "posts", posts);
+	hmap_set(env->vars->hmap, "user", user);
+	render_bench(env, "bench_blog", "page", iters);
+	roscha_env_destroy(env);
+}
+
+static void
+bench_table(size_t iters)
+{
+	char *input = "<table><tr><th>#</th><th>Name</th><th>Price</th>"
+				  "<th>Qty</th><th>Total</th></tr>"
+				  "{% for row in rows %}<tr><td>{{ loop.index }}</td>"
+				  "<td>{{ row.name }}</td><td>{{ row.price }}</td>"
+				  "<td>{{ row.qty }}</td><td>{{ row.price * row.qty }}</td>"
+				  "</tr>{% endfor %}</table>";
+
+	struct roscha_env *env = roscha_env_new();
+	env->autoescape        = true;
+	roscha_env_add_template(env, strdup("table"), input);
+
+	struct roscha_object *rows = roscha_object_new(vector_new());
+	for (int i = 0; i < 10000; i++) {
+		struct roscha_object *row = roscha_object_new(hmap_new());
+		roscha_hmap_set_new(row, "name", sdscatfmt(sdsempty(), "item %i", i));
+		roscha_hmap_set_new(row, "price", 100 + i % 900);
+		roscha_hmap_set_new(row, "qty", 1 + i % 7);
+		vector_push(rows->vector, row);
+	}
+	hmap_set(env->vars->hmap, "rows", rows);
+	render_bench(env, "bench_table", "table", iters);
+	roscha_env_destroy(env);
+}
+
+#define NESTED_DEPTH 8
+
+static void
+bench_nested(size_t iters)
+{
+	char *input =
+		"{% for i in items %}"
+		"<p>{{ a.b.c.d.e.f.g.h.name }} {{ a.b.c.d.e.f.g.h.value }}</p>"
+		"{% if a.b.c.d.e.f.g.h.flag %}<b>{{ a.b.c.d.name }}</b>{% endif %}"
+		"{{ a.b.c.d.e.f.g.h.list[2] }}{{ a.b.c.d.e.f.g.name }}"
+		"{% endfor %}";
+	/* Map keys aren't copied */
+	static char *keys[NESTED_DEPTH] = { "a", "b", "c", "d", "e", "f", "g", "h" };
+
+	struct roscha_env *env = roscha_env_new();
+	roscha_env_add_template(env, strdup("nested"), input);
+
+	/* a.b.c...h, every level with a name */
+	struct roscha_object *obj = env->vars;
+	for (size_t i = 0; i < NESTED_DEPTH; i++) {
+		struct roscha_object *next = roscha_object_new(hmap_new());
+		roscha_hmap_set_new(next, "name", sdscatfmt(sdsempty(), "level %U",
+		                                            (unsigned long long)i));
+		hmap_set(obj->hmap, keys[i], next);
+		obj = next;
+	}
+	struct roscha_object *list = roscha_object_new(vector_new());
+	for (int i = 0; i < 4; i++) {
+		roscha_vector_push_new(list, i * 10);
+	}
+	roscha_hmap_set_new(obj, "value", 42);
+	roscha_hmap_set_new(obj, "flag", 1);
+	hmap_set(obj->hmap, "list", list);
+	hmap_set(env->vars->hmap, "items", roscha_object_new_range(0, 100, 1));
+
+	render_bench(env, "bench_nested", "nested", iters);
+	roscha_env_destroy(env);
+}
+
+static void
+bench_email(size_t iters)
+{
+	char *input =
+		"Dear {{ user.first | trim }} {{ user.last | upper }},\n\n"
+		"Thank you for your order #{{ order.id }} placed on {{ order.date }}. "
+		"We are happy to let you know that it has been shipped and should "
+		"arrive at {{ user.address | replace(\"\\n\", \", \") }} within "
+		"{{ order.days }} business days. You can follow its progress at any "
+		"time from your account page, where you will also find the invoice "
+		"and the details of every item you ordered.\n\n"
+		"{% for line in order.lines %}"
+		"  - {{ line.name | truncate(40) }} x{{ line.qty }}: "
+		"{{ line.price }} {{ order.currency | lower }}\n"
+		"{% endfor %}\n"
+		"Subtotal: {{ order.subtotal }} {{ order.currency | lower }}\n"
+		"Shipping: {{ order.shipping }} {{ order.currency | lower }}\n\n"
+		"{{ message }}\n\n"
+		"If you have any questions about your order, simply reply to this "
+		"email or write to {{ support.email }} and one of our team members "
+		"will get back to you as soon as possible, usually within a day.\n\n"
+		"Kind regards,\n{{ support.signature | trim }}\n\n"
+		"{{ legal | truncate(300) }}\n";
+
+	struct roscha_env *env = roscha_env_new();
+	roscha_env_add_template(env, strdup("email"), input);
+
+	struct roscha_object *user  = roscha_object_new(hmap_new());
+	struct roscha_object *order = roscha_object_new(hmap_new());
+	struct roscha_object *sup   = roscha_object_new(hmap_new());
+	struct roscha_object *lines = roscha_object_new(vector_new());
+	roscha_hmap_set_new(user, "first", sdsnew("  Ana  "));
+	roscha_hmap_set_new(user, "last", sdsnew("Lovelace"));
+	roscha_hmap_set_new(user, "address",
+	                    sdsnew("12 Analytical Row\nLondon\nUnited Kingdom"));
+	roscha_hmap_set_new(order, "id", 1843);
+	roscha_hmap_set_new(order, "date", sdsnew("10 December 2024"));
+	roscha_hmap_set_new(order, "days", 3);
+	roscha_hmap_set_new(order, "currency", sdsnew("EUR"));
+	roscha_hmap_set_new(order, "subtotal", 274);
+	roscha_hmap_set_new(order, "shipping", 5);
+	for (int i = 0; i < 5; i++) {
+		struct roscha_object *line = roscha_object_new(hmap_new());
+		roscha_hmap_set_new(
+			line, "name",
+			sdscatfmt(sdsempty(),
+			          "Difference engine replacement part number %i", i));
+		roscha_hmap_set_new(line, "qty", 1 + i);
+		roscha_hmap_set_new(line, "price", 10 * (i + 1));
+		vector_push(lines->vector, line);
+	}
+	hmap_set(order->hmap, "lines", lines);
+	roscha_hmap_set_new(sup, "email", sdsnew("support@example.org"));
+	roscha_hmap_set_new(sup, "signature", sdsnew("\n  The Example team\n"));
+
+	sds message = sdsempty();
+	sds legal   = sdsempty();
+	for (int i = 0; i < 8; i++) {
+		message = sdscat(message, "Our spring catalogue is out now, with "
+		                          "hundreds of new parts for your engines. ");
+		legal   = sdscat(legal, "This email was sent to you because you "
+		                        "placed an order with Example Ltd. ");
+	}
+	hmap_set(env->vars->hmap, "user", user);
+	hmap_set(env->vars->hmap, "order", order);
+	hmap_set(env->vars->hmap, "support", sup);
+	roscha_hmap_set_new(env->vars, "message", message);
+	roscha_hmap_set_new(env->vars, "legal", legal);
+
+	render_bench(env, "bench_email", "email", iters);
+	roscha_env_destroy(env);
+}
+
+static const struct {
+	void (*run)(size_t iters);
+	size_t iters;
+} workloads[] = {
+	{ bench_blog, 10000 },
+	{ bench_table, 50 },
+	{ bench_nested, 5000 },
+	{ bench_email, 50000 },
+};
+
+int
+main(void)
+{
+	roscha_set_allocator(&count_allocator);
+	printf("# %s\nname\trenders\tns/render\trenders/s\tMB/s\tallocs/render"
+	       "\tpeak_rss_kb\n",
+	       __FILE__);
+	fflush(stdout);
+	for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (pid == 0) {
+			workloads[i].run(workloads[i].iters);
+			fflush(stdout);
+			_exit(0);
+		}
+		int status;
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)
+		    || WEXITSTATUS(status) != 0) {
+			return 1;
+		}
+	}
+	roscha_set_allocator(NULL);
+	return 0;
+}
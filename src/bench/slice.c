@@ -0,0 +1,107 @@
+#include "bench/bench.h"
+#include "slice.h"
+#include "hmap.h"
+
+#include <stdint.h>
+
+#define ITERS 10000000
+
+/* Variable names of 3 to 16 bytes, like the ones templates look up */
+static const char *keys[] = {
+	"url",
+	"user",
+	"title",
+	"author",
+	"content",
+	"comments",
+	"createdat",
+	"stylesheet",
+	"description",
+	"profile_image",
+	"navigation_bar",
+	"published_after",
+	"canonical_domain",
+	NULL,
+};
+
+static struct slice slices[16];
+static struct slice copies[16];
+static char         buf[256];
+static size_t       nkeys;
+
+/* The FNV-1a hash that hmap used before, for comparison */
+static size_t
+fnv1a(const struct slice *slice)
+{
+	uint64_t hash = 14695981039346656037u;
+	for (size_t i = slice->start; i < slice->end; i++) {
+		hash ^= slice->str[i];
+		hash *= 1099511628211u;
+	}
+	return hash;
+}
+
+static void
+bench_fnv1a(size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		BENCH_KEEP(fnv1a(&slices[i % nkeys]));
+	}
+}
+
+static void
+bench_slice_hash(size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		BENCH_KEEP(slice_hash(&slices[i % nkeys]));
+	}
+}
+
+static void
+bench_slice_eq(size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		BENCH_KEEP(slice_eq(&slices[i % nkeys], &copies[i % nkeys]));
+	}
+}
+
+static void
+bench_slice_cmp(size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		BENCH_KEEP(slice_cmp(&slices[i % nkeys], &copies[i % nkeys]));
+	}
+}
+
+static void
+bench_hmap_gets(size_t n)
+{
+	struct hmap *map = hmap_new();
+	for (size_t i = 0; i < nkeys; i++) {
+		hmap_sets(map, slices[i], (void *)keys[i]);
+	}
+	for (size_t i = 0; i < n; i++) {
+		BENCH_KEEP(hmap_gets(map, &copies[i % nkeys]));
+	}
+	hmap_free(map);
+}
+
+int
+main(void)
+{
+	INIT_BENCH();
+	/* Compare against copies so that the pointers are never the same */
+	size_t off = 0;
+	for (nkeys = 0; keys[nkeys] != NULL; nkeys++) {
+		size_t len = strlen(keys[nkeys]);
+		memcpy(buf + off, keys[nkeys], len);
+		slices[nkeys] = slice_whole(keys[nkeys]);
+		copies[nkeys] = slice_new(buf, off, off + len);
+		off += len;
+	}
+	RUN_BENCH(bench_fnv1a, ITERS);
+	RUN_BENCH(bench_slice_hash, ITERS);
+	RUN_BENCH(bench_slice_eq, ITERS);
+	RUN_BENCH(bench_slice_cmp, ITERS);
+	RUN_BENCH(bench_hmap_gets, ITERS);
+}
@@ -0,0 +1,198 @@
+#include "cache.h"
+#include "alloc.h"
+#include "hmap.h"
+
+#include <pthread.h>
+#include <string.h>
+
+/* A cached value; the key and then the value are stored right after it */
+struct centry {
+	/* Neighbours in the recency list, most recently used first */
+	struct centry *prev;
+	struct centry *next;
+	/* Time in seconds at which the entry expires, 0 if it never does */
+	time_t expires;
+	size_t keylen;
+	size_t vallen;
+	char   data[];
+};
+
+struct roscha_cache {
+	pthread_mutex_t lock;
+	/* hmap of struct centry, the keys point to the ones in the entries */
+	struct hmap *entries;
+	/* Recency list, evicting from the tail */
+	struct centry *head;
+	struct centry *tail;
+	struct roscha_cache_stats stats;
+};
+
+static inline time_t
+cache_now(void)
+{
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec;
+}
+
+static inline size_t
+centry_size(size_t keylen, size_t vallen)
+{
+	return sizeof(struct centry) + keylen + vallen;
+}
+
+static inline void
+cache_unlink(struct roscha_cache *cache, struct centry *e)
+{
+	if (e->prev) e->prev->next = e->next;
+	else cache->head = e->next;
+	if (e->next) e->next->prev = e->prev;
+	else cache->tail = e->prev;
+}
+
+static inline void
+cache_push_front(struct roscha_cache *cache, struct centry *e)
+{
+	e->prev = NULL;
+	e->next = cache->head;
+	if (cache->head) cache->head->prev = e;
+	else cache->tail = e;
+	cache->head = e;
+}
+
+static void
+cache_drop(struct roscha_cache *cache, struct centry *e)
+{
+	struct slice key = slice_new(e->data, 0, e->keylen);
+	hmap_removes(cache->entries, &key);
+	cache_unlink(cache, e);
+	cache->stats.entries--;
+	cache->stats.size -= centry_size(e->keylen, e->vallen);
+	roscha_free(e);
+}
+
+/* Drop the least recently used entries until at most size bytes are held */
+static void
+cache_evict(struct roscha_cache *cache, size_t size)
+{
+	while (cache->stats.size > size && cache->tail != NULL) {
+		cache_drop(cache, cache->tail);
+		cache->stats.evictions++;
+	}
+}
+
+struct roscha_cache *
+roscha_cache_new(size_t max_size)
+{
+	/* The cache outlives requests, so it is never allocated in a heap */
+	struct roscha_heap  *heap  = roscha_heap_leave();
+	struct roscha_cache *cache = roscha_calloc(1, sizeof(*cache));
+	cache->entries             = hmap_new();
+	cache->stats.max_size      = max_size;
+	pthread_mutex_init(&cache->lock, NULL);
+	roscha_heap_enter(heap);
+
+	return cache;
+}
+
+void
+roscha_cache_set_max_size(struct roscha_cache *cache, size_t max_size)
+{
+	pthread_mutex_lock(&cache->lock);
+	cache->stats.max_size = max_size;
+	cache_evict(cache, max_size);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+sds
+roscha_cache_get(struct roscha_cache *cache, const char *key, size_t keylen,
+                 sds out)
+{
+	struct slice skey = slice_new(key, 0, keylen);
+
+	pthread_mutex_lock(&cache->lock);
+	struct centry *e = hmap_gets(cache->entries, &skey);
+	if (e != NULL && e->expires != 0 && e->expires <= cache_now()) {
+		cache_drop(cache, e);
+		e = NULL;
+	}
+	if (e == NULL) {
+		cache->stats.misses++;
+		pthread_mutex_unlock(&cache->lock);
+		return NULL;
+	}
+	cache->stats.hits++;
+	cache_unlink(cache, e);
+	cache_push_front(cache, e);
+	/* Copied while locked, the entry can be evicted as soon as it's released */
+	out = sdscatlen(out, e->data + e->keylen, e->vallen);
+	pthread_mutex_unlock(&cache->lock);
+
+	return out;
+}
+
+void
+roscha_cache_put(struct roscha_cache *cache, const char *key, size_t keylen,
+                 const char *val, size_t vallen, time_t ttl)
+{
+	size_t size = centry_size(keylen, vallen);
+
+	/* Built before locking, so that other threads only wait for the insert */
+	struct roscha_heap *heap = roscha_heap_leave();
+	struct centry      *e    = roscha_malloc(size);
+	if (e != NULL) {
+		e->expires = ttl > 0 ? cache_now() + ttl : 0;
+		e->keylen  = keylen;
+		e->vallen  = vallen;
+		memcpy(e->data, key, keylen);
+		memcpy(e->data + keylen, val, vallen);
+	}
+
+	struct slice skey = slice_new(key, 0, keylen);
+	pthread_mutex_lock(&cache->lock);
+	struct centry *old = hmap_gets(cache->entries, &skey);
+	if (old != NULL) {
+		cache_drop(cache, old);
+	}
+	if (e != NULL && size <= cache->stats.max_size) {
+		cache_evict(cache, cache->stats.max_size - size);
+		hmap_sets(cache->entries, slice_new(e->data, 0, keylen), e);
+		cache_push_front(cache, e);
+		cache->stats.entries++;
+		cache->stats.size += size;
+		e = NULL;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	if (e != NULL) {
+		roscha_free(e);
+	}
+	roscha_heap_enter(heap);
+}
+
+void
+roscha_cache_stats(struct roscha_cache *cache,
+                   struct roscha_cache_stats *stats)
+{
+	pthread_mutex_lock(&cache->lock);
+	*stats = cache->stats;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void
+roscha_cache_clear(struct roscha_cache *cache)
+{
+	pthread_mutex_lock(&cache->lock);
+	while (cache->head != NULL) {
+		cache_drop(cache, cache->head);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void
+roscha_cache_destroy(struct roscha_cache *cache)
+{
+	roscha_cache_clear(cache);
+	hmap_free(cache->entries);
+	pthread_mutex_destroy(&cache->lock);
+	roscha_free(cache);
+}
@@ -0,0 +1,63 @@
+#include "escape.h"
+#include "simd.h"
+
+#include <stdint.h>
+#include <string.h>
+
+static const char *entities[256] = {
+	['&']  = "&amp;",
+	['<']  = "&lt;",
+	['>']  = "&gt;",
+	['"']  = "&quot;",
+	['\''] = "&#39;",
+};
+
+/* Index of the next character that needs escaping in s, or len */
+static inline size_t
+escape_scan(const char *s, size_t i, size_t len)
+{
+#ifdef SIMD_WIDTH
+	const simd_vec amp  = simd_set1('&');
+	const simd_vec lt   = simd_set1('<');
+	const simd_vec gt   = simd_set1('>');
+	const simd_vec quot = simd_set1('"');
+	const simd_vec apos = simd_set1('\'');
+	for (; i + SIMD_WIDTH <= len; i += SIMD_WIDTH) {
+		simd_vec chunk = simd_load(s + i);
+		simd_vec hits  = simd_or(simd_or(simd_eq(chunk, amp),
+		                                 simd_eq(chunk, lt)),
+		                         simd_or(simd_eq(chunk, gt),
+		                                 simd_or(simd_eq(chunk, quot),
+		                                         simd_eq(chunk, apos))));
+		uint32_t mask = simd_mask(hits);
+		if (mask) {
+			return i + simd_first(mask);
+		}
+	}
+#endif
+	for (; i < len; i++) {
+		if (entities[(unsigned char)s[i]]) break;
+	}
+	return i;
+}
+
+sds
+escape_html(sds str, const char *s, size_t len)
+{
+	/* Most values have nothing to escape, so reserve room for a plain copy */
+	str = sdsMakeRoomFor(str, len);
+
+	size_t i = 0;
+	while (i < len) {
+		size_t next = escape_scan(s, i, len);
+		if (next > i) {
+			str = sdscatlen(str, s + i, next - i);
+		}
+		if (next == len) break;
+		const char *ent = entities[(unsigned char)s[next]];
+		str             = sdscatlen(str, ent, strlen(ent));
+		i               = next + 1;
+	}
+
+	return str;
+}
@@ -0,0 +1,172 @@
+#include "filter.h"
+
+#include <ctype.h>
+#include <string.h>
+
+/*
+ * Most of the built-in filters concatenate the input to the output as is and
+ * then transform it in place, so no intermediate strings are allocated.
+ */
+static inline sds
+append_object(sds out, struct roscha_object *in, size_t *start)
+{
+	*start = sdslen(out);
+	return roscha_object_string(in, out);
+}
+
+static sds
+filter_upper(sds out, struct roscha_object *in, struct vector *args)
+{
+	if (args->len > 0) return NULL;
+	size_t start;
+	out = append_object(out, in, &start);
+	for (char *p = out + start, *end = out + sdslen(out); p < end; p++) {
+		if (*p >= 'a' && *p <= 'z') *p -= 'a' - 'A';
+	}
+	return out;
+}
+
+static sds
+filter_lower(sds out, struct roscha_object *in, struct vector *args)
+{
+	if (args->len > 0) return NULL;
+	size_t start;
+	out = append_object(out, in, &start);
+	for (char *p = out + start, *end = out + sdslen(out); p < end; p++) {
+		if (*p >= 'A' && *p <= 'Z') *p += 'a' - 'A';
+	}
+	return out;
+}
+
+static sds
+filter_trim(sds out, struct roscha_object *in, struct vector *args)
+{
+	if (args->len > 0) return NULL;
+	size_t start;
+	out = append_object(out, in, &start);
+	size_t len = sdslen(out), i = start, end = len;
+	while (i < end && isspace((unsigned char)out[i])) i++;
+	while (end > i && isspace((unsigned char)out[end - 1])) end--;
+	memmove(out + start, out + i, end - i);
+	sdsIncrLen(out, -(ssize_t)(len - start - (end - i)));
+	return out;
+}
+
+/* truncate(length=255, end="...") */
+static sds
+filter_truncate(sds out, struct roscha_object *in, struct vector *args)
+{
+	int64_t      max = 255;
+	struct slice end = slice_whole("...");
+	if (args->len > 2) return NULL;
+	if (args->len > 0) {
+		struct roscha_object *n = args->values[0];
+		if (n->type != ROSCHA_INT || n->integer < 0) return NULL;
+		max = n->integer;
+	}
+	if (args->len > 1 && !roscha_object_slice(args->values[1], &end)) {
+		return NULL;
+	}
+
+	size_t start;
+	out        = append_object(out, in, &start);
+	size_t len = sdslen(out) - start;
+	if (len <= (uint64_t)max) return out;
+	/* Don't cut UTF-8 sequences in half */
+	size_t cut = max;
+	while (cut > 0 && ((unsigned char)out[start + cut] & 0xC0) == 0x80) cut--;
+	sdsIncrLen(out, -(ssize_t)(len - cut));
+	return slice_string(&end, out);
+}
+
+/* replace(old, new) */
+static sds
+filter_replace(sds out, struct roscha_object *in, struct vector *args)
+{
+	struct slice old, new, str;
+	if (args->len != 2 || !roscha_object_slice(args->values[0], &old)
+	    || !roscha_object_slice(args->values[1], &new)) {
+		return NULL;
+	}
+	sds tmp = NULL;
+	if (!roscha_object_slice(in, &str)) {
+		tmp = roscha_object_string(in, sdsempty());
+		str = slice_new(tmp, 0, sdslen(tmp));
+	}
+
+	const char *s    = str.str + str.start;
+	const char *o    = old.str + old.start;
+	size_t      len  = slice_len(&str);
+	size_t      olen = slice_len(&old);
+	size_t      i = 0, run = 0;
+	while (olen > 0 && i + olen <= len) {
+		const char *hit = memchr(s + i, o[0], len - olen + 1 - i);
+		if (!hit) break;
+		i = hit - s;
+		if (memcmp(s + i, o, olen) == 0) {
+			out = sdscatlen(out, s + run, i - run);
+			out = slice_string(&new, out);
+			i += olen;
+			run = i;
+		} else {
+			i++;
+		}
+	}
+	out = sdscatlen(out, s + run, len - run);
+	if (tmp) sdsfree(tmp);
+
+	return out;
+}
+
+/* Number of characters of a string or items of a vector, map or range */
+static struct roscha_object *
+filter_length(struct roscha_object *in, struct vector *args)
+{
+	if (args->len > 0) return NULL;
+	struct slice str;
+	int64_t      len = 0;
+	if (roscha_object_slice(in, &str)) {
+		for (size_t i = str.start; i < str.end; i++) {
+			len += ((unsigned char)str.str[i] & 0xC0) != 0x80;
+		}
+	} else if (in->type == ROSCHA_VECTOR) {
+		len = in->vector->len;
+	} else if (in->type == ROSCHA_HMAP) {
+		len = in->hmap->size;
+	} else if (in->type == ROSCHA_RANGE) {
+		len = roscha_range_len(in);
+	} else if (in->type != ROSCHA_NULL) {
+		return NULL;
+	}
+
+	return roscha_object_new(len);
+}
+
+/* Only has an effect as the last filter of a {{ }} variable */
+static struct roscha_object *
+filter_safe(struct roscha_object *in, struct vector *args)
+{
+	if (args->len > 0) return NULL;
+	roscha_object_ref(in);
+	return in;
+}
+
+static const struct roscha_filter builtin_upper    = { .write = filter_upper };
+static const struct roscha_filter builtin_lower    = { .write = filter_lower };
+static const struct roscha_filter builtin_trim     = { .write = filter_trim };
+static const struct roscha_filter builtin_truncate = { .write = filter_truncate };
+static const struct roscha_filter builtin_replace  = { .write = filter_replace };
+static const struct roscha_filter builtin_length   = { .value = filter_length };
+static const struct roscha_filter builtin_safe     = { .value = filter_safe };
+
+void
+filter_add_builtins(struct hmap *filters)
+{
+	hmap_set(filters, "upper", (void *)&builtin_upper);
+	hmap_set(filters, "lower", (void *)&builtin_lower);
+	hmap_set(filters, "trim", (void *)&builtin_trim);
+	hmap_set(filters, "truncate", (void *)&builtin_truncate);
+	hmap_set(filters, "replace", (void *)&builtin_replace);
+	hmap_set(filters, "length", (void *)&builtin_length);
+	hmap_set(filters, "safe", (void *)&builtin_safe);
+}
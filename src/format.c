@@ -0,0 +1,58 @@
+#include "format.h"
+
+#include <string.h>
+
+static const char digit_pairs[] = "00010203040506070809"
+                                  "10111213141516171819"
+                                  "20212223242526272829"
+                                  "30313233343536373839"
+                                  "40414243444546474849"
+                                  "50515253545556575859"
+                                  "60616263646566676869"
+                                  "70717273747576777879"
+                                  "80818283848586878889"
+                                  "90919293949596979899";
+
+unsigned
+format_digits(uint64_t val)
+{
+	unsigned n = 1;
+	for (;;) {
+		if (val < 10) return n;
+		if (val < 100) return n + 1;
+		if (val < 1000) return n + 2;
+		if (val < 10000) return n + 3;
+		val /= 10000;
+		n += 4;
+	}
+}
+
+sds
+format_int(sds str, int64_t val)
+{
+	/* Negate as unsigned so that INT64_MIN doesn't overflow */
+	uint64_t u      = val < 0 ? -(uint64_t)val : (uint64_t)val;
+	size_t   neg    = val < 0;
+	size_t   ndigit = format_digits(u);
+
+	str     = sdsMakeRoomFor(str, neg + ndigit);
+	char *p = str + sdslen(str) + neg + ndigit;
+	while (u >= 100) {
+		size_t i = (u % 100) * 2;
+		u /= 100;
+		p -= 2;
+		memcpy(p, digit_pairs + i, 2);
+	}
+	if (u >= 10) {
+		p -= 2;
+		memcpy(p, digit_pairs + u * 2, 2);
+	} else {
+		*--p = '0' + u;
+	}
+	if (neg) {
+		*--p = '-';
+	}
+	sdsIncrLen(str, neg + ndigit);
+
+	return str;
+}
@@ -1,4 +1,5 @@
 #include "hmap.h"
+#include "alloc.h"
 #include "slice.h"
 
 #include <inttypes.h>
@@ -6,58 +7,141 @@
 #include <stdlib.h>
 #include <err.h>
 
-#if SIZE_MAX == 0xFFFFFFFF
-/* If size_t is 32bit */
-static const size_t fnv_prime   = 16777619u;
-static const size_t fnv_offsetb = 2166136261u;
-#elif SIZE_MAX == 0xFFFFFFFFFFFFFFFF
-/* If size_t is 64bit */
-static const size_t fnv_prime   = 1099511628211u;
-static const size_t fnv_offsetb = 14695981039346656037u;
-#else
-/* If size_t is 128bit. Maybe this is overdoing it? */
-static const size_t fnv_prime   = 309485009821345068724781371u;
-static const size_t fnv_offsetb = 144066263297769815596495629667062367629u;
-#endif
-
-struct hnode {
-	struct slice  key;
-	void         *value;
-	struct hnode *next;
-};
+/* Values of the index table slots that don't point to an entry */
+#define SLOT_EMPTY   0
+#define SLOT_DELETED 1
+#define SLOT_OFFSET  2
+
+/* Smallest index table; has room for 5 entries */
+#define HMAP_MIN_CAP 8
+
+/* Number of entries that fit in a map with an index table of cap slots */
+#define hmap_usable(cap) ((cap) - (cap) / 3)
 
-struct hmap_iter {
-	struct hmap  *map;
-	size_t        index;
-	size_t        count;
-	struct hnode *cur;
+struct hentry {
+	/* NULL str if the entry has been removed */
+	struct slice key;
+	void        *value;
+	size_t       hash;
 };
 
-/* FNV1a */
+static inline size_t
+round_cap(size_t cap)
+{
+	size_t n = HMAP_MIN_CAP;
+	while (n < cap) {
+		n <<= 1;
+	}
+	return n;
+}
+
+/*
+ * Find the index table slot of key. If the key is not in the map, returns the
+ * slot where it should be inserted, i.e. the first deleted slot in the probe
+ * sequence or else the empty slot that terminated it.
+ */
 static size_t
-hash_slice(const struct slice *slice)
+hmap_find_slot(const struct hmap *hm, const struct slice *key, size_t hash)
 {
-	size_t hash = fnv_offsetb;
-	size_t i    = slice->start;
-	while (i < slice->end) {
-		hash ^= slice->str[i];
-		hash *= fnv_prime;
-		i++;
+	size_t mask    = hm->cap - 1;
+	size_t i       = hash & mask;
+	size_t perturb = hash;
+	size_t tomb    = SIZE_MAX;
+
+	for (;;) {
+		uint32_t slot = hm->index[i];
+		if (slot == SLOT_EMPTY) {
+			return tomb != SIZE_MAX ? tomb : i;
+		}
+		if (slot == SLOT_DELETED) {
+			if (tomb == SIZE_MAX) tomb = i;
+		} else {
+			struct hentry *e = &hm->entries[slot - SLOT_OFFSET];
+			if (e->hash == hash && slice_eq(&e->key, key)) {
+				return i;
+			}
+		}
+		perturb >>= 5;
+		i = (i * 5 + 1 + perturb) & mask;
 	}
+}
 
-	return hash;
+static inline struct hentry *
+hmap_slot_entry(const struct hmap *hm, size_t i)
+{
+	uint32_t slot = hm->index[i];
+	if (slot < SLOT_OFFSET) return NULL;
+	return &hm->entries[slot - SLOT_OFFSET];
+}
+
+/*
+ * Rebuild the map with an index table big enough for the current number of
+ * key-value pairs to double, dropping the tombstones. The existing arrays are
+ * reallocated rather than replaced so that they stay with the allocator that
+ * owns them.
+ */
+static bool
+hmap_resize(struct hmap *hm)
+{
+	size_t cap = HMAP_MIN_CAP;
+	while (hmap_usable(cap) <= hm->size * 2) {
+		cap <<= 1;
+	}
+
+	if (cap > hm->cap) {
+		struct hentry *entries = roscha_realloc(
+			hm->entries, hmap_usable(cap) * sizeof(*entries));
+		if (entries == NULL) return false;
+		hm->entries = entries;
+	}
+	if (cap != hm->cap) {
+		uint32_t *index = roscha_realloc(hm->index, cap * sizeof(*index));
+		if (index == NULL) return false;
+		hm->index = index;
+	}
+	memset(hm->index, 0, cap * sizeof(*hm->index));
+
+	size_t mask = cap - 1;
+	size_t len  = 0;
+	for (size_t j = 0; j < hm->len; j++) {
+		struct hentry *e = &hm->entries[j];
+		if (e->key.str == NULL) continue;
+		size_t i       = e->hash & mask;
+		size_t perturb = e->hash;
+		while (hm->index[i] != SLOT_EMPTY) {
+			perturb >>= 5;
+			i = (i * 5 + 1 + perturb) & mask;
+		}
+		hm->index[i]       = len + SLOT_OFFSET;
+		hm->entries[len++] = *e;
+	}
+
+	if (cap < hm->cap) {
+		struct hentry *entries = roscha_realloc(
+			hm->entries, hmap_usable(cap) * sizeof(*entries));
+		if (entries != NULL) hm->entries = entries;
+	}
+	hm->cap  = cap;
+	hm->len  = len;
+	hm->fill = len;
+	return true;
 }
 
 struct hmap *
 hmap_new_with_cap(size_t cap)
 {
-	struct hmap *hm = malloc(sizeof *hm);
-	hm->cap         = cap;
-	hm->size        = 0;
+	struct hmap *hm = roscha_malloc(sizeof *hm);
 	if (hm == NULL) return NULL;
-	hm->buckets = calloc(cap, sizeof hm->buckets);
-	if (hm->buckets == NULL) {
-		free(hm);
+	hm->cap     = round_cap(cap);
+	hm->len     = 0;
+	hm->fill    = 0;
+	hm->size    = 0;
+	hm->index   = roscha_calloc(hm->cap, sizeof(*hm->index));
+	hm->entries = roscha_malloc(hmap_usable(hm->cap) * sizeof(*hm->entries));
+	if (hm->index == NULL || hm->entries == NULL) {
+		roscha_free(hm->index);
+		roscha_free(hm->entries);
+		roscha_free(hm);
 		return NULL;
 	}
 
@@ -67,40 +151,40 @@ hmap_new_with_cap(size_t cap)
 void *
 hmap_sets(struct hmap *hm, struct slice key, void *value)
 {
-	int           pos       = hash_slice(&key) % hm->cap;
-	struct hnode *head      = hm->buckets[pos];
-	struct hnode *node      = head;
-	void         *old_value = NULL;
-
-	while (node) {
-		if (slice_cmp(&node->key, &key) == 0) {
-			old_value   = node->value;
-			node->value = value;
-			return old_value;
-		}
-		node = node->next;
+	size_t         hash = slice_hash(&key);
+	size_t         i    = hmap_find_slot(hm, &key, hash);
+	struct hentry *e    = hmap_slot_entry(hm, i);
+
+	if (e) {
+		void *old_value = e->value;
+		e->value        = value;
+		return old_value;
+	}
+
+	size_t usable = hmap_usable(hm->cap);
+	if (hm->len >= usable || hm->fill >= usable) {
+		if (!hmap_resize(hm)) return NULL;
+		i = hmap_find_slot(hm, &key, hash);
 	}
 
-	node             = malloc(sizeof *node);
-	node->key        = key;
-	node->value      = value;
-	node->next       = head;
-	hm->buckets[pos] = node;
+	if (hm->index[i] == SLOT_EMPTY) hm->fill++;
+	e            = &hm->entries[hm->len];
+	e->key       = key;
+	e->value     = value;
+	e->hash      = hash;
+	hm->index[i] = hm->len + SLOT_OFFSET;
+	hm->len++;
 	hm->size++;
-	return old_value;
+	return NULL;
 }
 
 void *
 hmap_gets(struct hmap *hm, const struct slice *key)
 {
-	size_t        pos  = hash_slice(key) % hm->cap;
-	struct hnode *node = hm->buckets[pos];
-	while (node != NULL) {
-		if (slice_cmp(&node->key, key) == 0) {
-			return node->value;
-		}
-
-		node = node->next;
+	size_t         hash = slice_hash(key);
+	struct hentry *e    = hmap_slot_entry(hm, hmap_find_slot(hm, key, hash));
+	if (e) {
+		return e->value;
 	}
 
 	return NULL;
@@ -116,29 +200,26 @@ hmap_get(struct hmap *hm, const char *k)
 void *
 hmap_removes(struct hmap *hm, const struct slice *key)
 {
-	int           pos  = hash_slice(key) % hm->cap;
-	struct hnode *node = hm->buckets[pos];
-	struct hnode *prev = NULL;
-	void         *old_value;
-
-	while (node) {
-		if (slice_cmp(&node->key, key) == 0) {
-			if (prev) {
-				prev->next = node->next;
-			} else {
-				hm->buckets[pos] = node->next;
-			}
-			old_value = node->value;
-			free(node);
-			hm->size--;
-			return old_value;
-		}
-
-		prev = node;
-		node = node->next;
+	size_t         hash = slice_hash(key);
+	size_t         i    = hmap_find_slot(hm, key, hash);
+	struct hentry *e    = hmap_slot_entry(hm, i);
+	if (!e) {
+		return NULL;
 	}
 
-	return NULL;
+	void *old_value = e->value;
+	e->key.str      = NULL;
+	e->value        = NULL;
+	hm->index[i]    = SLOT_DELETED;
+	hm->size--;
+	/*
+	 * Reclaim trailing tombstones, so that repeatedly setting and removing a
+	 * key, e.g. a loop variable, doesn't keep growing the entries.
+	 */
+	while (hm->len > 0 && hm->entries[hm->len - 1].key.str == NULL) {
+		hm->len--;
+	}
+	return old_value;
 }
 
 void *
@@ -149,74 +230,57 @@ hmap_remove(struct hmap *hm, const char *k)
 }
 
 #define HMAP_WALK(hm, ...)                 \
-	struct hnode *node;                    \
-	struct hnode *next;                    \
-	for (size_t i = 0; i < hm->cap; i++) { \
-		node = hm->buckets[i];             \
-		while (node) {                     \
-			next = node->next;             \
-			__VA_ARGS__;                   \
-			node = next;                   \
+	struct hentry *entry;                  \
+	for (size_t i = 0; i < hm->len; i++) { \
+		entry = &hm->entries[i];           \
+		if (entry->key.str == NULL) {      \
+			continue;                      \
 		}                                  \
+		__VA_ARGS__;                       \
 	}
 
 void
 hmap_walk(struct hmap *hm, hmap_cb cb)
 {
-	HMAP_WALK(hm, cb(&node->key, node->value));
+	HMAP_WALK(hm, cb(&entry->key, entry->value));
 }
 
-struct hmap_iter *
-hmap_iter_new(struct hmap *hm)
+void
+hmap_iter_init(struct hmap_iter *iter, struct hmap *hm)
 {
-	struct hmap_iter *iter = malloc(sizeof(*iter));
-	iter->map              = hm;
-	iter->index            = 0;
-	iter->count            = hm->size;
-	iter->cur              = NULL;
-
-	return iter;
+	iter->map   = hm;
+	iter->index = 0;
 }
 
 bool
 hmap_iter_next(struct hmap_iter *iter, const struct slice **key, void **value)
 {
-	if (iter->count < 1) return false;
-
-	if (!iter->cur || !iter->cur->next) {
-		do {
-			iter->cur = iter->map->buckets[iter->index++];
-		} while (!iter->cur);
-	} else {
-		iter->cur = iter->cur->next;
+	struct hmap *hm = iter->map;
+	while (iter->index < hm->len) {
+		struct hentry *e = &hm->entries[iter->index++];
+		if (e->key.str == NULL) continue;
+		*key   = &e->key;
+		*value = e->value;
+		return true;
 	}
-	*key   = &iter->cur->key;
-	*value = iter->cur->value;
-	iter->count--;
 
-	return true;
-}
-
-void
-hmap_iter_free(struct hmap_iter *iter)
-{
-	free(iter);
+	return false;
 }
 
 void
 hmap_destroy(struct hmap *hm, hmap_cb cb)
 {
-	HMAP_WALK(hm, cb(&node->key, node->value), free(node));
+	HMAP_WALK(hm, cb(&entry->key, entry->value));
 
-	free(hm->buckets);
-	free(hm);
+	roscha_free(hm->index);
+	roscha_free(hm->entries);
+	roscha_free(hm);
 }
 
 void
 hmap_free(struct hmap *hm)
 {
-	HMAP_WALK(hm, free(node));
-
-	free(hm->buckets);
-	free(hm);
+	roscha_free(hm->index);
+	roscha_free(hm->entries);
+	roscha_free(hm);
 }
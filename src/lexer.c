@@ -1,15 +1,164 @@
 #include "lexer.h"
+#include "alloc.h"
+#include "simd.h"
 #include "token.h"
+#include "sds/sds.h"
 
-#include <ctype.h>
+#include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
-static bool
-isidentc(char c)
+/* Character classes, looked up in char_class */
+#define CHAR_IDENT 0x1
+#define CHAR_DIGIT 0x2
+#define CHAR_SPACE 0x4
+
+#define I CHAR_IDENT
+#define D CHAR_DIGIT
+#define S CHAR_SPACE
+/* Bytes 0x80 and up are all 0 */
+static const unsigned char char_class[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, S, S, S, S, S, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	S, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	D, D, D, D, D, D, D, D, D, D, 0, 0, 0, 0, 0, 0,
+	0, I, I, I, I, I, I, I, I, I, I, I, I, I, I, I,
+	I, I, I, I, I, I, I, I, I, I, I, 0, 0, 0, 0, I,
+	0, I, I, I, I, I, I, I, I, I, I, I, I, I, I, I,
+	I, I, I, I, I, I, I, I, I, I, I, 0, 0, 0, 0, 0,
+};
+#undef I
+#undef D
+#undef S
+
+#define char_is(c, class) (char_class[(unsigned char)(c)] & (class))
+
+/* How far back and ahead of the current char a streaming lexer looks */
+#define LEXER_HISTORY   2
+#define LEXER_LOOKAHEAD 3
+/* Smallest stream buffer, and the size of the literal pool chunks */
+#define LEXER_MIN_BUFSIZE 16
+#define LEXER_POOL_CHUNK  4096
+
+/*
+ * Read from the stream until there are at least want bytes in buf or the input
+ * ends, growing buf if it is already full.
+ */
+static void
+lexer_fill(struct lexer *lexer, size_t want)
+{
+	while (!lexer->eof && lexer->len < want) {
+		if (lexer->len == lexer->cap) {
+			lexer->cap     *= 2;
+			lexer->buf      = roscha_realloc(lexer->buf, lexer->cap + 1);
+			lexer->input    = lexer->buf;
+			lexer->word.str = lexer->buf;
+		}
+		ssize_t n = lexer->read(lexer->ctx, lexer->buf + lexer->len,
+		                        lexer->cap - lexer->len);
+		if (n <= 0) {
+			lexer->eof        = true;
+			lexer->read_error = n < 0;
+			break;
+		}
+		lexer->len += n;
+	}
+	lexer->buf[lexer->len] = '\0';
+}
+
+/*
+ * Called between tokens; once less than half of buf is left to tokenize, drop
+ * the consumed input and read as much as fits.
+ */
+static void
+lexer_refill(struct lexer *lexer)
+{
+	if (lexer->eof || lexer->len - lexer->word.start >= lexer->cap / 2) {
+		return;
+	}
+	size_t drop = 0;
+	if (lexer->word.start > LEXER_HISTORY) {
+		drop = lexer->word.start - LEXER_HISTORY;
+	}
+	memmove(lexer->buf, lexer->buf + drop, lexer->len - drop);
+	lexer->len        -= drop;
+	lexer->word.start -= drop;
+	lexer->word.end   -= drop;
+	lexer_fill(lexer, lexer->cap);
+}
+
+/*
+ * Copy the literal to the pool so it outlives the stream buffer, preceded by
+ * the char prev unless it is negative. Every copy is NUL terminated.
+ */
+static void
+lexer_keep(struct lexer *lexer, struct slice *lit, int prev)
+{
+	assert(lit->end >= lit->start);
+	size_t skip  = prev >= 0;
+	size_t len   = lit->end - lit->start;
+	sds    chunk = NULL;
+	if (lexer->pool->len > 0) {
+		chunk = lexer->pool->values[lexer->pool->len - 1];
+	}
+	if (chunk == NULL || sdsavail(chunk) < skip + len + 1) {
+		size_t size = skip + len + 1;
+		if (size < LEXER_POOL_CHUNK) {
+			size = LEXER_POOL_CHUNK;
+		}
+		chunk = sdsMakeRoomFor(sdsempty(), size);
+		vector_push(lexer->pool, chunk);
+	}
+	size_t at = sdslen(chunk);
+	if (skip) {
+		chunk[at] = prev;
+	}
+	memcpy(chunk + at + skip, lit->str + lit->start, len);
+	sdsIncrLen(chunk, skip + len + 1);
+	chunk[at + skip + len] = '\0';
+
+	lit->str   = chunk;
+	lit->start = at + skip;
+	lit->end   = at + skip + len;
+}
+
+/*
+ * Make a streamed token independent of buf. Only literals coming from the
+ * source are copied; the rest have fixed spellings.
+ */
+static void
+lexer_keep_literal(struct lexer *lexer, struct token *token)
 {
-	return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_';
+	struct slice *lit = &token->literal;
+	switch (token->type) {
+	case TOKEN_EOF:
+		break;
+	case TOKEN_CONTENT: {
+		/*
+		 * lstrip_blocks looks at the char before the content, which is
+		 * kept too; a newline stands in for the start of the input.
+		 */
+		char prev = '\n';
+		if (lit->start > 0) {
+			prev = lit->str[lit->start - 1];
+		}
+		lexer_keep(lexer, lit, (unsigned char)prev);
+		break;
+	}
+	case TOKEN_ILLEGAL:
+	case TOKEN_IDENT:
+	case TOKEN_INT:
+	case TOKEN_STRING:
+		lexer_keep(lexer, lit, -1);
+		break;
+	case TOKEN_TRIM:
+		*lit = slice_whole("-");
+		break;
+	default:
+		*lit = slice_whole(token_type_print(token->type));
+	}
 }
 
 static void
@@ -47,8 +196,14 @@ static inline void
 lexer_read_char(struct lexer *lexer)
 {
 	lexer->word.start = lexer->word.end;
-	if (lexer->word.end > lexer->len) {
-		lexer->word.end = 0;
+	if (lexer->read != NULL
+	    && lexer->word.start + LEXER_LOOKAHEAD > lexer->len) {
+		lexer_fill(lexer, lexer->word.start + LEXER_LOOKAHEAD);
+	}
+	if (lexer->word.start > lexer->len) {
+		/* Stay on the NUL at the end of the input */
+		lexer->word.start = lexer->len;
+		lexer->word.end   = lexer->len + 1;
 		return;
 	}
 	char prevc = lexer_peek_prev_char(lexer);
@@ -63,12 +218,12 @@ lexer_read_char(struct lexer *lexer)
 static void
 lexer_read_ident(struct lexer *lexer, struct token *token)
 {
-	size_t start       = lexer->word.start;
-	token->literal.str = lexer->input;
-	while (isidentc(lexer->input[lexer->word.start])
-	       || isdigit(lexer->input[lexer->word.start])) {
+	size_t start = lexer->word.start;
+	while (char_is(lexer->input[lexer->word.start], CHAR_IDENT | CHAR_DIGIT)) {
 		lexer_read_char(lexer);
 	}
+	/* reading may have moved a streamed input */
+	token->literal.str   = lexer->input;
 	token->literal.start = start;
 	token->literal.end   = lexer->word.start;
 }
@@ -76,11 +231,12 @@ lexer_read_ident(struct lexer *lexer, struct token *token)
 static void
 lexer_read_num(struct lexer *lexer, struct token *token)
 {
-	size_t start       = lexer->word.start;
-	token->literal.str = lexer->input;
-	while (isdigit(lexer->input[lexer->word.start])) {
+	size_t start = lexer->word.start;
+	while (char_is(lexer->input[lexer->word.start], CHAR_DIGIT)) {
 		lexer_read_char(lexer);
 	}
+	/* reading may have moved a streamed input */
+	token->literal.str   = lexer->input;
 	token->literal.start = start;
 	token->literal.end   = lexer->word.start;
 }
@@ -88,33 +244,130 @@ lexer_read_num(struct lexer *lexer, struct token *token)
 static void
 lexer_read_string(struct lexer *lexer, struct token *token)
 {
-	size_t start       = lexer->word.start;
-	token->literal.str = lexer->input;
+	size_t start = lexer->word.start;
 	lexer_read_char(lexer);
 	while (lexer->input[lexer->word.start] != '"' && lexer->input[lexer->word.start] != '\0') {
 		lexer_read_char(lexer);
 	}
 	lexer_read_char(lexer);
+	/* reading may have moved a streamed input */
+	token->literal.str   = lexer->input;
 	token->literal.start = start;
 	token->literal.end   = lexer->word.start;
 }
 
+/*
+ * Find the next '{' in s starting from i, or len if there is none. Counts the
+ * newlines before it in nlines, and sets lastnl to the index of the last one.
+ */
+static size_t
+scan_content(const char *s, size_t i, size_t len, size_t *nlines,
+             size_t *lastnl)
+{
+	size_t lines = 0;
+#ifdef SIMD_WIDTH
+	const simd_vec brace = simd_set1('{');
+	const simd_vec nl    = simd_set1('\n');
+	for (; i + SIMD_WIDTH <= len; i += SIMD_WIDTH) {
+		simd_vec chunk = simd_load(s + i);
+		uint32_t bmask = simd_mask(simd_eq(chunk, brace));
+		uint32_t nmask = simd_mask(simd_eq(chunk, nl));
+		if (bmask) {
+			unsigned b = simd_first(bmask);
+			nmask &= (1u << b) - 1;
+			if (nmask) {
+				lines += simd_count(nmask);
+				*lastnl = i + simd_last(nmask);
+			}
+			*nlines = lines;
+			return i + b;
+		}
+		if (nmask) {
+			lines += simd_count(nmask);
+			*lastnl = i + simd_last(nmask);
+		}
+	}
+#endif
+	for (; i < len && s[i] != '{'; i++) {
+		if (s[i] == '\n') {
+			lines++;
+			*lastnl = i;
+		}
+	}
+	*nlines = lines;
+	return i;
+}
+
+/*
+ * Skip over the content up to the next '{' at once, updating the line and
+ * column just like reading it char by char with lexer_read_char would.
+ */
 static void
 lexer_read_content(struct lexer *lexer, struct token *token)
 {
-	size_t start       = lexer->word.start;
-	token->literal.str = lexer->input;
-	while (lexer->input[lexer->word.start] != '{' && lexer->input[lexer->word.start] != '\0') {
-		lexer_read_char(lexer);
+	size_t start = lexer->word.start;
+	size_t lines, lastnl = 0;
+	size_t end = scan_content(lexer->input, start, lexer->len, &lines, &lastnl);
+
+	while (end == lexer->len && lexer->read != NULL && !lexer->eof) {
+		/*
+		 * The content goes on past buf; end this run after its last
+		 * non-space char, so whitespace control never has to look at more
+		 * than one of them.
+		 */
+		size_t cut = end;
+		while (cut > start && char_is(lexer->input[cut - 1], CHAR_SPACE)) {
+			cut--;
+		}
+		if (cut > start) {
+			end = scan_content(lexer->input, start, cut, &lines, &lastnl);
+			break;
+		}
+		/*
+		 * Only whitespace so far; read more, growing buf if needed, so that
+		 * the whole run is one token that whitespace control trims whole.
+		 */
+		size_t more;
+		size_t want = lexer->len < lexer->cap ? lexer->cap : lexer->cap + 1;
+		lexer_fill(lexer, want);
+		end = scan_content(lexer->input, end, lexer->len, &more, &lastnl);
+		lines += more;
 	}
+	/* lexer_read_char never looks at a newline at the very start */
+	if (start == 0 && lines > 0 && lexer->input[0] == '\n') {
+		lines--;
+	}
+	if (lines > 0) {
+		lexer->line += lines;
+		lexer->column = end - lastnl;
+	} else {
+		lexer->column += end - start;
+	}
+	lexer->word.start = end;
+	lexer->word.end   = end + 1;
+
+	token->literal.str   = lexer->input;
 	token->literal.start = start;
-	token->literal.end   = lexer->word.start;
+	token->literal.end   = end;
+}
+
+/* Whether the current '-' is a whitespace control marker like {%- or -}} */
+static bool
+lexer_at_trim(struct lexer *lexer)
+{
+	const char *in = lexer->input;
+	size_t      i  = lexer->word.start;
+	if (i >= 2 && in[i - 2] == '{' && (in[i - 1] == '{' || in[i - 1] == '%')) {
+		return true;
+	}
+
+	return (in[i + 1] == '}' || in[i + 1] == '%') && in[i + 2] == '}';
 }
 
 static void
 lexer_eatspace(struct lexer *lexer)
 {
-	while (isspace(lexer->input[lexer->word.start])) {
+	while (char_is(lexer->input[lexer->word.start], CHAR_SPACE)) {
 		lexer_read_char(lexer);
 	}
 }
@@ -122,7 +375,7 @@ lexer_eatspace(struct lexer *lexer)
 struct lexer *
 lexer_new(const char *input)
 {
-	struct lexer *lexer = malloc(sizeof(*lexer));
+	struct lexer *lexer = roscha_calloc(1, sizeof(*lexer));
 	lexer->input        = input;
 	lexer->len          = strlen(lexer->input);
 	lexer->word.str     = lexer->input;
@@ -136,8 +389,45 @@ lexer_new(const char *input)
 	return lexer;
 }
 
+struct lexer *
+lexer_new_stream(lexer_read_f read, void *ctx, size_t bufsize)
+{
+	if (bufsize < LEXER_MIN_BUFSIZE) {
+		bufsize = LEXER_MIN_BUFSIZE;
+	}
+	struct lexer *lexer = roscha_calloc(1, sizeof(*lexer));
+	lexer->read         = read;
+	lexer->ctx          = ctx;
+	lexer->cap          = bufsize;
+	lexer->buf          = roscha_malloc(bufsize + 1);
+	lexer->input        = lexer->buf;
+	lexer->word.str     = lexer->buf;
+	lexer->in_content   = true;
+	lexer->line         = 1;
+	lexer->pool         = vector_new();
+	lexer_fill(lexer, bufsize);
+	lexer_read_char(lexer);
+
+	return lexer;
+}
+
+static struct token lexer_scan_token(struct lexer *);
+
 struct token
 lexer_next_token(struct lexer *lexer)
+{
+	if (lexer->read == NULL) {
+		return lexer_scan_token(lexer);
+	}
+	lexer_refill(lexer);
+	struct token token = lexer_scan_token(lexer);
+	lexer_keep_literal(lexer, &token);
+
+	return token;
+}
+
+static struct token
+lexer_scan_token(struct lexer *lexer)
 {
 	struct token token = {.line = lexer->line, .column = lexer->column};
 	char         c     = lexer->input[lexer->word.start];
@@ -155,6 +445,11 @@ lexer_next_token(struct lexer *lexer)
 
 	lexer_eatspace(lexer);
 	c = lexer->input[lexer->word.start];
+	if (c == '\0') {
+		/* The input ended inside a tag */
+		set_token(&token, TOKEN_EOF, NULL);
+		return token;
+	}
 	switch (c) {
 	case '=':
 		if (lexer_peek_char(lexer) == '=') {
@@ -168,7 +463,11 @@ lexer_next_token(struct lexer *lexer)
 		set_token(&token, TOKEN_PLUS, &lexer->word);
 		break;
 	case '-':
-		set_token(&token, TOKEN_MINUS, &lexer->word);
+		if (lexer_at_trim(lexer)) {
+			set_token(&token, TOKEN_TRIM, &lexer->word);
+		} else {
+			set_token(&token, TOKEN_MINUS, &lexer->word);
+		}
 		break;
 	case '!':
 		if (lexer_peek_char(lexer) == '=') {
@@ -233,16 +532,19 @@ lexer_next_token(struct lexer *lexer)
 	case '%':
 		set_token(&token, TOKEN_PERCENT, &lexer->word);
 		break;
+	case '|':
+		set_token(&token, TOKEN_PIPE, &lexer->word);
+		break;
 	default:
 		if (c == '"') {
 			lexer_read_string(lexer, &token);
 			token.type = TOKEN_STRING;
 			return token;
-		} else if (isidentc(c)) {
+		} else if (char_is(c, CHAR_IDENT)) {
 			lexer_read_ident(lexer, &token);
 			token.type = token_lookup_ident(&token.literal);
 			return token;
-		} else if (isdigit(c)) {
+		} else if (char_is(c, CHAR_DIGIT)) {
 			lexer_read_num(lexer, &token);
 			token.type = TOKEN_INT;
 			return token;
@@ -258,5 +560,14 @@ lexer_next_token(struct lexer *lexer)
 void
 lexer_destroy(struct lexer *lexer)
 {
-	free(lexer);
+	if (lexer->pool != NULL) {
+		size_t i;
+		sds    chunk;
+		vector_foreach (lexer->pool, i, chunk) {
+			sdsfree(chunk);
+		}
+		vector_free(lexer->pool);
+	}
+	roscha_free(lexer->buf);
+	roscha_free(lexer);
 }
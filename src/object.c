@@ -1,4 +1,8 @@
 #include "object.h"
+#include "alloc.h"
+#include "format.h"
+
+#include <string.h>
 
 static const char *roscha_types[] = {
 	[ROSCHA_NULL]   = "null",
@@ -6,8 +10,10 @@ static const char *roscha_types[] = {
 	[ROSCHA_BOOL]   = "bool",
 	[ROSCHA_STRING] = "string",
 	[ROSCHA_SLICE]  = "slice",
+	[ROSCHA_SSTR]   = "string",
 	[ROSCHA_VECTOR] = "vector",
 	[ROSCHA_HMAP]   = "hashmap",
+	[ROSCHA_RANGE]  = "range",
 };
 
 extern inline const char *
@@ -50,9 +56,12 @@ hmap_string(struct hmap *map, sds str)
 	str = sdscat(str, "{ ");
 	const struct slice *key;
 	void               *val;
-	struct hmap_iter   *iter = hmap_iter_new(map);
-	hmap_iter_foreach (iter, &key, &val) {
-		str                             = sdscatfmt(str, "\"%s\": ", key->str);
+	struct hmap_iter    iter;
+	hmap_iter_init(&iter, map);
+	hmap_iter_foreach (&iter, &key, &val) {
+		str                             = sdscat(str, "\"");
+		str                             = slice_string(key, str);
+		str                             = sdscat(str, "\": ");
 		const struct roscha_object *obj = val;
 		str                             = roscha_object_string(obj, str);
 		str                             = sdscat(str, ", ");
@@ -71,25 +80,62 @@ roscha_object_string(const struct roscha_object *obj, sds str)
 	case ROSCHA_BOOL:
 		return bool_string(obj->boolean, str);
 	case ROSCHA_INT:
-		return sdscatfmt(str, "%I", obj->integer);
+		return format_int(str, obj->integer);
 	case ROSCHA_STRING:
 		return sdscat(str, obj->string);
 	case ROSCHA_SLICE:
 		return slice_string(&obj->slice, str);
+	case ROSCHA_SSTR:
+		return sdscatlen(str, obj->sstr.str, obj->sstr.len);
 	case ROSCHA_VECTOR:
 		return vector_string(obj->vector, str);
 	case ROSCHA_HMAP:
 		return hmap_string(obj->hmap, str);
+	case ROSCHA_RANGE:
+		str = sdscat(str, "range(");
+		str = format_int(str, obj->range.start);
+		str = sdscat(str, ", ");
+		str = format_int(str, obj->range.stop);
+		str = sdscat(str, ", ");
+		str = format_int(str, obj->range.step);
+		return sdscat(str, ")");
 	}
 	return str;
 }
 
+bool
+roscha_object_slice(const struct roscha_object *obj, struct slice *s)
+{
+	switch (obj->type) {
+	case ROSCHA_STRING:
+		slice_set(s, obj->string, 0, sdslen(obj->string));
+		return true;
+	case ROSCHA_SLICE:
+		slice_cpy(s, &obj->slice);
+		return true;
+	case ROSCHA_SSTR:
+		slice_set(s, obj->sstr.str, 0, obj->sstr.len);
+		return true;
+	default:
+		return false;
+	}
+}
+
+static inline struct roscha_object *
+roscha_object_alloc(enum roscha_type type)
+{
+	struct roscha_object *obj = roscha_malloc(sizeof(*obj));
+	obj->type                 = type;
+	obj->heap                 = roscha_heap_current() != NULL;
+	obj->safe                 = false;
+	obj->refcount             = 1;
+	return obj;
+}
+
 struct roscha_object *
 roscha_object_new_int(int64_t val)
 {
-	struct roscha_object *obj = malloc(sizeof(*obj));
-	obj->type                 = ROSCHA_INT;
-	obj->refcount             = 1;
+	struct roscha_object *obj = roscha_object_alloc(ROSCHA_INT);
 	obj->integer              = val;
 	return obj;
 }
@@ -97,9 +143,7 @@ roscha_object_new_int(int64_t val)
 struct roscha_object *
 roscha_object_new_slice(struct slice s)
 {
-	struct roscha_object *obj = malloc(sizeof(*obj));
-	obj->type                 = ROSCHA_SLICE;
-	obj->refcount             = 1;
+	struct roscha_object *obj = roscha_object_alloc(ROSCHA_SLICE);
 	obj->slice                = s;
 	return obj;
 }
@@ -107,19 +151,30 @@ roscha_object_new_slice(struct slice s)
 struct roscha_object *
 roscha_object_new_string(sds str)
 {
-	struct roscha_object *obj = malloc(sizeof(*obj));
-	obj->type                 = ROSCHA_STRING;
-	obj->refcount             = 1;
+	struct roscha_object *obj = roscha_object_alloc(ROSCHA_STRING);
 	obj->string               = str;
 	return obj;
 }
 
+struct roscha_object *
+roscha_object_new_sstr(const char *str, size_t len)
+{
+	if (len > ROSCHA_SSTR_CAP) {
+		return roscha_object_new_string(sdsnewlen(str, len));
+	}
+	struct roscha_object *obj = roscha_object_alloc(ROSCHA_SSTR);
+	/* zeroed first so that an empty short string is falsy */
+	obj->boolean  = 0;
+	obj->sstr.len = len;
+	memcpy(obj->sstr.str, str, len);
+	obj->sstr.str[len] = '\0';
+	return obj;
+}
+
 struct roscha_object *
 roscha_object_new_vector(struct vector *vec)
 {
-	struct roscha_object *obj = malloc(sizeof(*obj));
-	obj->type                 = ROSCHA_VECTOR;
-	obj->refcount             = 1;
+	struct roscha_object *obj = roscha_object_alloc(ROSCHA_VECTOR);
 	obj->vector               = vec;
 	return obj;
 }
@@ -127,13 +182,37 @@ roscha_object_new_vector(struct vector *vec)
 struct roscha_object *
 roscha_object_new_hmap(struct hmap *map)
 {
-	struct roscha_object *obj = malloc(sizeof(*obj));
-	obj->type                 = ROSCHA_HMAP;
-	obj->refcount             = 1;
+	struct roscha_object *obj = roscha_object_alloc(ROSCHA_HMAP);
 	obj->hmap                 = map;
 	return obj;
 }
 
+struct roscha_object *
+roscha_object_new_range(int64_t start, int64_t stop, int64_t step)
+{
+	struct roscha_object *obj = roscha_object_alloc(ROSCHA_RANGE);
+	obj->range.step           = step;
+	obj->range.start          = start;
+	obj->range.stop           = stop;
+	return obj;
+}
+
+size_t
+roscha_range_len(const struct roscha_object *obj)
+{
+	int64_t start = obj->range.start;
+	int64_t stop  = obj->range.stop;
+	int64_t step  = obj->range.step;
+	if (step > 0 && start < stop) {
+		return ((uint64_t)stop - start - 1) / step + 1;
+	}
+	if (step < 0 && start > stop) {
+		return ((uint64_t)start - stop - 1) / -(uint64_t)step + 1;
+	}
+
+	return 0;
+}
+
 static inline void
 roscha_object_vector_destroy(struct roscha_object *obj)
 {
@@ -150,6 +229,8 @@ roscha_object_unref(struct roscha_object *obj)
 {
 	if (obj == NULL) return;
 	if (obj->type == ROSCHA_NULL || obj->type == ROSCHA_BOOL) return;
+	/* released all at once with the heap */
+	if (obj->heap) return;
 	if (--obj->refcount < 1) {
 		switch (obj->type) {
 		case ROSCHA_STRING:
@@ -164,8 +245,62 @@ roscha_object_unref(struct roscha_object *obj)
 		default:
 			break;
 		}
-		free(obj);
+		roscha_free(obj);
+	}
+}
+
+static struct roscha_object *
+roscha_object_copy(const struct roscha_object *obj)
+{
+	switch (obj->type) {
+	case ROSCHA_INT:
+		return roscha_object_new_int(obj->integer);
+	case ROSCHA_STRING:
+		return roscha_object_new_string(sdsdup(obj->string));
+	case ROSCHA_SLICE:
+		return roscha_object_new_slice(obj->slice);
+	case ROSCHA_SSTR:
+		return roscha_object_new_sstr(obj->sstr.str, obj->sstr.len);
+	case ROSCHA_VECTOR: {
+		size_t                i;
+		struct roscha_object *subobj;
+		struct vector        *vec = vector_new_with_cap(obj->vector->cap);
+		vector_foreach (obj->vector, i, subobj) {
+			vector_push(vec, roscha_object_copy(subobj));
+		}
+		return roscha_object_new_vector(vec);
+	}
+	case ROSCHA_HMAP: {
+		const struct slice *key;
+		void               *val;
+		struct hmap_iter    iter;
+		struct hmap        *map = hmap_new_with_cap(obj->hmap->cap);
+		hmap_iter_init(&iter, obj->hmap);
+		hmap_iter_foreach (&iter, &key, &val) {
+			hmap_sets(map, *key, roscha_object_copy(val));
+		}
+		return roscha_object_new_hmap(map);
+	}
+	case ROSCHA_RANGE:
+		return roscha_object_new_range(obj->range.start, obj->range.stop,
+		                               obj->range.step);
+	default:
+		/* null and booleans are static objects */
+		return (struct roscha_object *)obj;
+	}
+}
+
+struct roscha_object *
+roscha_object_persist(struct roscha_object *obj)
+{
+	if (!obj->heap) {
+		roscha_object_ref(obj);
+		return obj;
 	}
+	struct roscha_heap   *heap = roscha_heap_leave();
+	struct roscha_object *res  = roscha_object_copy(obj);
+	roscha_heap_enter(heap);
+	return res;
 }
 
 void
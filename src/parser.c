@@ -1,8 +1,10 @@
 #include "parser.h"
+#include "alloc.h"
 #include "ast.h"
 #include "token.h"
 #include "vector.h"
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -13,64 +15,102 @@ enum precedence {
 	PRE_SUM,
 	PRE_PROD,
 	PRE_PREFIX,
+	PRE_FILTER,
 	PRE_CALL,
 	PRE_INDEX,
 };
 
-static enum precedence precedence_values[] = {
-	0,
-	PRE_LOWEST,
-	PRE_EQUALS,
-	PRE_LG,
-	PRE_SUM,
-	PRE_PROD,
-	PRE_PREFIX,
-	PRE_CALL,
-	PRE_INDEX,
-};
-
-static struct hmap *prefix_fns  = NULL;
-static struct hmap *infix_fns   = NULL;
-static struct hmap *precedences = NULL;
-
 static struct block *parser_parse_block(struct parser *, struct block *opening);
 
-static inline void
-parser_register_prefix(enum token_type t, prefix_parse_f fn)
-{
-	hmap_set(prefix_fns, token_type_print(t), fn);
-}
+static struct expression *parser_parse_identifier(struct parser *);
+static struct expression *parser_parse_call(struct parser *,
+                                            struct expression *);
+static struct expression *parser_parse_integer(struct parser *);
+static struct expression *parser_parse_boolean(struct parser *);
+static struct expression *parser_parse_string(struct parser *);
+static struct expression *parser_parse_grouped(struct parser *);
+static struct expression *parser_parse_prefix(struct parser *);
+static struct expression *parser_parse_infix(struct parser *,
+                                             struct expression *);
+static struct expression *parser_parse_mapkey(struct parser *,
+                                              struct expression *);
+static struct expression *parser_parse_index(struct parser *,
+                                             struct expression *);
+static struct expression *parser_parse_filter(struct parser *,
+                                              struct expression *);
+
+/* Parsing functions and precedences of each token type */
+
+static const prefix_parse_f prefix_fns[TOKEN_CONTENT + 1] = {
+	[TOKEN_IDENT]  = parser_parse_identifier,
+	[TOKEN_INT]    = parser_parse_integer,
+	[TOKEN_BANG]   = parser_parse_prefix,
+	[TOKEN_MINUS]  = parser_parse_prefix,
+	[TOKEN_NOT]    = parser_parse_prefix,
+	[TOKEN_TRUE]   = parser_parse_boolean,
+	[TOKEN_FALSE]  = parser_parse_boolean,
+	[TOKEN_STRING] = parser_parse_string,
+	[TOKEN_LPAREN] = parser_parse_grouped,
+	[TOKEN_RPAREN] = parser_parse_grouped,
+};
 
-static inline void
-parser_register_infix(enum token_type t, infix_parse_f fn)
-{
-	hmap_set(infix_fns, token_type_print(t), fn);
-}
+static const infix_parse_f infix_fns[TOKEN_CONTENT + 1] = {
+	[TOKEN_PLUS]     = parser_parse_infix,
+	[TOKEN_MINUS]    = parser_parse_infix,
+	[TOKEN_SLASH]    = parser_parse_infix,
+	[TOKEN_ASTERISK] = parser_parse_infix,
+	[TOKEN_EQ]       = parser_parse_infix,
+	[TOKEN_NOTEQ]    = parser_parse_infix,
+	[TOKEN_LT]       = parser_parse_infix,
+	[TOKEN_GT]       = parser_parse_infix,
+	[TOKEN_LTE]      = parser_parse_infix,
+	[TOKEN_GTE]      = parser_parse_infix,
+	[TOKEN_AND]      = parser_parse_infix,
+	[TOKEN_OR]       = parser_parse_infix,
+	[TOKEN_DOT]      = parser_parse_mapkey,
+	[TOKEN_LBRACKET] = parser_parse_index,
+	[TOKEN_PIPE]     = parser_parse_filter,
+	[TOKEN_LPAREN]   = parser_parse_call,
+};
 
-static inline void
-parser_register_precedence(enum token_type t, enum precedence pre)
-{
-	hmap_set(precedences, token_type_print(t), &precedence_values[pre]);
-}
+/* Token types left out have PRE_LOWEST precedence */
+static const enum precedence precedences[TOKEN_CONTENT + 1] = {
+	[TOKEN_EQ]       = PRE_EQUALS,
+	[TOKEN_NOTEQ]    = PRE_EQUALS,
+	[TOKEN_LT]       = PRE_LG,
+	[TOKEN_GT]       = PRE_LG,
+	[TOKEN_LTE]      = PRE_LG,
+	[TOKEN_GTE]      = PRE_LG,
+	[TOKEN_AND]      = PRE_LG,
+	[TOKEN_OR]       = PRE_LG,
+	[TOKEN_PLUS]     = PRE_SUM,
+	[TOKEN_MINUS]    = PRE_SUM,
+	[TOKEN_ASTERISK] = PRE_PROD,
+	[TOKEN_SLASH]    = PRE_PROD,
+	[TOKEN_PIPE]     = PRE_FILTER,
+	[TOKEN_LPAREN]   = PRE_CALL,
+	[TOKEN_DOT]      = PRE_INDEX,
+	[TOKEN_LBRACKET] = PRE_INDEX,
+};
 
 static inline prefix_parse_f
 parser_get_prefix(struct parser *parser, enum token_type t)
 {
-	return hmap_get(prefix_fns, token_type_print(t));
+	return prefix_fns[t];
 }
 
 static inline infix_parse_f
 parser_get_infix(struct parser *parser, enum token_type t)
 {
-	return hmap_get(infix_fns, token_type_print(t));
+	return infix_fns[t];
 }
 
 static inline enum precedence
 parser_get_precedence(struct parser *parser, enum token_type t)
 {
-	enum precedence *pre = hmap_get(precedences, token_type_print(t));
+	enum precedence pre = precedences[t];
 	if (!pre) return PRE_LOWEST;
-	return *pre;
+	return pre;
 }
 
 static inline void
@@ -134,6 +174,62 @@ parser_no_prefix_fn_error(struct parser *parser, enum token_type t)
 	             token_type_print(t));
 }
 
+/*
+ * Called with the first token after {{ or {% as the current one. Handles a {{-
+ * or {%- marker, or lstrip_blocks for tags, by trimming the content right
+ * before.
+ */
+static inline void
+parser_open_tag(struct parser *parser, bool tag)
+{
+	struct block *prev   = parser->prev_content;
+	parser->prev_content = NULL;
+	parser->trim_next    = TRIM_NONE;
+	if (parser_cur_token_is(parser, TOKEN_TRIM)) {
+		if (prev) {
+			struct slice *lit = &prev->token.literal;
+			while (lit->end > lit->start
+			       && isspace((unsigned char)lit->str[lit->end - 1])) {
+				lit->end--;
+			}
+		}
+		parser_next_token(parser);
+	} else if (tag && parser->lstrip_blocks && prev) {
+		struct slice *lit = &prev->token.literal;
+		size_t        end = lit->end;
+		while (end > lit->start
+		       && (lit->str[end - 1] == ' ' || lit->str[end - 1] == '\t')) {
+			end--;
+		}
+		if (end == 0 || lit->str[end - 1] == '\n') {
+			lit->end = end;
+		}
+	}
+}
+
+/*
+ * Called before the closing %} or }}. Handles a -%} or -}} marker, or
+ * trim_blocks for tags, by setting how to trim the next content block.
+ */
+static inline void
+parser_close_tag(struct parser *parser, bool tag)
+{
+	if (parser_peek_token_is(parser, TOKEN_TRIM)) {
+		parser_next_token(parser);
+		parser->trim_next = TRIM_SPACE;
+	} else if (tag && parser->trim_blocks) {
+		parser->trim_next = TRIM_NEWLINE;
+	}
+}
+
+/* Expect the % of the closing %} of a tag */
+static inline bool
+parser_expect_tag_end(struct parser *parser)
+{
+	parser_close_tag(parser, true);
+	return parser_expect_peek(parser, TOKEN_PERCENT);
+}
+
 static struct expression *
 parser_parse_expression(struct parser *parser, enum precedence pre)
 {
@@ -159,12 +255,42 @@ parser_parse_expression(struct parser *parser, enum precedence pre)
 	return lexpr;
 }
 
+/* Whether the name is a loop variable hiding a parameter of the macro */
+static bool
+parser_shadowed(struct parser *parser, const struct slice *name)
+{
+	if (parser->shadowed->len == 0) return false;
+	struct slice loop = slice_whole("loop");
+	if (slice_eq(name, &loop)) return true;
+
+	size_t        i;
+	struct slice *item;
+	vector_foreach (parser->shadowed, i, item) {
+		if (slice_eq(item, name)) return true;
+	}
+	return false;
+}
+
 static struct expression *
 parser_parse_identifier(struct parser *parser)
 {
-	struct expression *expr = malloc(sizeof(*expr));
+	struct expression *expr = roscha_malloc(sizeof(*expr));
 	expr->type              = EXPRESSION_IDENT;
 	expr->token             = parser->cur_token;
+	expr->ident.slot        = 0;
+
+	/* Macro parameters are bound to frame slots instead of looked up */
+	if (parser->macro != NULL
+	    && !parser_shadowed(parser, &expr->token.literal)) {
+		size_t        i;
+		struct ident *param;
+		vector_foreach (parser->macro->params, i, param) {
+			if (slice_eq(&param->token.literal, &expr->token.literal)) {
+				expr->ident.slot = param->slot;
+				break;
+			}
+		}
+	}
 
 	return expr;
 }
@@ -172,7 +298,7 @@ parser_parse_identifier(struct parser *parser)
 static struct expression *
 parser_parse_integer(struct parser *parser)
 {
-	struct expression *expr = malloc(sizeof(*expr));
+	struct expression *expr = roscha_malloc(sizeof(*expr));
 	expr->type              = EXPRESSION_INT;
 	expr->token             = parser->cur_token;
 
@@ -185,7 +311,7 @@ parser_parse_integer(struct parser *parser)
 		parser_error(parser, parser->cur_token, "%s is not a valid integer",
 		             istr);
 		sdsfree(istr);
-		free(expr);
+		roscha_free(expr);
 		return NULL;
 	}
 
@@ -195,7 +321,7 @@ parser_parse_integer(struct parser *parser)
 static struct expression *
 parser_parse_boolean(struct parser *parser)
 {
-	struct expression *expr = malloc(sizeof(*expr));
+	struct expression *expr = roscha_malloc(sizeof(*expr));
 	expr->type              = EXPRESSION_BOOL;
 	expr->token             = parser->cur_token;
 	expr->boolean.value     = expr->token.type == TOKEN_TRUE;
@@ -206,7 +332,7 @@ parser_parse_boolean(struct parser *parser)
 static struct expression *
 parser_parse_string(struct parser *parser)
 {
-	struct expression *expr = malloc(sizeof(*expr));
+	struct expression *expr = roscha_malloc(sizeof(*expr));
 	expr->type              = EXPRESSION_STRING;
 	expr->token             = parser->cur_token;
 	expr->string.value      = parser->cur_token.literal;
@@ -231,7 +357,7 @@ parser_parse_grouped(struct parser *parser)
 static struct expression *
 parser_parse_prefix(struct parser *parser)
 {
-	struct expression *expr = malloc(sizeof(*expr));
+	struct expression *expr = roscha_malloc(sizeof(*expr));
 	expr->type              = EXPRESSION_PREFIX;
 	expr->token             = parser->cur_token;
 	expr->prefix.operator= parser->cur_token.literal;
@@ -245,7 +371,7 @@ parser_parse_prefix(struct parser *parser)
 static struct expression *
 parser_parse_infix(struct parser *parser, struct expression *lexpr)
 {
-	struct expression *expr = malloc(sizeof(*expr));
+	struct expression *expr = roscha_malloc(sizeof(*expr));
 	expr->type              = EXPRESSION_INFIX;
 	expr->token             = parser->cur_token;
 	expr->infix.operator= parser->cur_token.literal;
@@ -270,10 +396,13 @@ parser_parse_mapkey(struct parser *parser, struct expression *lexpr)
 		sdsfree(got);
 		return NULL;
 	}
-	struct expression *expr = malloc(sizeof(*expr));
+	struct expression *expr = roscha_malloc(sizeof(*expr));
 	expr->type              = EXPRESSION_MAPKEY;
 	expr->token             = parser->cur_token;
 	expr->indexkey.left     = lexpr;
+	expr->indexkey.path =
+		(lexpr->type == EXPRESSION_IDENT && lexpr->ident.slot == 0)
+		|| (lexpr->type == EXPRESSION_MAPKEY && lexpr->indexkey.path);
 
 	parser_next_token(parser);
 	expr->indexkey.key = parser_parse_expression(parser, PRE_INDEX);
@@ -294,14 +423,15 @@ parser_parse_index(struct parser *parser, struct expression *lexpr)
 {
 	if (lexpr->type != EXPRESSION_IDENT
 	    && lexpr->type != EXPRESSION_MAPKEY
-	    && lexpr->type != EXPRESSION_INDEX) {
+	    && lexpr->type != EXPRESSION_INDEX
+	    && lexpr->type != EXPRESSION_CALL) {
 		sds got = expression_string(lexpr, sdsempty());
 		parser_error(parser, parser->cur_token,
 		             "expected a vector identifier, key or index; got %s", got);
 		sdsfree(got);
 		return NULL;
 	}
-	struct expression *expr = malloc(sizeof(*expr));
+	struct expression *expr = roscha_malloc(sizeof(*expr));
 	expr->type              = EXPRESSION_INDEX;
 	expr->token             = parser->cur_token;
 	expr->indexkey.left     = lexpr;
@@ -317,6 +447,93 @@ parser_parse_index(struct parser *parser, struct expression *lexpr)
 	return expr;
 }
 
+/*
+ * Parse a parenthesized, comma separated list of at most max expressions into
+ * args, starting at the opening parenthesis; what names the callee in errors.
+ */
+static bool
+parser_parse_args(struct parser *parser, struct vector *args, size_t max,
+                  const char *what)
+{
+	if (parser_peek_token_is(parser, TOKEN_RPAREN)) {
+		parser_next_token(parser);
+		return true;
+	}
+	do {
+		parser_next_token(parser);
+		struct expression *arg = parser_parse_expression(parser, PRE_LOWEST);
+		if (!arg) return false;
+		if (args->len == max) {
+			parser_error(parser, arg->token,
+			             "%s take at most %u arguments", what, (unsigned)max);
+			expression_destroy(arg);
+			return false;
+		}
+		vector_push(args, arg);
+		if (!parser_peek_token_is(parser, TOKEN_COMMA)) break;
+		parser_next_token(parser);
+	} while (true);
+
+	return parser_expect_peek(parser, TOKEN_RPAREN);
+}
+
+static struct expression *
+parser_parse_filter(struct parser *parser, struct expression *lexpr)
+{
+	if (!parser_expect_peek(parser, TOKEN_IDENT)) {
+		expression_destroy(lexpr);
+		return NULL;
+	}
+	struct expression *expr = roscha_malloc(sizeof(*expr));
+	expr->type              = EXPRESSION_FILTER;
+	expr->token             = parser->cur_token;
+	expr->filter.left       = lexpr;
+	expr->filter.name.token = parser->cur_token;
+	expr->filter.name.slot  = 0;
+	expr->filter.args       = NULL;
+	if (!parser_peek_token_is(parser, TOKEN_LPAREN)) {
+		return expr;
+	}
+
+	parser_next_token(parser);
+	expr->filter.args = vector_new_with_cap(FILTER_MAX_ARGS);
+	if (!parser_parse_args(parser, expr->filter.args, FILTER_MAX_ARGS,
+	                       "filters")) {
+		expression_destroy(expr);
+		return NULL;
+	}
+
+	return expr;
+}
+
+static struct expression *
+parser_parse_call(struct parser *parser, struct expression *lexpr)
+{
+	if (lexpr->type != EXPRESSION_IDENT) {
+		sds got = expression_string(lexpr, sdsempty());
+		parser_error(parser, parser->cur_token, "%s is not a macro", got);
+		sdsfree(got);
+		expression_destroy(lexpr);
+		return NULL;
+	}
+	struct expression *expr = roscha_malloc(sizeof(*expr));
+	expr->type              = EXPRESSION_CALL;
+	expr->token             = lexpr->token;
+	expr->call.name         = lexpr->ident;
+	expr->call.args         = vector_new();
+	expr->call.macro        = NULL;
+	expression_destroy(lexpr);
+
+	if (!parser_parse_args(parser, expr->call.args, MACRO_MAX_PARAMS,
+	                       "macros")) {
+		expression_destroy(expr);
+		return NULL;
+	}
+	vector_push(parser->calls, &expr->call);
+
+	return expr;
+}
+
 static inline bool
 parser_parse_loop(struct parser *parser, struct block *blk)
 {
@@ -328,14 +545,16 @@ parser_parse_loop(struct parser *parser, struct block *blk)
 	if (!parser_expect_peek(parser, TOKEN_IDENT)) return false;
 	blk->tag.loop.seq = parser_parse_expression(parser, PRE_LOWEST);
 
-	if (!parser_expect_peek(parser, TOKEN_PERCENT)) return false;
+	if (!parser_expect_tag_end(parser)) return false;
 	if (!parser_expect_peek(parser, TOKEN_RBRACE)) return false;
 
 	parser_next_token(parser);
 	blk->tag.loop.subblocks = vector_new();
+	vector_push(parser->shadowed, &blk->tag.loop.item.token.literal);
 	while (!parser_cur_token_is(parser, TOKEN_EOF)) {
 		struct block *subblk = parser_parse_block(parser, blk);
 		if (subblk == NULL) {
+			vector_pop(parser->shadowed);
 			return false;
 		}
 		vector_push(blk->tag.loop.subblocks, subblk);
@@ -344,6 +563,7 @@ parser_parse_loop(struct parser *parser, struct block *blk)
 			break;
 		}
 	}
+	vector_pop(parser->shadowed);
 
 	return true;
 }
@@ -351,7 +571,7 @@ parser_parse_loop(struct parser *parser, struct block *blk)
 static inline struct branch *
 parser_parse_branch(struct parser *parser, struct block *opening)
 {
-	struct branch *brnch = calloc(1, sizeof(*brnch));
+	struct branch *brnch = roscha_calloc(1, sizeof(*brnch));
 	brnch->token         = parser->cur_token;
 
 	if (brnch->token.type == TOKEN_IF || brnch->token.type == TOKEN_ELIF) {
@@ -359,8 +579,12 @@ parser_parse_branch(struct parser *parser, struct block *opening)
 		brnch->condition = parser_parse_expression(parser, PRE_LOWEST);
 	}
 
-	if (!parser_expect_peek(parser, TOKEN_PERCENT)) return false;
-	if (!parser_expect_peek(parser, TOKEN_RBRACE)) return false;
+	if (!parser_expect_tag_end(parser)
+	    || !parser_expect_peek(parser, TOKEN_RBRACE)) {
+		expression_destroy(brnch->condition);
+		roscha_free(brnch);
+		return NULL;
+	}
 
 	parser_next_token(parser);
 	brnch->subblocks = vector_new();
@@ -372,7 +596,7 @@ parser_parse_branch(struct parser *parser, struct block *opening)
 		}
 		if (subblk->type == BLOCK_TAG && subblk->tag.type == TAG_IF) {
 			brnch->next = subblk->tag.cond.root;
-			free(subblk);
+			roscha_free(subblk);
 			break;
 		}
 		vector_push(brnch->subblocks, subblk);
@@ -422,15 +646,33 @@ parser_parse_parent(struct parser *parser, struct block *blk)
 	blk->tag.type = TAG_EXTENDS;
 	if (!parser_expect_peek(parser, TOKEN_STRING)) return false;
 
-	blk->tag.parent.name        = malloc(sizeof(*blk->tag.parent.name));
+	blk->tag.parent.name        = roscha_malloc(sizeof(*blk->tag.parent.name));
 	blk->tag.parent.name->token = parser->cur_token;
 	blk->tag.parent.name->value = parser->cur_token.literal;
 	blk->tag.parent.name->value.start++;
 	blk->tag.parent.name->value.end--;
 
-	if (!parser_expect_peek(parser, TOKEN_PERCENT)) return false;
+	if (!parser_expect_tag_end(parser)) return false;
+	if (!parser_expect_peek(parser, TOKEN_RBRACE)) return false;
+
+	return true;
+}
+
+static inline bool
+parser_parse_include(struct parser *parser, struct block *blk)
+{
+	blk->tag.type          = TAG_INCLUDE;
+	blk->tag.include.tmpl  = NULL;
+	blk->tag.include.cycle = false;
+
+	parser_next_token(parser);
+	blk->tag.include.name = parser_parse_expression(parser, PRE_LOWEST);
+	if (blk->tag.include.name == NULL) return false;
+
+	if (!parser_expect_tag_end(parser)) return false;
 	if (!parser_expect_peek(parser, TOKEN_RBRACE)) return false;
 
+	vector_push(parser->includes, &blk->tag.include);
 	return true;
 }
 
@@ -442,11 +684,12 @@ parser_parse_tblock(struct parser *parser, struct block *blk)
 	if (!parser_expect_peek(parser, TOKEN_IDENT)) return false;
 	blk->tag.tblock.name.token = parser->cur_token;
 
-	if (!parser_expect_peek(parser, TOKEN_PERCENT)) return false;
+	if (!parser_expect_tag_end(parser)) return false;
 	if (!parser_expect_peek(parser, TOKEN_RBRACE)) return false;
 
 	parser_next_token(parser);
 	blk->tag.tblock.subblocks = vector_new();
+	blk->tag.tblock.id        = 0;
 	while (!parser_cur_token_is(parser, TOKEN_EOF)) {
 		struct block *subblk = parser_parse_block(parser, blk);
 		if (subblk == NULL) {
@@ -463,14 +706,119 @@ parser_parse_tblock(struct parser *parser, struct block *blk)
 	return true;
 }
 
+static inline bool
+parser_parse_macro(struct parser *parser, struct block *blk)
+{
+	struct macro *macro = &blk->tag.macro;
+	blk->tag.type       = TAG_MACRO;
+	macro->params       = vector_new();
+	macro->subblocks    = vector_new();
+
+	if (!parser_expect_peek(parser, TOKEN_IDENT)) return false;
+	macro->name.token = parser->cur_token;
+	macro->name.slot  = 0;
+	if (!parser_expect_peek(parser, TOKEN_LPAREN)) return false;
+	while (!parser_peek_token_is(parser, TOKEN_RPAREN)) {
+		if (macro->params->len > 0
+		    && !parser_expect_peek(parser, TOKEN_COMMA)) {
+			return false;
+		}
+		if (!parser_expect_peek(parser, TOKEN_IDENT)) return false;
+		if (macro->params->len == MACRO_MAX_PARAMS) {
+			parser_error(parser, parser->cur_token,
+			             "macros take at most %i arguments", MACRO_MAX_PARAMS);
+			return false;
+		}
+		struct ident *param = roscha_malloc(sizeof(*param));
+		param->token        = parser->cur_token;
+		param->slot         = macro->params->len + 1;
+		vector_push(macro->params, param);
+	}
+	parser_next_token(parser);
+
+	if (!parser_expect_tag_end(parser)) return false;
+	if (!parser_expect_peek(parser, TOKEN_RBRACE)) return false;
+
+	/* Loops around the macro don't hide its parameters */
+	struct macro  *outer       = parser->macro;
+	struct vector *outer_loops = parser->shadowed;
+	bool           ok          = true;
+	parser->macro              = macro;
+	parser->shadowed           = vector_new();
+	parser_next_token(parser);
+	while (!parser_cur_token_is(parser, TOKEN_EOF)) {
+		struct block *subblk = parser_parse_block(parser, blk);
+		if (subblk == NULL) {
+			ok = false;
+			break;
+		}
+		vector_push(macro->subblocks, subblk);
+		parser_next_token(parser);
+		if (subblk->type == BLOCK_TAG && subblk->tag.type == TAG_CLOSE) {
+			break;
+		}
+	}
+	vector_free(parser->shadowed);
+	parser->macro    = outer;
+	parser->shadowed = outer_loops;
+	if (!ok) return false;
+
+	hmap_sets(parser->macros, macro->name.token.literal, macro);
+	return true;
+}
+
+static inline bool
+parser_parse_fragment(struct parser *parser, struct block *blk)
+{
+	struct fragment *frag = &blk->tag.fragment;
+	blk->tag.type         = TAG_CACHE;
+	frag->ttl             = NULL;
+	frag->subblocks       = vector_new();
+	frag->prefix          = sdscatfmt(sdsempty(), "%s:%U:%U:", parser->name,
+	                                  (unsigned long long)blk->token.line,
+	                                  (unsigned long long)blk->token.column);
+
+	parser_next_token(parser);
+	frag->key = parser_parse_expression(parser, PRE_LOWEST);
+	if (frag->key == NULL) return false;
+	if (parser_peek_token_is(parser, TOKEN_COMMA)) {
+		parser_next_token(parser);
+	}
+	if (!parser_peek_token_is(parser, TOKEN_PERCENT)
+	    && !parser_peek_token_is(parser, TOKEN_TRIM)) {
+		parser_next_token(parser);
+		frag->ttl = parser_parse_expression(parser, PRE_LOWEST);
+		if (frag->ttl == NULL) return false;
+	}
+
+	if (!parser_expect_tag_end(parser)) return false;
+	if (!parser_expect_peek(parser, TOKEN_RBRACE)) return false;
+
+	parser_next_token(parser);
+	while (!parser_cur_token_is(parser, TOKEN_EOF)) {
+		struct block *subblk = parser_parse_block(parser, blk);
+		if (subblk == NULL) {
+			return false;
+		}
+		vector_push(frag->subblocks, subblk);
+		parser_next_token(parser);
+		if (subblk->type == BLOCK_TAG && subblk->tag.type == TAG_CLOSE) {
+			break;
+		}
+	}
+
+	return true;
+}
+
 static inline struct block *
 parser_parse_tag(struct parser *parser, struct block *opening)
 {
-	struct block *blk = malloc(sizeof(*blk));
+	struct block *blk = roscha_malloc(sizeof(*blk));
 	blk->type         = BLOCK_TAG;
 
 	parser_next_token(parser);
 	parser_next_token(parser);
+	parser_open_tag(parser, true);
 
 	blk->token = parser->cur_token;
 
@@ -481,7 +829,7 @@ parser_parse_tag(struct parser *parser, struct block *opening)
 		break;
 	case TOKEN_BREAK:
 		blk->tag.type = TAG_BREAK;
-		if (!parser_expect_peek(parser, TOKEN_PERCENT)) goto fail;
+		if (!parser_expect_tag_end(parser)) goto fail;
 		if (!parser_expect_peek(parser, TOKEN_RBRACE)) goto fail;
 		break;
 	case TOKEN_IF:
@@ -494,9 +842,18 @@ parser_parse_tag(struct parser *parser, struct block *opening)
 	case TOKEN_EXTENDS:
 		res = parser_parse_parent(parser, blk);
 		break;
+	case TOKEN_INCLUDE:
+		res = parser_parse_include(parser, blk);
+		break;
 	case TOKEN_BLOCK:
 		res = parser_parse_tblock(parser, blk);
 		break;
+	case TOKEN_MACRO:
+		res = parser_parse_macro(parser, blk);
+		break;
+	case TOKEN_CACHE:
+		res = parser_parse_fragment(parser, blk);
+		break;
 	case TOKEN_ENDFOR:
 		if (opening == NULL) goto noopening;
 		if (opening->tag.type != TAG_FOR) goto noopening;
@@ -509,6 +866,14 @@ parser_parse_tag(struct parser *parser, struct block *opening)
 		if (opening == NULL) goto noopening;
 		if (opening->tag.type != TAG_BLOCK) goto noopening;
 		goto closing;
+	case TOKEN_ENDMACRO:
+		if (opening == NULL) goto noopening;
+		if (opening->tag.type != TAG_MACRO) goto noopening;
+		goto closing;
+	case TOKEN_ENDCACHE:
+		if (opening == NULL) goto noopening;
+		if (opening->tag.type != TAG_CACHE) goto noopening;
+		goto closing;
 	default:;
 		parser_error(parser, parser->cur_token, "expected keyword, got %s",
 		             token_type_print(parser->cur_token.type));
@@ -516,36 +881,48 @@ parser_parse_tag(struct parser *parser, struct block *opening)
 	}
 
 	if (!res) {
-		free(blk);
+		roscha_free(blk);
 		return NULL;
 	}
 
 	return blk;
 closing:
 	blk->tag.type = TAG_CLOSE;
-	if (!parser_expect_peek(parser, TOKEN_PERCENT)) goto fail;
+	if (!parser_expect_tag_end(parser)) goto fail;
 	if (!parser_peek_token_is(parser, TOKEN_RBRACE)) goto fail;
 	return blk;
 noopening:;
 	parser_error(parser, parser->cur_token, "unexpected closing tag %s",
 	             token_type_print(parser->cur_token.type));
 fail:
-	free(blk);
+	roscha_free(blk);
 	return NULL;
 }
 
 static inline struct block *
 parser_parse_variable(struct parser *parser)
 {
-	struct block *blk = malloc(sizeof(*blk));
+	struct block *blk = roscha_malloc(sizeof(*blk));
 	blk->type         = BLOCK_VARIABLE;
 	blk->token        = parser->peek_token;
 
 	parser_next_token(parser);
 	parser_next_token(parser);
+	parser_open_tag(parser, false);
 
-	blk->variable.expression = parser_parse_expression(parser, PRE_LOWEST);
-	if (!blk->variable.expression) goto fail;
+	struct expression *expr = parser_parse_expression(parser, PRE_LOWEST);
+	blk->variable.expression = expr;
+	blk->variable.safe       = false;
+	if (!expr) goto fail;
+	/* A trailing | safe only marks the output as not to be escaped */
+	struct slice safe = slice_whole("safe");
+	if (expr->type == EXPRESSION_FILTER && !expr->filter.args
+	    && slice_eq(&expr->filter.name.token.literal, &safe)) {
+		blk->variable.expression = expr->filter.left;
+		blk->variable.safe       = true;
+		roscha_free(expr);
+	}
+	parser_close_tag(parser, false);
 	if (!parser_expect_peek(parser, TOKEN_RBRACE)) goto fail;
 	if (!parser_expect_peek(parser, TOKEN_RBRACE)) goto fail;
 
@@ -558,10 +935,32 @@ fail:
 static inline struct block *
 parser_parse_content(struct parser *parser)
 {
-	struct block *blk = malloc(sizeof(*blk));
+	struct block *blk = roscha_malloc(sizeof(*blk));
 	blk->type         = BLOCK_CONTENT;
 	blk->token        = parser->cur_token;
 
+	struct slice *lit = &blk->token.literal;
+	switch (parser->trim_next) {
+	case TRIM_SPACE:
+		while (lit->start < lit->end
+		       && isspace((unsigned char)lit->str[lit->start])) {
+			lit->start++;
+		}
+		break;
+	case TRIM_NEWLINE:
+		if (lit->start < lit->end && lit->str[lit->start] == '\n') {
+			lit->start++;
+		} else if (lit->end - lit->start >= 2 && lit->str[lit->start] == '\r'
+		           && lit->str[lit->start + 1] == '\n') {
+			lit->start += 2;
+		}
+		break;
+	case TRIM_NONE:
+		break;
+	}
+	parser->trim_next    = TRIM_NONE;
+	parser->prev_content = blk;
+
 	return blk;
 }
 
@@ -590,16 +989,16 @@ parser_parse_block(struct parser *parser, struct block *opening)
 	}
 }
 
-struct parser *
-parser_new(char *name, char *input)
+/* Size of the window of a streamed template held at a time */
+#define PARSER_STREAM_BUFSIZE 65536
+
+static struct parser *
+parser_new_lexer(char *name, struct lexer *lex)
 {
-	struct parser *parser = calloc(1, sizeof(*parser));
+	struct parser *parser = roscha_calloc(1, sizeof(*parser));
 	parser->name          = name;
-
-	struct lexer *lex = lexer_new(input);
-	parser->lexer     = lex;
-
-	parser->errors = vector_new();
+	parser->lexer         = lex;
+	parser->errors        = vector_new();
 
 	parser_next_token(parser);
 	parser_next_token(parser);
@@ -607,14 +1006,68 @@ parser_new(char *name, char *input)
 	return parser;
 }
 
+struct parser *
+parser_new(char *name, char *input)
+{
+	return parser_new_lexer(name, lexer_new(input));
+}
+
+struct parser *
+parser_new_stream(char *name, lexer_read_f read, void *ctx)
+{
+	return parser_new_lexer(
+		name, lexer_new_stream(read, ctx, PARSER_STREAM_BUFSIZE));
+}
+
+/*
+ * Point every call to its macro, now that all of them are defined; calls to
+ * range() are left to the built-in one unless a macro is named so.
+ */
+static void
+parser_resolve_calls(struct parser *parser)
+{
+	struct slice range = slice_whole("range");
+	size_t       i;
+	struct call *call;
+	vector_foreach (parser->calls, i, call) {
+		call->macro  = hmap_gets(parser->macros, &call->name.token.literal);
+		bool builtin = call->macro == NULL
+		               && slice_eq(&call->name.token.literal, &range);
+		if (builtin) {
+			if (call->args->len < 1 || call->args->len > 3) {
+				parser_error(parser, call->token,
+				             "range takes 1 to 3 arguments, got %U",
+				             (unsigned long long)call->args->len);
+			}
+		} else if (call->macro == NULL) {
+			sds name = slice_string(&call->name.token.literal, sdsempty());
+			parser_error(parser, call->token, "unknown macro %s", name);
+			sdsfree(name);
+		} else if (call->args->len > call->macro->params->len) {
+			sds name = slice_string(&call->name.token.literal, sdsempty());
+			parser_error(parser, call->token,
+			             "macro %s takes %U arguments, got %U", name,
+			             (unsigned long long)call->macro->params->len,
+			             (unsigned long long)call->args->len);
+			sdsfree(name);
+		}
+	}
+}
+
 struct template *
 parser_parse_template(struct parser *parser)
 {
-	struct template *tmpl = malloc(sizeof(*tmpl));
+	struct lexer    *lex  = parser->lexer;
+	struct template *tmpl = roscha_malloc(sizeof(*tmpl));
 	tmpl->name            = parser->name;
-	tmpl->source          = (char *)parser->lexer->input;
+	tmpl->source          = lex->read == NULL ? (char *)lex->input : NULL;
 	parser->tblocks       = hmap_new();
-	tmpl->child           = NULL;
+	parser->includes      = vector_new();
+	parser->macros        = hmap_new();
+	parser->calls         = vector_new();
+	parser->shadowed      = vector_new();
+	tmpl->root            = NULL;
+	tmpl->resolved        = NULL;
 	tmpl->blocks          = vector_new();
 
 	while (!parser_cur_token_is(parser, TOKEN_EOF)) {
@@ -626,8 +1079,24 @@ parser_parse_template(struct parser *parser)
 
 		parser_next_token(parser);
 	}
-
-	tmpl->tblocks = parser->tblocks;
+	if (lex->read_error) {
+		parser_error(parser, parser->cur_token, "%s",
+		             "unable to read template");
+	}
+	/* Calls in blocks that failed to parse might be gone already */
+	if (parser->errors->len == 0) {
+		parser_resolve_calls(parser);
+	}
+	hmap_free(parser->macros);
+	vector_free(parser->calls);
+	vector_free(parser->shadowed);
+
+	/* The AST points into the pool, so it goes along with it */
+	tmpl->pool     = lex->pool;
+	lex->pool      = NULL;
+	tmpl->tblocks  = parser->tblocks;
+	tmpl->includes = parser->includes;
+	tmpl->mark     = 0;
 	return tmpl;
 }
 
@@ -641,65 +1110,5 @@ parser_destroy(struct parser *parser)
 	}
 	vector_free(parser->errors);
 	lexer_destroy(parser->lexer);
-	free(parser);
-}
-
-void
-parser_init(void)
-{
-	token_init_keywords();
-
-	prefix_fns = hmap_new();
-	parser_register_prefix(TOKEN_IDENT, parser_parse_identifier);
-	parser_register_prefix(TOKEN_INT, parser_parse_integer);
-	parser_register_prefix(TOKEN_BANG, parser_parse_prefix);
-	parser_register_prefix(TOKEN_MINUS, parser_parse_prefix);
-	parser_register_prefix(TOKEN_NOT, parser_parse_prefix);
-	parser_register_prefix(TOKEN_TRUE, parser_parse_boolean);
-	parser_register_prefix(TOKEN_FALSE, parser_parse_boolean);
-	parser_register_prefix(TOKEN_STRING, parser_parse_string);
-	parser_register_prefix(TOKEN_LPAREN, parser_parse_grouped);
-	parser_register_prefix(TOKEN_RPAREN, parser_parse_grouped);
-
-	infix_fns = hmap_new();
-	parser_register_infix(TOKEN_PLUS, parser_parse_infix);
-	parser_register_infix(TOKEN_MINUS, parser_parse_infix);
-	parser_register_infix(TOKEN_SLASH, parser_parse_infix);
-	parser_register_infix(TOKEN_ASTERISK, parser_parse_infix);
-	parser_register_infix(TOKEN_EQ, parser_parse_infix);
-	parser_register_infix(TOKEN_NOTEQ, parser_parse_infix);
-	parser_register_infix(TOKEN_LT, parser_parse_infix);
-	parser_register_infix(TOKEN_GT, parser_parse_infix);
-	parser_register_infix(TOKEN_LTE, parser_parse_infix);
-	parser_register_infix(TOKEN_GTE, parser_parse_infix);
-	parser_register_infix(TOKEN_AND, parser_parse_infix);
-	parser_register_infix(TOKEN_OR, parser_parse_infix);
-
-	parser_register_infix(TOKEN_DOT, parser_parse_mapkey);
-	parser_register_infix(TOKEN_LBRACKET, parser_parse_index);
-
-	precedences = hmap_new();
-	parser_register_precedence(TOKEN_EQ, PRE_EQUALS);
-	parser_register_precedence(TOKEN_NOTEQ, PRE_EQUALS);
-	parser_register_precedence(TOKEN_LT, PRE_LG);
-	parser_register_precedence(TOKEN_GT, PRE_LG);
-	parser_register_precedence(TOKEN_LTE, PRE_LG);
-	parser_register_precedence(TOKEN_GTE, PRE_LG);
-	parser_register_precedence(TOKEN_AND, PRE_LG);
-	parser_register_precedence(TOKEN_OR, PRE_LG);
-	parser_register_precedence(TOKEN_PLUS, PRE_SUM);
-	parser_register_precedence(TOKEN_MINUS, PRE_SUM);
-	parser_register_precedence(TOKEN_ASTERISK, PRE_PROD);
-	parser_register_precedence(TOKEN_SLASH, PRE_PROD);
-	parser_register_precedence(TOKEN_DOT, PRE_INDEX);
-	parser_register_precedence(TOKEN_LBRACKET, PRE_INDEX);
-}
-
-void
-parser_deinit(void)
-{
-	token_free_keywords();
-	hmap_free(infix_fns);
-	hmap_free(prefix_fns);
-	hmap_free(precedences);
+	roscha_free(parser);
 }
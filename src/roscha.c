@@ -1,6 +1,9 @@
 #include "roscha.h"
+#include "alloc.h"
 
 #include "ast.h"
+#include "escape.h"
+#include "filter.h"
 #include "hmap.h"
 #include "vector.h"
 #include "parser.h"
@@ -14,30 +17,77 @@
 #include <dirent.h>
 #include <sys/stat.h>
 
-#define BUFSIZE 8912
+/* Bounds the includes with dynamic names, which can't be checked for cycles */
+#define INCLUDE_MAX_DEPTH 64
+/* Bounds recursive macro calls */
+#define MACRO_MAX_DEPTH 64
+/* Number of different sets of reads remembered per memoized template */
+#define MEMO_MAX_READSETS 4
+
+/* Open addressing set of pointers */
+struct ptrset {
+	const void **slots;
+	/* Number of slots; zero or a power of two */
+	size_t cap;
+	size_t len;
+};
 
 struct roscha_ {
 	/* hmap of template */
 	struct hmap *templates;
+	/* hmap of const struct roscha_filter */
+	struct hmap *filters;
+	/*
+	 * Ids of {% block ... %} names across all templates, stored as id + 1;
+	 * the keys point to the sds names in block_names, indexed by id.
+	 */
+	struct hmap   *block_ids;
+	struct vector *block_names;
 	/* template currently being evaluated */
 	const struct template *eval_tmpl;
+	/* resolved blocks of the template being rendered */
+	struct tblock *const *eval_blocks;
+	/* Number of includes being rendered */
+	unsigned include_depth;
+	/* Arguments of the macro being called, indexed by ident slot - 1 */
+	struct roscha_object **frame;
+	/* Number of macro calls being rendered */
+	unsigned call_depth;
+	/* hmap of struct memo by template name, see eval_memoized */
+	struct hmap *memos;
+	/* hmap of struct patchdoc by template name, see eval_incremental */
+	struct hmap *patchdocs;
+	/* Bumped whenever templates are added; part of memoized render keys */
+	size_t generation;
+	/* vector of the variable paths read by the render, when recording */
+	struct vector *reads;
+	/* The paths already in reads, see eval_record */
+	struct ptrset recorded;
+	/* Generation of template marks, see template_reaches */
+	size_t mark;
 	/* Set when a break tag was encountered */
 	bool brk;
+	/* Set while loading a dir, which resolves the templates once at the end */
+	bool loading;
+	/*
+	 * Variables substituted while folding a template being specialized, an
+	 * hmap object; NULL otherwise. shadowed is a vector of the slices of loop
+	 * variables hiding them in the blocks being folded.
+	 */
+	struct roscha_object *consts;
+	struct vector        *shadowed;
 };
 
 static struct roscha_object obj_null = {
-	ROSCHA_NULL,
-	0,
+	.type    = ROSCHA_NULL,
 	.boolean = false,
 };
 static struct roscha_object obj_true = {
-	ROSCHA_BOOL,
-	0,
+	.type    = ROSCHA_BOOL,
 	.boolean = true,
 };
 static struct roscha_object obj_false = {
-	ROSCHA_BOOL,
-	0,
+	.type    = ROSCHA_BOOL,
 	.boolean = false,
 };
 
@@ -48,6 +98,14 @@ get_bool_object(bool val)
 	return obj;
 }
 
+/* Whether the object counts as true in conditions; empty ranges don't */
+static inline bool
+object_truthy(const struct roscha_object *obj)
+{
+	if (obj->type == ROSCHA_RANGE) return roscha_range_len(obj) != 0;
+	return obj->boolean;
+}
+
 static void
 roscha_env_destroy_templates_cb(const struct slice *key, void *val)
 {
@@ -55,12 +113,18 @@ roscha_env_destroy_templates_cb(const struct slice *key, void *val)
 	template_destroy(tmpl);
 }
 
+/*
+ * Error messages outlive the render, so they are never allocated in a request
+ * heap.
+ */
 #define eval_error(e, t, fmt, ...)                                                    \
+	struct roscha_heap *err_heap = roscha_heap_leave();                               \
 	sds err = sdscatfmt(sdsempty(), "%s:%U:%U: " fmt,                                 \
 	                    e->internal->eval_tmpl->name, t.line, t.column, __VA_ARGS__); \
-	vector_push(e->errors, err)
+	vector_push(e->errors, err);                                                      \
+	roscha_heap_enter(err_heap)
 
-#define THERES_ERRORS env->errors->len > 0
+#define THERES_ERRORS (env->errors->len > 0)
 
 static inline struct roscha_object *eval_expression(struct roscha_env *,
                                                     struct expression *);
@@ -76,7 +140,7 @@ eval_prefix(struct roscha_env *env, struct prefix *pref)
 	switch (pref->token.type) {
 	case TOKEN_BANG:
 	case TOKEN_NOT:
-		res = get_bool_object(!right->boolean);
+		res = get_bool_object(!object_truthy(right));
 		break;
 	case TOKEN_MINUS:
 		if (right->type != ROSCHA_INT) {
@@ -123,10 +187,12 @@ eval_boolean_infix(struct roscha_env *env, struct token *op,
 		res = get_bool_object(left->boolean != right->boolean);
 		break;
 	case TOKEN_AND:
-		res = get_bool_object(left->boolean && right->boolean);
+		res = get_bool_object(object_truthy(left)
+		                      && object_truthy(right));
 		break;
 	case TOKEN_OR:
-		res = get_bool_object(left->boolean || right->boolean);
+		res = get_bool_object(object_truthy(left)
+		                      || object_truthy(right));
 		break;
 	default:
 		if (left->type != right->type) {
@@ -173,6 +239,40 @@ eval_integer_infix(struct roscha_env *env, struct token *op,
 	return res;
 }
 
+static inline struct roscha_object *
+eval_string_infix(struct roscha_env *env, struct token *op,
+                  struct roscha_object *left, struct roscha_object *right,
+                  const struct slice *lstr, const struct slice *rstr)
+{
+	struct roscha_object *res;
+	switch (op->type) {
+	case TOKEN_LT:
+		res = get_bool_object(slice_cmp(lstr, rstr) < 0);
+		break;
+	case TOKEN_GT:
+		res = get_bool_object(slice_cmp(lstr, rstr) > 0);
+		break;
+	case TOKEN_LTE:
+		res = get_bool_object(slice_cmp(lstr, rstr) <= 0);
+		break;
+	case TOKEN_GTE:
+		res = get_bool_object(slice_cmp(lstr, rstr) >= 0);
+		break;
+	case TOKEN_EQ:
+		res = get_bool_object(slice_eq(lstr, rstr));
+		break;
+	case TOKEN_NOTEQ:
+		res = get_bool_object(!slice_eq(lstr, rstr));
+		break;
+	default:
+		return eval_boolean_infix(env, op, left, right);
+	}
+	roscha_object_unref(left);
+	roscha_object_unref(right);
+
+	return res;
+}
+
 static inline struct roscha_object *
 eval_infix(struct roscha_env *env, struct infix *inf)
 {
@@ -180,6 +280,18 @@ eval_infix(struct roscha_env *env, struct infix *inf)
 	if (!left) {
 		return NULL;
 	}
+	if (inf->token.type == TOKEN_AND || inf->token.type == TOKEN_OR) {
+		/* Short-circuit; right isn't evaluated if left decides the result */
+		bool decides = inf->token.type == TOKEN_OR;
+		bool truthy  = object_truthy(left);
+		roscha_object_unref(left);
+		if (truthy == decides) return get_bool_object(decides);
+		struct roscha_object *right = eval_expression(env, inf->right);
+		if (!right) return NULL;
+		truthy = object_truthy(right);
+		roscha_object_unref(right);
+		return get_bool_object(truthy);
+	}
 	struct roscha_object *right = eval_expression(env, inf->right);
 	if (!right) {
 		roscha_object_unref(left);
@@ -188,6 +300,10 @@ eval_infix(struct roscha_env *env, struct infix *inf)
 	if (left->type == ROSCHA_INT && right->type == ROSCHA_INT) {
 		return eval_integer_infix(env, &inf->token, left, right);
 	}
+	struct slice lstr, rstr;
+	if (roscha_object_slice(left, &lstr) && roscha_object_slice(right, &rstr)) {
+		return eval_string_infix(env, &inf->token, left, right, &lstr, &rstr);
+	}
 
 	return eval_boolean_infix(env, &inf->token, left, right);
 }
@@ -227,7 +343,7 @@ eval_index(struct roscha_env *env, struct indexkey *index)
 	struct roscha_object *res = NULL;
 	struct roscha_object *vec = eval_expression(env, index->left);
 	if (!vec) return NULL;
-	if (vec->type != ROSCHA_VECTOR) {
+	if (vec->type != ROSCHA_VECTOR && vec->type != ROSCHA_RANGE) {
 		eval_error(env, index->token, "expected %s type got %s",
 		           roscha_type_print(ROSCHA_VECTOR),
 		           roscha_type_print(vec->type));
@@ -239,7 +355,14 @@ eval_index(struct roscha_env *env, struct indexkey *index)
 		           roscha_type_print(ROSCHA_INT));
 		goto out2;
 	}
-	if (i->integer > (vec->vector->len - 1)) {
+	if (vec->type == ROSCHA_RANGE) {
+		if ((uint64_t)i->integer >= roscha_range_len(vec)) {
+			res = &obj_null;
+		} else {
+			res = roscha_object_new(vec->range.start
+			                        + i->integer * vec->range.step);
+		}
+	} else if (i->integer > (vec->vector->len - 1)) {
 		res = &obj_null;
 	} else {
 		res = vec->vector->values[i->integer];
@@ -253,13 +376,232 @@ out:
 	return res;
 }
 
+static inline void
+filter_release(struct roscha_object *in, struct vector *args)
+{
+	size_t                i;
+	struct roscha_object *arg;
+	vector_foreach (args, i, arg) {
+		roscha_object_unref(arg);
+	}
+	roscha_object_unref(in);
+}
+
+/*
+ * Look up the filter and evaluate its input and arguments; returns NULL if
+ * there was an error.
+ */
+static inline const struct roscha_filter *
+eval_filter_args(struct roscha_env *env, struct filter *filter,
+                 struct roscha_object **in, struct vector *args)
+{
+	const struct roscha_filter *fn =
+		hmap_gets(env->internal->filters, &filter->name.token.literal);
+	if (!fn) {
+		sds name = slice_string(&filter->name.token.literal, sdsempty());
+		eval_error(env, filter->name.token, "unknown filter %s", name);
+		sdsfree(name);
+		return NULL;
+	}
+	*in = eval_expression(env, filter->left);
+	if (!*in) return NULL;
+	if (filter->args) {
+		size_t             i;
+		struct expression *expr;
+		vector_foreach (filter->args, i, expr) {
+			struct roscha_object *arg = eval_expression(env, expr);
+			if (!arg) {
+				filter_release(*in, args);
+				return NULL;
+			}
+			args->values[args->len++] = arg;
+		}
+	}
+
+	return fn;
+}
+
+static inline void
+filter_args_error(struct roscha_env *env, struct filter *filter)
+{
+	sds name = slice_string(&filter->name.token.literal, sdsempty());
+	eval_error(env, filter->name.token, "invalid arguments for filter %s",
+	           name);
+	sdsfree(name);
+}
+
+static inline struct roscha_object *
+eval_filter(struct roscha_env *env, struct filter *filter)
+{
+	struct roscha_object       *in;
+	void                       *argv[FILTER_MAX_ARGS];
+	struct vector               args = {FILTER_MAX_ARGS, 0, argv};
+	const struct roscha_filter *fn   = eval_filter_args(env, filter, &in, &args);
+	if (!fn) return NULL;
+
+	struct roscha_object *res = NULL;
+	if (fn->value) {
+		res = fn->value(in, &args);
+	} else {
+		sds str = sdsempty();
+		sds out = fn->write(str, in, &args);
+		if (out) {
+			/* Writing escaped markup gives escaped markup */
+			res       = roscha_object_new(out);
+			res->safe = in->safe;
+		} else {
+			sdsfree(str);
+		}
+	}
+	if (!res) {
+		filter_args_error(env, filter);
+	}
+	filter_release(in, &args);
+
+	return res;
+}
+
+/*
+ * Like eval_filter, but concatenates the result to r; sets safe if it was
+ * already escaped.
+ */
+static inline sds
+eval_filter_write(struct roscha_env *env, sds r, struct filter *filter,
+                  bool *safe)
+{
+	struct roscha_object       *in;
+	void                       *argv[FILTER_MAX_ARGS];
+	struct vector               args = {FILTER_MAX_ARGS, 0, argv};
+	const struct roscha_filter *fn   = eval_filter_args(env, filter, &in, &args);
+	*safe                            = false;
+	if (!fn) return r;
+
+	if (fn->write) {
+		sds out = fn->write(r, in, &args);
+		if (out) {
+			r     = out;
+			*safe = in->safe;
+		} else {
+			filter_args_error(env, filter);
+		}
+	} else {
+		struct roscha_object *res = fn->value(in, &args);
+		if (res) {
+			*safe = res->safe;
+			r     = roscha_object_string(res, r);
+			roscha_object_unref(res);
+		} else {
+			filter_args_error(env, filter);
+		}
+	}
+	filter_release(in, &args);
+
+	return r;
+}
+
+static inline sds eval_call(struct roscha_env *, sds r, struct call *);
+
+/* The built-in range(stop), range(start, stop) or range(start, stop, step) */
+static inline struct roscha_object *
+eval_range(struct roscha_env *env, struct call *call)
+{
+	int64_t bounds[3] = {0, 0, 1};
+	size_t  nargs     = call->args->len;
+	for (size_t i = 0; i < nargs; i++) {
+		struct roscha_object *arg = eval_expression(env, call->args->values[i]);
+		if (!arg) return NULL;
+		if (arg->type != ROSCHA_INT) {
+			eval_error(env, call->token,
+			           "range arguments should be of type %s, got %s",
+			           roscha_type_print(ROSCHA_INT),
+			           roscha_type_print(arg->type));
+			roscha_object_unref(arg);
+			return NULL;
+		}
+		/* A single argument is the stop */
+		bounds[nargs == 1 ? 1 : i] = arg->integer;
+		roscha_object_unref(arg);
+	}
+	if (bounds[2] == 0) {
+		eval_error(env, call->token, "range step can't be %i", 0);
+		return NULL;
+	}
+
+	return roscha_object_new_range(bounds[0], bounds[1], bounds[2]);
+}
+
+static inline size_t
+ptrset_slot(const struct ptrset *set, const void *p)
+{
+	uint64_t h = (uintptr_t)p * 0x9e3779b97f4a7c15ull;
+	return (h >> 32) & (set->cap - 1);
+}
+
+static void
+ptrset_grow(struct ptrset *set)
+{
+	struct ptrset grown = {.cap = set->cap ? set->cap * 2 : 64, .len = set->len};
+	grown.slots         = roscha_calloc(grown.cap, sizeof(*grown.slots));
+	for (size_t i = 0; i < set->cap; i++) {
+		if (set->slots[i] == NULL) continue;
+		size_t j = ptrset_slot(&grown, set->slots[i]);
+		while (grown.slots[j] != NULL) {
+			j = (j + 1) & (grown.cap - 1);
+		}
+		grown.slots[j] = set->slots[i];
+	}
+	roscha_free(set->slots);
+	*set = grown;
+}
+
+/* Add the pointer to the set; false if it was already in it */
+static bool
+ptrset_add(struct ptrset *set, const void *p)
+{
+	if ((set->len + 1) * 3 > set->cap * 2) ptrset_grow(set);
+	size_t i = ptrset_slot(set, p);
+	while (set->slots[i] != NULL) {
+		if (set->slots[i] == p) return false;
+		i = (i + 1) & (set->cap - 1);
+	}
+	set->slots[i] = p;
+	set->len++;
+	return true;
+}
+
+static void
+ptrset_clear(struct ptrset *set)
+{
+	roscha_free(set->slots);
+	*set = (struct ptrset){0};
+}
+
+/*
+ * Record a read of the variable path, once per render. The paths seen are
+ * kept with the render rather than in the tree, which is shared by renders.
+ */
+static inline void
+eval_record(struct roscha_env *env, struct expression *path)
+{
+	if (ptrset_add(&env->internal->recorded, path)) {
+		vector_push(env->internal->reads, path);
+	}
+}
+
 static inline struct roscha_object *
 eval_expression(struct roscha_env *env, struct expression *expr)
 {
 	struct roscha_object *obj = NULL;
 	switch (expr->type) {
 	case EXPRESSION_IDENT:
-		obj = roscha_hmap_get(env->vars, &expr->ident.token.literal);
+		if (expr->ident.slot) {
+			obj = env->internal->frame[expr->ident.slot - 1];
+		} else {
+			if (env->internal->reads) {
+				eval_record(env, expr);
+			}
+			obj = roscha_hmap_get(env->vars, &expr->ident.token.literal);
+		}
 		if (!obj) {
 			obj = &obj_null;
 		} else {
@@ -282,24 +624,96 @@ eval_expression(struct roscha_env *env, struct expression *expr)
 		obj = eval_infix(env, &expr->infix);
 		break;
 	case EXPRESSION_MAPKEY:
+		if (expr->indexkey.path && env->internal->reads) {
+			/* The whole path is recorded rather than its prefixes */
+			struct vector *reads = env->internal->reads;
+			eval_record(env, expr);
+			env->internal->reads = NULL;
+			obj                  = eval_mapkey(env, &expr->indexkey);
+			env->internal->reads = reads;
+			break;
+		}
 		obj = eval_mapkey(env, &expr->indexkey);
 		break;
 	case EXPRESSION_INDEX:
 		obj = eval_index(env, &expr->indexkey);
 		break;
+	case EXPRESSION_FILTER:
+		obj = eval_filter(env, &expr->filter);
+		break;
+	case EXPRESSION_CALL: {
+		if (expr->call.macro == NULL) {
+			obj = eval_range(env, &expr->call);
+			break;
+		}
+		sds out   = eval_call(env, sdsempty(), &expr->call);
+		obj       = roscha_object_new(out);
+		obj->safe = true;
+		break;
+	}
 	}
 
 	return obj;
 }
 
+static inline sds
+escape_object(sds r, const struct roscha_object *obj)
+{
+	struct slice str;
+	switch (obj->type) {
+	case ROSCHA_NULL:
+	case ROSCHA_BOOL:
+	case ROSCHA_INT:
+		return roscha_object_string(obj, r);
+	default:
+		break;
+	}
+	if (roscha_object_slice(obj, &str)) {
+		return escape_html(r, str.str + str.start, slice_len(&str));
+	}
+	sds tmp = roscha_object_string(obj, sdsempty());
+	r       = escape_html(r, tmp, sdslen(tmp));
+	sdsfree(tmp);
+
+	return r;
+}
+
 static inline sds
 eval_variable(struct roscha_env *env, sds r, struct variable *var)
 {
+	bool escape = env->autoescape && !var->safe;
+	if (var->expression->type == EXPRESSION_FILTER) {
+		/* The last filter writes straight to the output */
+		bool safe;
+		if (!escape) {
+			return eval_filter_write(env, r, &var->expression->filter, &safe);
+		}
+		sds tmp =
+			eval_filter_write(env, sdsempty(), &var->expression->filter, &safe);
+		if (safe) {
+			r = sdscatsds(r, tmp);
+		} else {
+			r = escape_html(r, tmp, sdslen(tmp));
+		}
+		sdsfree(tmp);
+		return r;
+	}
+
+	if (var->expression->type == EXPRESSION_CALL
+	    && var->expression->call.macro != NULL) {
+		/* Macros are rendered in place; their content is never escaped */
+		return eval_call(env, r, &var->expression->call);
+	}
+
 	struct roscha_object *obj = eval_expression(env, var->expression);
 	if (!obj) {
 		return r;
 	}
-	r = roscha_object_string(obj, r);
+	if (escape && !obj->safe) {
+		r = escape_object(r, obj);
+	} else {
+		r = roscha_object_string(obj, r);
+	}
 	roscha_object_unref(obj);
 
 	return r;
@@ -313,7 +727,8 @@ eval_branch(struct roscha_env *env, sds r, struct branch *br)
 {
 	if (br->condition) {
 		struct roscha_object *cond = eval_expression(env, br->condition);
-		if (cond->boolean) {
+		if (!cond) return r;
+		if (object_truthy(cond)) {
 			r = eval_subblocks(env, r, br->subblocks);
 		} else if (br->next) {
 			r = eval_branch(env, r, br->next);
@@ -328,6 +743,8 @@ eval_branch(struct roscha_env *env, sds r, struct branch *br)
 static inline sds
 eval_loop(struct roscha_env *env, sds r, struct loop *loop)
 {
+	struct roscha_object *seq = eval_expression(env, loop->seq);
+	if (!seq) return r;
 	struct roscha_object *loopv  = roscha_object_new(hmap_new());
 	struct roscha_object *indexv = roscha_object_new(0);
 	roscha_hmap_set(loopv, "index", indexv);
@@ -335,8 +752,6 @@ eval_loop(struct roscha_env *env, sds r, struct loop *loop)
 	struct roscha_object *outerloop = roscha_hmap_set(env->vars, "loop", loopv);
 	struct slice          it        = loop->item.token.literal;
 	struct roscha_object *outeritem = roscha_hmap_get(env->vars, &it);
-	struct roscha_object *seq       = eval_expression(env, loop->seq);
-	if (!seq) return r;
 	if (seq->type == ROSCHA_VECTOR) {
 		struct roscha_object *item;
 		vector_foreach (seq->vector, indexv->integer, item) {
@@ -350,10 +765,11 @@ eval_loop(struct roscha_env *env, sds r, struct loop *loop)
 			}
 		}
 	} else if (seq->type == ROSCHA_HMAP) {
-		struct hmap_iter   *iter = hmap_iter_new(seq->hmap);
+		struct hmap_iter    iter;
 		const struct slice *key;
 		void               *val;
-		hmap_iter_foreach (iter, &key, &val) {
+		hmap_iter_init(&iter, seq->hmap);
+		hmap_iter_foreach (&iter, &key, &val) {
 			struct roscha_object *item = val;
 			indexv->integer++;
 			roscha_hmap_set(env->vars, it, item);
@@ -365,6 +781,33 @@ eval_loop(struct roscha_env *env, sds r, struct loop *loop)
 				break;
 			}
 		}
+	} else if (seq->type == ROSCHA_RANGE) {
+		/*
+		 * Items are made as needed, reusing the last one if it wasn't kept.
+		 * Nothing keeps objects of a request heap past the iteration, their
+		 * refcounts just aren't kept up to date.
+		 */
+		size_t                len  = roscha_range_len(seq);
+		struct roscha_object *item = NULL;
+		for (size_t i = 0; i < len; i++) {
+			int64_t val = seq->range.start + (int64_t)i * seq->range.step;
+			if (item != NULL && (item->heap || item->refcount == 1)) {
+				item->integer = val;
+			} else {
+				roscha_object_unref(item);
+				item = roscha_object_new(val);
+			}
+			indexv->integer = i;
+			roscha_hmap_set(env->vars, it, item);
+			r = eval_subblocks(env, r, loop->subblocks);
+			roscha_hmap_unset(env->vars, &it);
+			if (THERES_ERRORS) break;
+			if (env->internal->brk) {
+				env->internal->brk = false;
+				break;
+			}
+		}
+		roscha_object_unref(item);
 	} else {
 		eval_error(env, loop->seq->token,
 		           "sequence should be of type %s or %s, got %s",
@@ -390,33 +833,210 @@ eval_loop(struct roscha_env *env, sds r, struct loop *loop)
 	return r;
 }
 
-static inline struct tblock *
-get_child_tblock(struct roscha_env *env, struct slice *name,
-                 const struct template *tmpl)
+/* The name of the template extended by tmpl, or NULL if there is none */
+static const struct slice *
+template_parent(const struct template *tmpl)
+{
+	if (tmpl->blocks->len == 0) return NULL;
+	struct block *blk = tmpl->blocks->values[0];
+	if (blk->type == BLOCK_TAG && blk->tag.type == TAG_EXTENDS) {
+		return &blk->tag.parent.name->value;
+	}
+
+	return NULL;
+}
+
+static void
+template_not_found(struct roscha_env *env, const struct slice *name)
+{
+	struct roscha_heap *heap   = roscha_heap_leave();
+	sds                 errmsg = sdscat(sdsempty(), "template \"");
+	errmsg                     = slice_string(name, errmsg);
+	errmsg                     = sdscat(errmsg, "\" not found");
+	vector_push(env->errors, errmsg);
+	roscha_heap_enter(heap);
+}
+
+/* Report why the extends chain of tmpl couldn't be resolved */
+static void
+template_unresolved(struct roscha_env *env, const struct template *tmpl)
+{
+	struct hmap *templates = env->internal->templates;
+	for (size_t depth = 0; depth < templates->size; depth++) {
+		const struct slice *parent = template_parent(tmpl);
+		tmpl                       = hmap_gets(templates, parent);
+		if (tmpl == NULL) {
+			template_not_found(env, parent);
+			return;
+		}
+	}
+	struct roscha_heap *heap = roscha_heap_leave();
+	vector_push(env->errors, sdscatfmt(sdsempty(),
+	                                   "template \"%s\" extends itself",
+	                                   tmpl->name));
+	roscha_heap_enter(heap);
+}
+
+/*
+ * Render the included template in place. Static names were resolved when the
+ * templates were added; others are looked up by their value, and are limited
+ * in depth instead of checked for cycles.
+ */
+static inline sds
+eval_include(struct roscha_env *env, sds r, struct include *inc)
 {
-	struct tblock *tblk = NULL;
-	if (tmpl->child) {
-		tblk = get_child_tblock(env, name, tmpl->child);
+	const struct template *tmpl = inc->tmpl;
+	if (inc->cycle) {
+		eval_error(env, inc->token, "cyclic include of template \"%s\"",
+		           tmpl->name);
+		return r;
+	}
+	if (tmpl == NULL) {
+		struct roscha_object *name = eval_expression(env, inc->name);
+		if (THERES_ERRORS) return r;
+		struct slice sname;
+		if (!roscha_object_slice(name, &sname)) {
+			eval_error(env, inc->token, "include expects a string, got %s",
+			           roscha_type_print(name->type));
+			roscha_object_unref(name);
+			return r;
+		}
+		tmpl = hmap_gets(env->internal->templates, &sname);
+		if (tmpl == NULL) {
+			template_not_found(env, &sname);
+		}
+		roscha_object_unref(name);
+		if (tmpl == NULL) return r;
 	}
-	if (!tblk) {
-		return hmap_gets(tmpl->tblocks, name);
+	if (tmpl->root == NULL) {
+		template_unresolved(env, tmpl);
+		return r;
+	}
+	if (env->internal->include_depth >= INCLUDE_MAX_DEPTH) {
+		eval_error(env, inc->token, "includes nested deeper than %u",
+		           INCLUDE_MAX_DEPTH);
+		return r;
 	}
 
-	return tblk;
+	const struct template *eval_tmpl   = env->internal->eval_tmpl;
+	struct tblock *const  *eval_blocks = env->internal->eval_blocks;
+	env->internal->eval_tmpl           = tmpl->root;
+	env->internal->eval_blocks         = tmpl->resolved;
+	env->internal->include_depth++;
+
+	r = eval_subblocks(env, r, tmpl->root->blocks);
+
+	env->internal->include_depth--;
+	env->internal->eval_tmpl   = eval_tmpl;
+	env->internal->eval_blocks = eval_blocks;
+
+	return r;
 }
 
 static inline sds
 eval_tblock(struct roscha_env *env, sds r, struct tblock *tblk)
 {
-	struct tblock *child = get_child_tblock(env, &tblk->name.token.literal,
-	                                        env->internal->eval_tmpl);
-	if (child) {
-		tblk = child;
-	}
+	tblk = env->internal->eval_blocks[tblk->id];
 
 	return eval_subblocks(env, r, tblk->subblocks);
 }
 
+/*
+ * Render the body of the called macro, with the arguments evaluated into a
+ * frame on the stack that its parameters were bound to when parsing.
+ */
+static inline sds
+eval_call(struct roscha_env *env, sds r, struct call *call)
+{
+	struct macro *macro = call->macro;
+	if (env->internal->call_depth >= MACRO_MAX_DEPTH) {
+		eval_error(env, call->token, "macro calls nested deeper than %u",
+		           MACRO_MAX_DEPTH);
+		return r;
+	}
+
+	struct roscha_object *frame[MACRO_MAX_PARAMS];
+	size_t                nparams = macro->params->len;
+	size_t                i;
+	for (i = 0; i < call->args->len; i++) {
+		frame[i] = eval_expression(env, call->args->values[i]);
+		if (frame[i] == NULL) frame[i] = &obj_null;
+	}
+	for (; i < nparams; i++) {
+		frame[i] = &obj_null;
+	}
+
+	if (!THERES_ERRORS) {
+		struct roscha_object **outer = env->internal->frame;
+		env->internal->frame         = frame;
+		env->internal->call_depth++;
+		r = eval_subblocks(env, r, macro->subblocks);
+		env->internal->call_depth--;
+		env->internal->frame = outer;
+	}
+
+	for (i = 0; i < nparams; i++) {
+		roscha_object_unref(frame[i]);
+	}
+
+	return r;
+}
+
+/*
+ * Append the cached output of the fragment, or render it and cache what was
+ * appended. Outputs cut short by an error or a break aren't cached.
+ */
+static inline sds
+eval_fragment(struct roscha_env *env, sds r, struct fragment *frag)
+{
+	struct roscha_cache *cache = env->cache;
+	if (cache == NULL) {
+		return eval_subblocks(env, r, frag->subblocks);
+	}
+
+	struct roscha_object *keyobj = eval_expression(env, frag->key);
+	if (THERES_ERRORS) return r;
+	sds key = sdsdup(frag->prefix);
+	key     = sdscatlen(key, env->autoescape ? "e" : "r", 1);
+	key     = roscha_object_string(keyobj, key);
+	roscha_object_unref(keyobj);
+
+	sds hit = roscha_cache_get(cache, key, sdslen(key), r);
+	if (hit != NULL) {
+		sdsfree(key);
+		return hit;
+	}
+
+	int64_t ttl = 0;
+	if (frag->ttl != NULL) {
+		struct roscha_object *obj = eval_expression(env, frag->ttl);
+		if (THERES_ERRORS) goto out;
+		if (obj->type != ROSCHA_INT) {
+			eval_error(env, frag->token, "cache ttl must be an int, got %s",
+			           roscha_type_print(obj->type));
+			roscha_object_unref(obj);
+			goto out;
+		}
+		ttl = obj->integer;
+		roscha_object_unref(obj);
+		if (ttl < 0) {
+			eval_error(env, frag->token, "cache ttl can't be negative, got %I",
+			           ttl);
+			goto out;
+		}
+	}
+
+	size_t start = sdslen(r);
+	r            = eval_subblocks(env, r, frag->subblocks);
+	if (!THERES_ERRORS && !env->internal->brk) {
+		roscha_cache_put(cache, key, sdslen(key), r + start, sdslen(r) - start,
+		                 ttl);
+	}
+out:
+	sdsfree(key);
+	return r;
+}
+
 static inline sds
 eval_tag(struct roscha_env *env, sds r, struct tag *tag)
 {
@@ -427,6 +1047,10 @@ eval_tag(struct roscha_env *env, sds r, struct tag *tag)
 		return eval_loop(env, r, &tag->loop);
 	case TAG_BLOCK:
 		return eval_tblock(env, r, &tag->tblock);
+	case TAG_INCLUDE:
+		return eval_include(env, r, &tag->include);
+	case TAG_CACHE:
+		return eval_fragment(env, r, &tag->fragment);
 	case TAG_EXTENDS: {
 		eval_error(env, tag->token, "extends tag can only be the first tag",
 		           tag->token);
@@ -470,79 +1094,1212 @@ eval_subblocks(struct roscha_env *env, sds r, struct vector *blks)
 }
 
 static inline sds
-eval_template(struct roscha_env *env, const struct slice *name,
-              struct template *child)
+eval_template(struct roscha_env *env, const struct slice *name)
 {
-	struct template *tmpl = hmap_gets(env->internal->templates, name);
+	const struct template *tmpl = hmap_gets(env->internal->templates, name);
 	if (!tmpl) {
-		sds errmsg = sdscat(sdsempty(), "template \"");
-		errmsg     = slice_string(name, errmsg);
-		errmsg     = sdscat(errmsg, "\" not found");
-		vector_push(env->errors, errmsg);
+		template_not_found(env, name);
 		return NULL;
 	}
-
-	tmpl->child              = child;
-	env->internal->eval_tmpl = tmpl;
-
-	struct block *blk = tmpl->blocks->values[0];
-	if (blk->type == BLOCK_TAG && blk->tag.type == TAG_EXTENDS) {
-		struct slice name = blk->tag.parent.name->value;
-		return eval_template(env, &name, tmpl);
+	if (!tmpl->root) {
+		template_unresolved(env, tmpl);
+		return NULL;
 	}
 
+	env->internal->eval_tmpl   = tmpl->root;
+	env->internal->eval_blocks = tmpl->resolved;
+
 	sds r = sdsempty();
-	r     = eval_subblocks(env, r, tmpl->blocks);
+	r     = eval_subblocks(env, r, tmpl->root->blocks);
 
-	env->internal->eval_tmpl = NULL;
+	env->internal->eval_tmpl   = NULL;
+	env->internal->eval_blocks = NULL;
 
 	return r;
 }
 
-void
-roscha_init(void)
+/* The variable paths a render read, which its output depends on */
+struct readset {
+	/* vector of struct expression, either identifiers or paths */
+	struct vector *paths;
+	/* The paths one per line, e.g. "user.name\nitems\n" */
+	sds text;
+};
+
+/* The sets of reads seen when rendering a template */
+struct memo {
+	sds            name;
+	struct readset sets[MEMO_MAX_READSETS];
+	size_t         len;
+	/* The set to replace next once all of them are used */
+	size_t next;
+};
+
+/* Look up a recorded path without reporting errors; NULL if it has none */
+static const struct roscha_object *
+memo_resolve(struct roscha_env *env, const struct expression *path)
 {
-	parser_init();
+	const struct roscha_object *obj;
+	if (path->type == EXPRESSION_IDENT) {
+		obj = hmap_gets(env->vars->hmap, &path->ident.token.literal);
+		return obj ? obj : &obj_null;
+	}
+	const struct roscha_object *map = memo_resolve(env, path->indexkey.left);
+	if (map == NULL || map->type != ROSCHA_HMAP) return NULL;
+	obj = hmap_gets(map->hmap, &path->indexkey.key->token.literal);
+	return obj ? obj : &obj_null;
 }
 
-void
-roscha_deinit(void)
+static inline uint64_t
+memo_mix(uint64_t h, uint64_t v)
 {
-	parser_deinit();
+	h = (h ^ v) * 0xbf58476d1ce4e5b9ull;
+	return h ^ (h >> 31);
 }
 
-struct roscha_env *
-roscha_env_new(void)
+/*
+ * Hash the value into h, telling apart all the values that could render
+ * differently; strings of all kinds hash the same.
+ */
+static uint64_t
+memo_fingerprint(uint64_t h, const struct roscha_object *obj)
 {
-	struct roscha_env *env   = calloc(1, sizeof(*env));
-	env->internal            = calloc(1, sizeof(*env->internal));
-	env->vars                = roscha_object_new(hmap_new());
-	env->internal->templates = hmap_new();
-	env->errors              = vector_new();
+	if (obj == NULL) return memo_mix(h, 'x');
 
-	return env;
+	struct slice s;
+	h = memo_mix(h, obj->type);
+	switch (obj->type) {
+	case ROSCHA_NULL:
+		return h;
+	case ROSCHA_BOOL:
+		return memo_mix(h, obj->boolean);
+	case ROSCHA_INT:
+		return memo_mix(h, obj->integer);
+	case ROSCHA_STRING:
+	case ROSCHA_SLICE:
+	case ROSCHA_SSTR:
+		roscha_object_slice(obj, &s);
+		h = memo_mix(h, slice_len(&s));
+		return memo_mix(h, slice_hash(&s));
+	case ROSCHA_VECTOR: {
+		size_t                i;
+		struct roscha_object *item;
+		h = memo_mix(h, obj->vector->len);
+		vector_foreach (obj->vector, i, item) {
+			h = memo_fingerprint(h, item);
+		}
+		return h;
+	}
+	case ROSCHA_HMAP: {
+		struct hmap_iter    iter;
+		const struct slice *k;
+		void               *val;
+		h = memo_mix(h, obj->hmap->size);
+		hmap_iter_init(&iter, obj->hmap);
+		hmap_iter_foreach (&iter, &k, &val) {
+			h = memo_mix(h, slice_hash(k));
+			h = memo_fingerprint(h, val);
+		}
+		return h;
+	}
+	case ROSCHA_RANGE:
+		h = memo_mix(h, obj->range.start);
+		h = memo_mix(h, obj->range.stop);
+		return memo_mix(h, obj->range.step);
+	}
+
+	return h;
 }
 
-bool
-roscha_env_add_template(struct roscha_env *env, char *name, char *body)
+/*
+ * The cache key of a render that read set: the template, the generation of
+ * the templates, whether output is escaped, the paths and the fingerprints of
+ * their current values.
+ */
+static sds
+memo_key(struct roscha_env *env, const struct slice *name,
+         const struct readset *set)
 {
-	struct parser   *parser = parser_new(name, body);
-	struct template *tmpl   = parser_parse_template(parser);
-	if (parser->errors->len > 0) {
-		sds errmsg = NULL;
-		while ((errmsg = vector_pop(parser->errors)) != NULL) {
-			vector_push(env->errors, errmsg);
-		}
-		parser_destroy(parser);
-		template_destroy(tmpl);
-		return false;
+	sds key = slice_string(name, sdsempty());
+	key     = sdscatlen(key, "", 1);
+	key     = sdscatlen(key, &env->internal->generation,
+	                    sizeof(env->internal->generation));
+	key     = sdscatlen(key, &env->autoescape, sizeof(env->autoescape));
+	key     = sdscatsds(key, set->text);
+
+	size_t             i;
+	struct expression *path;
+	vector_foreach (set->paths, i, path) {
+		uint64_t fp = memo_fingerprint(0, memo_resolve(env, path));
+		key         = sdscatlen(key, &fp, sizeof(fp));
 	}
-	parser_destroy(parser);
-	hmap_sets(env->internal->templates, slice_whole(name), tmpl);
-	return true;
+
+	return key;
 }
 
-bool
+static void
+memo_destroy(struct memo *memo)
+{
+	for (size_t i = 0; i < memo->len; i++) {
+		vector_free(memo->sets[i].paths);
+		sdsfree(memo->sets[i].text);
+	}
+	sdsfree(memo->name);
+	roscha_free(memo);
+}
+
+static void
+memo_destroy_cb(const struct slice *key, void *val)
+{
+	memo_destroy(val);
+}
+
+/*
+ * Add the paths read by a render of the template to its memo, unless the same
+ * ones were read before, which sets known; returns the index of their set.
+ */
+static size_t
+memo_add(struct roscha_env *env, const struct slice *name,
+         struct vector *paths, bool *known)
+{
+	struct memo *memo = hmap_gets(env->internal->memos, name);
+	if (memo == NULL) {
+		memo       = roscha_calloc(1, sizeof(*memo));
+		memo->name = slice_string(name, sdsempty());
+		hmap_sets(env->internal->memos, slice_whole(memo->name), memo);
+	}
+
+	size_t             i;
+	struct expression *path;
+	sds                text = sdsempty();
+	vector_foreach (paths, i, path) {
+		text = expression_string(path, text);
+		text = sdscatlen(text, "\n", 1);
+	}
+	for (i = 0; i < memo->len; i++) {
+		if (sdslen(memo->sets[i].text) == sdslen(text)
+		    && memcmp(memo->sets[i].text, text, sdslen(text)) == 0) {
+			vector_free(paths);
+			sdsfree(text);
+			*known = true;
+			return i;
+		}
+	}
+
+	if (memo->len < MEMO_MAX_READSETS) {
+		i = memo->len++;
+	} else {
+		i = memo->next;
+		vector_free(memo->sets[i].paths);
+		sdsfree(memo->sets[i].text);
+		memo->next = (memo->next + 1) % MEMO_MAX_READSETS;
+	}
+	memo->sets[i].paths = paths;
+	memo->sets[i].text  = text;
+	*known              = false;
+
+	return i;
+}
+
+/*
+ * Render the template through the render cache: the output is looked up by
+ * the values of the paths read by earlier renders, otherwise it is rendered
+ * while recording the paths it reads and then cached. The same values of the
+ * same paths make a render take the same branches and read the same paths
+ * again, so they always give the same output.
+ */
+static sds
+eval_memoized(struct roscha_env *env, const struct slice *name)
+{
+	struct roscha_cache *cache = env->render_cache;
+	struct memo         *memo  = hmap_gets(env->internal->memos, name);
+	size_t               nkeys = memo != NULL ? memo->len : 0;
+	sds                  keys[MEMO_MAX_READSETS];
+	sds                  r = sdsempty();
+	for (size_t i = 0; i < nkeys; i++) {
+		keys[i] = memo_key(env, name, &memo->sets[i]);
+		sds hit = roscha_cache_get(cache, keys[i], sdslen(keys[i]), r);
+		if (hit != NULL) {
+			nkeys = i + 1;
+			r     = hit;
+			goto out;
+		}
+	}
+	sdsfree(r);
+
+	/* Memos outlive requests, so they are never allocated in a heap */
+	struct roscha_heap *heap  = roscha_heap_leave();
+	struct vector      *reads = vector_new();
+	roscha_heap_enter(heap);
+
+	env->internal->reads = reads;
+	r                    = eval_template(env, name);
+	env->internal->reads = NULL;
+	ptrset_clear(&env->internal->recorded);
+
+	if (r == NULL || THERES_ERRORS) {
+		vector_free(reads);
+		goto out;
+	}
+	bool known;
+	heap     = roscha_heap_leave();
+	size_t i = memo_add(env, name, reads, &known);
+	memo     = hmap_gets(env->internal->memos, name);
+	roscha_heap_enter(heap);
+	/* The values are the same as when looking it up */
+	sds key = known ? keys[i] : memo_key(env, name, &memo->sets[i]);
+	roscha_cache_put(cache, key, sdslen(key), r, sdslen(r), 0);
+	if (!known) sdsfree(key);
+
+out:
+	for (size_t i = 0; i < nkeys; i++) {
+		sdsfree(keys[i]);
+	}
+	return r;
+}
+
+/* The output of a block rendered incrementally */
+struct segment {
+	struct block *blk;
+	sds           text;
+	/* vector of the paths the block read, and their fingerprints */
+	struct vector *paths;
+	uint64_t      *fingerprints;
+};
+
+/* The output of a template rendered incrementally, split in segments */
+struct patchdoc {
+	sds name;
+	/* env->autoescape when the segments were rendered */
+	bool autoescape;
+	/* vector of struct segment */
+	struct vector *segments;
+};
+
+static void
+patchdoc_destroy(struct patchdoc *doc)
+{
+	size_t          i;
+	struct segment *seg;
+	vector_foreach (doc->segments, i, seg) {
+		sdsfree(seg->text);
+		if (seg->paths) vector_free(seg->paths);
+		roscha_free(seg->fingerprints);
+		roscha_free(seg);
+	}
+	vector_free(doc->segments);
+	sdsfree(doc->name);
+	roscha_free(doc);
+}
+
+static void
+patchdoc_destroy_cb(const struct slice *key, void *val)
+{
+	patchdoc_destroy(val);
+}
+
+/*
+ * Split the blocks in segments, descending into {% block %} tags, whose
+ * bodies are usually most of a page.
+ */
+static void
+patchdoc_split(struct roscha_env *env, struct vector *segments,
+               const struct vector *blks)
+{
+	size_t        i;
+	struct block *blk;
+	vector_foreach (blks, i, blk) {
+		if (blk->type == BLOCK_TAG && blk->tag.type == TAG_BLOCK) {
+			struct tblock *tblk = env->internal->eval_blocks[blk->tag.tblock.id];
+			patchdoc_split(env, segments, tblk->subblocks);
+			continue;
+		}
+		struct segment *seg = roscha_calloc(1, sizeof(*seg));
+		seg->blk            = blk;
+		vector_push(segments, seg);
+	}
+}
+
+/* Whether any of the paths read by the segment has a different value */
+static bool
+segment_changed(struct roscha_env *env, const struct segment *seg)
+{
+	if (seg->paths == NULL) return true;
+	size_t             i;
+	struct expression *path;
+	vector_foreach (seg->paths, i, path) {
+		uint64_t fp = memo_fingerprint(0, memo_resolve(env, path));
+		if (fp != seg->fingerprints[i]) return true;
+	}
+
+	return false;
+}
+
+/* Render the segment again, recording the paths it reads */
+static void
+segment_render(struct roscha_env *env, struct segment *seg)
+{
+	if (seg->paths) vector_free(seg->paths);
+	roscha_free(seg->fingerprints);
+	seg->paths           = vector_new();
+	env->internal->reads = seg->paths;
+	seg->text            = eval_block(env, sdsempty(), seg->blk);
+	env->internal->reads = NULL;
+	ptrset_clear(&env->internal->recorded);
+
+	seg->fingerprints =
+		roscha_malloc(sizeof(*seg->fingerprints) * (seg->paths->len + 1));
+	size_t             i;
+	struct expression *path;
+	vector_foreach (seg->paths, i, path) {
+		seg->fingerprints[i] = memo_fingerprint(0, memo_resolve(env, path));
+	}
+}
+
+/*
+ * Render the segments of the template whose paths changed value since the
+ * last time, or all of them the first time; see
+ * roscha_env_render_incremental.
+ */
+static sds
+eval_incremental(struct roscha_env *env, const struct slice *name,
+                 struct vector *changes)
+{
+	const struct template *tmpl = hmap_gets(env->internal->templates, name);
+	if (!tmpl) {
+		template_not_found(env, name);
+		return NULL;
+	}
+	if (!tmpl->root) {
+		template_unresolved(env, tmpl);
+		return NULL;
+	}
+	env->internal->eval_tmpl   = tmpl->root;
+	env->internal->eval_blocks = tmpl->resolved;
+
+	struct patchdoc *doc = hmap_gets(env->internal->patchdocs, name);
+	if (doc != NULL && doc->autoescape != env->autoescape) {
+		/* All the segments might render differently */
+		hmap_removes(env->internal->patchdocs, name);
+		patchdoc_destroy(doc);
+		doc = NULL;
+	}
+	if (doc == NULL) {
+		doc             = roscha_calloc(1, sizeof(*doc));
+		doc->name       = slice_string(name, sdsempty());
+		doc->autoescape = env->autoescape;
+		doc->segments   = vector_new();
+		patchdoc_split(env, doc->segments, tmpl->root->blocks);
+		hmap_sets(env->internal->patchdocs, slice_whole(doc->name), doc);
+	}
+
+	size_t          start = 0;
+	size_t          i;
+	struct segment *seg;
+	vector_foreach (doc->segments, i, seg) {
+		size_t len = seg->text ? sdslen(seg->text) : 0;
+		if (segment_changed(env, seg)) {
+			sds old = seg->text;
+			segment_render(env, seg);
+			if (THERES_ERRORS) {
+				sdsfree(old);
+				break;
+			}
+			bool same = old != NULL && sdslen(old) == sdslen(seg->text)
+			            && memcmp(old, seg->text, sdslen(old)) == 0;
+			if (!same && changes != NULL) {
+				struct roscha_change *change = roscha_malloc(sizeof(*change));
+				change->start                = start;
+				change->len                  = len;
+				change->text                 = sdsdup(seg->text);
+				vector_push(changes, change);
+			}
+			sdsfree(old);
+		}
+		start += len;
+	}
+
+	env->internal->eval_tmpl   = NULL;
+	env->internal->eval_blocks = NULL;
+
+	if (THERES_ERRORS) {
+		/* Some segments are stale, start over next time */
+		hmap_removes(env->internal->patchdocs, name);
+		patchdoc_destroy(doc);
+		return NULL;
+	}
+	if (changes != NULL) return NULL;
+
+	sds r = sdsempty();
+	vector_foreach (doc->segments, i, seg) {
+		r = sdscatsds(r, seg->text);
+	}
+	return r;
+}
+
+/* Forget the reads of all templates, which might have changed */
+static void
+env_clear_memos(struct roscha_env *env)
+{
+	hmap_destroy(env->internal->memos, memo_destroy_cb);
+	hmap_destroy(env->internal->patchdocs, patchdoc_destroy_cb);
+	env->internal->memos     = hmap_new();
+	env->internal->patchdocs = hmap_new();
+	env->internal->generation++;
+}
+
+/*
+ * Load time folding: runs of blocks that render the same every time, such as
+ * content, {{ }} of literals and the branch an if with literal conditions
+ * always takes, are pre-rendered into a single content block. When
+ * specializing a template the variables of env->internal->consts count as
+ * literals too, and so do the filters applied to them.
+ */
+
+/* Whether the variable is substituted, i.e. a const not hidden by a loop */
+static bool
+fold_const_ident(const struct roscha_env *env, const struct ident *ident)
+{
+	const struct roscha_ *in = env->internal;
+	if (in->consts == NULL || ident->slot) return false;
+	if (hmap_gets(in->consts->hmap, &ident->token.literal) == NULL) {
+		return false;
+	}
+	size_t              i;
+	const struct slice *name;
+	vector_foreach (in->shadowed, i, name) {
+		if (slice_eq(name, &ident->token.literal)) return false;
+	}
+
+	return true;
+}
+
+/* Whether the infix is an and/or whose literal left side decides the result */
+static bool
+fold_decides(const struct expression *expr)
+{
+	const struct expression *left = expr->infix.left;
+	bool                     truthy;
+	if (expr->token.type != TOKEN_AND && expr->token.type != TOKEN_OR) {
+		return false;
+	}
+	if (left->type == EXPRESSION_INT) {
+		truthy = left->integer.value != 0;
+	} else if (left->type == EXPRESSION_BOOL) {
+		truthy = left->boolean.value;
+	} else {
+		return false;
+	}
+
+	return truthy == (expr->token.type == TOKEN_OR);
+}
+
+/* Whether the expression only has literals, so it always evaluates the same */
+static bool
+fold_constant(const struct roscha_env *env, const struct expression *expr)
+{
+	size_t                   i;
+	const struct expression *arg;
+	switch (expr->type) {
+	case EXPRESSION_INT:
+	case EXPRESSION_BOOL:
+	case EXPRESSION_STRING:
+		return true;
+	case EXPRESSION_IDENT:
+		return fold_const_ident(env, &expr->ident);
+	case EXPRESSION_PREFIX:
+		return fold_constant(env, expr->prefix.right);
+	case EXPRESSION_INFIX:
+		/* Left to the render, in case it divides by zero */
+		if (expr->token.type == TOKEN_SLASH) return false;
+		if (fold_decides(expr)) return true;
+		return fold_constant(env, expr->infix.left)
+		       && fold_constant(env, expr->infix.right);
+	case EXPRESSION_MAPKEY:
+		return fold_constant(env, expr->indexkey.left);
+	case EXPRESSION_INDEX:
+		return fold_constant(env, expr->indexkey.left)
+		       && fold_constant(env, expr->indexkey.key);
+	case EXPRESSION_FILTER:
+		/* Filters can be added after loading, but not after specializing */
+		if (env->internal->consts == NULL) return false;
+		if (!fold_constant(env, expr->filter.left)) return false;
+		if (expr->filter.args == NULL) return true;
+		vector_foreach (expr->filter.args, i, arg) {
+			if (!fold_constant(env, arg)) return false;
+		}
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Evaluate a constant expression, or return NULL if it fails, leaving the
+ * error to be reported when rendering.
+ */
+static struct roscha_object *
+fold_eval(struct roscha_env *env, struct expression *expr)
+{
+	size_t                nerrors = env->errors->len;
+	struct roscha_object *obj     = eval_expression(env, expr);
+	if (env->errors->len == nerrors) return obj;
+
+	while (env->errors->len > nerrors) {
+		sdsfree(vector_pop(env->errors));
+	}
+	roscha_object_unref(obj);
+	return NULL;
+}
+
+/*
+ * Replace the constant parts of the expression with literals of their values,
+ * as long as they are ints, bools or strings.
+ */
+static void
+fold_substitute(struct roscha_env *env, struct template *tmpl,
+                struct expression **expr)
+{
+	struct expression *e = *expr;
+	size_t             i;
+	switch (e->type) {
+	case EXPRESSION_INT:
+	case EXPRESSION_BOOL:
+	case EXPRESSION_STRING:
+		return;
+	default:
+		break;
+	}
+	if (fold_constant(env, e)) {
+		struct roscha_object *obj = fold_eval(env, e);
+		if (obj == NULL) return;
+		struct expression *lit = NULL;
+		struct slice       str;
+		if (obj->type == ROSCHA_INT) {
+			lit                = roscha_malloc(sizeof(*lit));
+			lit->type          = EXPRESSION_INT;
+			lit->token         = e->token;
+			lit->token.type    = TOKEN_INT;
+			lit->integer.value = obj->integer;
+		} else if (obj->type == ROSCHA_BOOL) {
+			lit                = roscha_malloc(sizeof(*lit));
+			lit->type          = EXPRESSION_BOOL;
+			lit->token         = e->token;
+			lit->token.type    = obj->boolean ? TOKEN_TRUE : TOKEN_FALSE;
+			lit->boolean.value = obj->boolean;
+		} else if (roscha_object_slice(obj, &str)) {
+			sds text = sdsnewlen(str.str + str.start, slice_len(&str));
+			if (tmpl->pool == NULL) tmpl->pool = vector_new();
+			vector_push(tmpl->pool, text);
+			lit                = roscha_malloc(sizeof(*lit));
+			lit->type          = EXPRESSION_STRING;
+			lit->token         = e->token;
+			lit->token.type    = TOKEN_STRING;
+			lit->string.value  = slice_new(text, 0, sdslen(text));
+			lit->token.literal = lit->string.value;
+		}
+		roscha_object_unref(obj);
+		if (lit != NULL) {
+			expression_destroy(e);
+			*expr = lit;
+		}
+		return;
+	}
+
+	switch (e->type) {
+	case EXPRESSION_PREFIX:
+		fold_substitute(env, tmpl, &e->prefix.right);
+		break;
+	case EXPRESSION_INFIX:
+		fold_substitute(env, tmpl, &e->infix.left);
+		fold_substitute(env, tmpl, &e->infix.right);
+		/* A substituted left side can decide an and/or */
+		if (fold_decides(e)) fold_substitute(env, tmpl, expr);
+		break;
+	case EXPRESSION_MAPKEY:
+		fold_substitute(env, tmpl, &e->indexkey.left);
+		break;
+	case EXPRESSION_INDEX:
+		fold_substitute(env, tmpl, &e->indexkey.left);
+		fold_substitute(env, tmpl, &e->indexkey.key);
+		break;
+	case EXPRESSION_FILTER:
+		fold_substitute(env, tmpl, &e->filter.left);
+		if (e->filter.args == NULL) break;
+		for (i = 0; i < e->filter.args->len; i++) {
+			fold_substitute(env, tmpl,
+			                (struct expression **)&e->filter.args->values[i]);
+		}
+		break;
+	case EXPRESSION_CALL:
+		for (i = 0; i < e->call.args->len; i++) {
+			fold_substitute(env, tmpl,
+			                (struct expression **)&e->call.args->values[i]);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Whether the blocks have tags that are referenced from elsewhere in the
+ * template, so they can't be dropped.
+ */
+static bool
+fold_referenced(const struct vector *blks)
+{
+	size_t        i;
+	struct block *blk;
+	vector_foreach (blks, i, blk) {
+		if (blk->type != BLOCK_TAG) continue;
+		switch (blk->tag.type) {
+		case TAG_BLOCK:
+		case TAG_INCLUDE:
+		case TAG_MACRO:
+			return true;
+		case TAG_IF:
+			for (struct branch *br = blk->tag.cond.root; br; br = br->next) {
+				if (fold_referenced(br->subblocks)) return true;
+			}
+			break;
+		case TAG_FOR:
+			if (fold_referenced(blk->tag.loop.subblocks)) return true;
+			break;
+		case TAG_CACHE:
+			if (fold_referenced(blk->tag.fragment.subblocks)) return true;
+			break;
+		default:
+			break;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Find the branch the if always takes, NULL if none; returns false if it
+ * depends on the variables, or if the others can't be dropped.
+ */
+static bool
+fold_branch(struct roscha_env *env, struct cond *cond, struct branch **taken)
+{
+	struct branch *br;
+	for (br = cond->root; br != NULL; br = br->next) {
+		if (br->condition == NULL) break;
+		if (!fold_constant(env, br->condition)) return false;
+		struct roscha_object *obj = fold_eval(env, br->condition);
+		if (obj == NULL) return false;
+		bool truthy = object_truthy(obj);
+		roscha_object_unref(obj);
+		if (truthy) break;
+	}
+	for (struct branch *other = cond->root; other; other = other->next) {
+		if (other != br && fold_referenced(other->subblocks)) return false;
+	}
+
+	*taken = br;
+	return true;
+}
+
+/*
+ * Drop the branches of an if that depends on the variables whose conditions
+ * are always false, and the ones after a condition that is always true, which
+ * becomes the else branch.
+ */
+static void
+fold_prune(struct roscha_env *env, struct cond *cond)
+{
+	struct branch **link = &cond->root;
+	struct branch  *br;
+	while ((br = *link) != NULL && br->condition != NULL) {
+		struct roscha_object *obj = NULL;
+		if (fold_constant(env, br->condition)) {
+			obj = fold_eval(env, br->condition);
+		}
+		if (obj == NULL) {
+			link = &br->next;
+			continue;
+		}
+		bool truthy = object_truthy(obj);
+		roscha_object_unref(obj);
+		if (truthy) {
+			bool referenced = false;
+			for (struct branch *rest = br->next; rest; rest = rest->next) {
+				referenced = referenced || fold_referenced(rest->subblocks);
+			}
+			if (referenced) return;
+			expression_destroy(br->condition);
+			br->condition = NULL;
+			if (br->next) branch_destroy(br->next);
+			br->next = NULL;
+			return;
+		}
+		if (fold_referenced(br->subblocks)) {
+			link = &br->next;
+			continue;
+		}
+		*link    = br->next;
+		br->next = NULL;
+		branch_destroy(br);
+	}
+}
+
+/*
+ * If the block renders the same every time, append its output to out and
+ * return true.
+ */
+static bool
+fold_static(struct roscha_env *env, struct block *blk, sds *out)
+{
+	switch (blk->type) {
+	case BLOCK_CONTENT:
+		*out = slice_string(&blk->token.literal, *out);
+		return true;
+	case BLOCK_TAG:
+		return blk->tag.type == TAG_CLOSE;
+	case BLOCK_VARIABLE:
+		break;
+	}
+
+	if (!fold_constant(env, blk->variable.expression)) return false;
+	struct roscha_object *obj = fold_eval(env, blk->variable.expression);
+	if (obj == NULL) return false;
+	sds str = roscha_object_string(obj, sdsempty());
+	roscha_object_unref(obj);
+
+	/* Autoescape can change after loading, so only output it leaves as is */
+	sds  escaped = escape_html(sdsempty(), str, sdslen(str));
+	bool same    = sdslen(escaped) == sdslen(str);
+	sdsfree(escaped);
+	if (!same && !blk->variable.safe) {
+		sdsfree(str);
+		return false;
+	}
+	*out = sdscatsds(*out, str);
+	sdsfree(str);
+
+	return true;
+}
+
+/* Replace runs of static blocks with content blocks, see fold_static */
+static struct vector *
+fold_runs(struct roscha_env *env, struct template *tmpl, struct vector *blks)
+{
+	struct vector *out = vector_new();
+	size_t         i   = 0;
+	while (i < blks->len) {
+		struct block *first = blks->values[i];
+		struct block *only  = NULL;
+		size_t        ntext = 0;
+		size_t        j;
+		sds           text = sdsempty();
+		for (j = i; j < blks->len; j++) {
+			struct block *blk = blks->values[j];
+			if (!fold_static(env, blk, &text)) break;
+			if (blk->type != BLOCK_TAG) {
+				only = blk;
+				ntext++;
+			}
+		}
+		if (j == i) {
+			vector_push(out, first);
+			sdsfree(text);
+			i++;
+			continue;
+		}
+
+		if (ntext == 1 && only->type == BLOCK_CONTENT) {
+			vector_push(out, only);
+			sdsfree(text);
+		} else if (sdslen(text) > 0) {
+			struct block *content  = roscha_malloc(sizeof(*content));
+			content->type          = BLOCK_CONTENT;
+			content->token         = first->token;
+			content->token.type    = TOKEN_CONTENT;
+			content->token.literal = slice_new(text, 0, sdslen(text));
+			if (tmpl->pool == NULL) tmpl->pool = vector_new();
+			vector_push(tmpl->pool, text);
+			vector_push(out, content);
+			only = NULL;
+		} else {
+			sdsfree(text);
+			only = NULL;
+		}
+		for (; i < j; i++) {
+			if (blks->values[i] != only) block_destroy(blks->values[i]);
+		}
+	}
+
+	vector_free(blks);
+	return out;
+}
+
+static struct vector *fold_blocks(struct roscha_env *, struct template *,
+                                  struct vector *blks);
+
+/* Push the block to out, or the blocks it always renders if it is an if */
+static void
+fold_push(struct roscha_env *env, struct template *tmpl, struct vector *out,
+          struct block *blk)
+{
+	bool specializing = env->internal->consts != NULL;
+	if (blk->type != BLOCK_TAG) {
+		if (specializing && blk->type == BLOCK_VARIABLE) {
+			fold_substitute(env, tmpl, &blk->variable.expression);
+		}
+		vector_push(out, blk);
+		return;
+	}
+
+	struct tag    *tag = &blk->tag;
+	struct branch *taken;
+	switch (tag->type) {
+	case TAG_IF:
+		for (struct branch *br = tag->cond.root; br; br = br->next) {
+			if (specializing && br->condition) {
+				fold_substitute(env, tmpl, &br->condition);
+			}
+		}
+		if (fold_branch(env, &tag->cond, &taken)) {
+			struct vector *blks = NULL;
+			if (taken != NULL) {
+				blks             = taken->subblocks;
+				taken->subblocks = vector_new();
+			}
+			block_destroy(blk);
+			if (blks == NULL) return;
+			size_t        i;
+			struct block *sub;
+			vector_foreach (blks, i, sub) {
+				fold_push(env, tmpl, out, sub);
+			}
+			vector_free(blks);
+			return;
+		}
+		fold_prune(env, &tag->cond);
+		for (struct branch *br = tag->cond.root; br; br = br->next) {
+			br->subblocks = fold_blocks(env, tmpl, br->subblocks);
+		}
+		break;
+	case TAG_FOR: {
+		struct slice   loopk    = slice_whole("loop");
+		struct vector *shadowed = env->internal->shadowed;
+		if (specializing) fold_substitute(env, tmpl, &tag->loop.seq);
+		vector_push(shadowed, &tag->loop.item.token.literal);
+		vector_push(shadowed, &loopk);
+		tag->loop.subblocks = fold_blocks(env, tmpl, tag->loop.subblocks);
+		vector_pop(shadowed);
+		vector_pop(shadowed);
+		break;
+	}
+	case TAG_BLOCK:
+		tag->tblock.subblocks = fold_blocks(env, tmpl, tag->tblock.subblocks);
+		break;
+	case TAG_MACRO:
+		tag->macro.subblocks = fold_blocks(env, tmpl, tag->macro.subblocks);
+		break;
+	case TAG_CACHE:
+		if (specializing) {
+			fold_substitute(env, tmpl, &tag->fragment.key);
+			if (tag->fragment.ttl) {
+				fold_substitute(env, tmpl, &tag->fragment.ttl);
+			}
+		}
+		tag->fragment.subblocks =
+			fold_blocks(env, tmpl, tag->fragment.subblocks);
+		break;
+	default:
+		break;
+	}
+	vector_push(out, blk);
+}
+
+/* Fold the blocks, returning them in a new vector */
+static struct vector *
+fold_blocks(struct roscha_env *env, struct template *tmpl, struct vector *blks)
+{
+	struct vector *out = vector_new();
+	size_t         i;
+	struct block  *blk;
+	vector_foreach (blks, i, blk) {
+		fold_push(env, tmpl, out, blk);
+	}
+	vector_free(blks);
+
+	return fold_runs(env, tmpl, out);
+}
+
+static void
+env_fold_template(struct roscha_env *env, struct template *tmpl)
+{
+	/* Errors of constant expressions name the template */
+	const struct template *eval_tmpl = env->internal->eval_tmpl;
+	env->internal->eval_tmpl         = tmpl;
+	/* Constants are looked up as variables while folding */
+	struct roscha_object *vars = env->vars;
+	if (env->internal->consts != NULL) env->vars = env->internal->consts;
+	tmpl->blocks             = fold_blocks(env, tmpl, tmpl->blocks);
+	env->vars                = vars;
+	env->internal->eval_tmpl = eval_tmpl;
+}
+
+/* Give every {% block ... %} tag of tmpl the id of its name */
+static void
+env_assign_block_ids(struct roscha_env *env, struct template *tmpl)
+{
+	struct roscha_     *in = env->internal;
+	struct hmap_iter    it;
+	const struct slice *name;
+	struct block       *blk;
+	hmap_iter_init(&it, tmpl->tblocks);
+	hmap_iter_foreach (&it, &name, (void **)&blk) {
+		uintptr_t id = (uintptr_t)hmap_gets(in->block_ids, name);
+		if (id == 0) {
+			sds copy = slice_string(name, sdsempty());
+			vector_push(in->block_names, copy);
+			id = in->block_names->len;
+			hmap_sets(in->block_ids, slice_whole(copy), (void *)id);
+		}
+		blk->tag.tblock.id = id - 1;
+	}
+}
+
+/*
+ * Flatten the extends chain of tmpl into its resolved block table. The chain
+ * is walked from tmpl up, so the most derived block of each name is kept.
+ */
+static void
+env_resolve_template(struct roscha_env *env, struct template *tmpl)
+{
+	struct hmap *templates = env->internal->templates;
+	size_t       size      = (env->internal->block_names->len + 1)
+	                    * sizeof(*tmpl->resolved);
+	tmpl->resolved = roscha_realloc(tmpl->resolved, size);
+	tmpl->root     = NULL;
+	memset(tmpl->resolved, 0, size);
+
+	const struct template *t = tmpl;
+	for (size_t depth = 0; depth < templates->size; depth++) {
+		struct hmap_iter    it;
+		const struct slice *name;
+		struct block       *blk;
+		hmap_iter_init(&it, t->tblocks);
+		hmap_iter_foreach (&it, &name, (void **)&blk) {
+			struct tblock *tblk = &blk->tag.tblock;
+			if (tmpl->resolved[tblk->id] == NULL) {
+				tmpl->resolved[tblk->id] = tblk;
+			}
+		}
+		const struct slice *parent = template_parent(t);
+		if (parent == NULL) {
+			tmpl->root = t;
+			return;
+		}
+		if ((t = hmap_gets(templates, parent)) == NULL) return;
+	}
+}
+
+/*
+ * Whether rendering from can end up rendering to, through includes or the
+ * parents whose blocks it renders. Templates already visited in this walk are
+ * marked with the current generation.
+ */
+static bool
+template_reaches(struct roscha_env *env, struct template *from,
+                 const struct template *to)
+{
+	if (from == to) return true;
+	if (from->mark == env->internal->mark) return false;
+	from->mark = env->internal->mark;
+
+	size_t          i;
+	struct include *inc;
+	vector_foreach (from->includes, i, inc) {
+		if (inc->tmpl && template_reaches(env, inc->tmpl, to)) return true;
+	}
+	const struct slice *parent = template_parent(from);
+	if (parent == NULL) return false;
+	struct template *ptmpl = hmap_gets(env->internal->templates, parent);
+
+	return ptmpl && template_reaches(env, ptmpl, to);
+}
+
+/* Point the includes with string names to their templates */
+static void
+env_resolve_includes(struct roscha_env *env, struct template *tmpl)
+{
+	size_t          i;
+	struct include *inc;
+	vector_foreach (tmpl->includes, i, inc) {
+		inc->tmpl  = NULL;
+		inc->cycle = false;
+		if (inc->name->type == EXPRESSION_STRING) {
+			inc->tmpl = hmap_gets(env->internal->templates,
+			                      &inc->name->string.value);
+		}
+	}
+}
+
+/* Flag the includes that would end up rendering their own template again */
+static void
+env_check_include_cycles(struct roscha_env *env, struct template *tmpl)
+{
+	size_t          i;
+	struct include *inc;
+	vector_foreach (tmpl->includes, i, inc) {
+		if (inc->tmpl == NULL) continue;
+		env->internal->mark++;
+		inc->cycle = template_reaches(env, inc->tmpl, tmpl);
+	}
+}
+
+/*
+ * Resolve every template again, since adding or replacing one can change the
+ * chain of any template that extends it, and the target of any include. Done
+ * once per template added, or once per dir loaded.
+ */
+static void
+env_resolve(struct roscha_env *env)
+{
+	struct hmap_iter    it;
+	const struct slice *name;
+	struct template    *tmpl;
+	hmap_iter_init(&it, env->internal->templates);
+	hmap_iter_foreach (&it, &name, (void **)&tmpl) {
+		env_resolve_template(env, tmpl);
+		env_resolve_includes(env, tmpl);
+	}
+	hmap_iter_init(&it, env->internal->templates);
+	hmap_iter_foreach (&it, &name, (void **)&tmpl) {
+		env_check_include_cycles(env, tmpl);
+	}
+}
+
+void
+roscha_init(void)
+{
+}
+
+void
+roscha_deinit(void)
+{
+}
+
+struct roscha_env *
+roscha_env_new(void)
+{
+	struct roscha_env *env     = roscha_calloc(1, sizeof(*env));
+	env->internal              = roscha_calloc(1, sizeof(*env->internal));
+	env->vars                  = roscha_object_new(hmap_new());
+	env->internal->templates   = hmap_new();
+	env->internal->filters     = hmap_new();
+	env->internal->block_ids   = hmap_new();
+	env->internal->block_names = vector_new();
+	env->internal->memos       = hmap_new();
+	env->internal->patchdocs   = hmap_new();
+	env->internal->shadowed    = vector_new();
+	env->errors                = vector_new();
+	filter_add_builtins(env->internal->filters);
+
+	return env;
+}
+
+/* Fold and add the template, replacing the one with the same name */
+static void
+env_add(struct roscha_env *env, struct template *tmpl)
+{
+	env_clear_memos(env);
+	env_fold_template(env, tmpl);
+	/* Replace a template with the same name, keeping the new key */
+	struct slice     name = slice_whole(tmpl->name);
+	struct template *old  = hmap_removes(env->internal->templates, &name);
+	hmap_sets(env->internal->templates, name, tmpl);
+	if (old != NULL) {
+		template_destroy(old);
+	}
+	env_assign_block_ids(env, tmpl);
+	if (!env->internal->loading) env_resolve(env);
+}
+
+/* Parse a template with the parser and add it, taking over the parser */
+static bool
+env_add_parsed(struct roscha_env *env, struct parser *parser)
+{
+	parser->trim_blocks   = env->trim_blocks;
+	parser->lstrip_blocks = env->lstrip_blocks;
+	struct template *tmpl = parser_parse_template(parser);
+	bool             ok   = true;
+	if (parser->errors->len > 0) {
+		sds errmsg = NULL;
+		while ((errmsg = vector_pop(parser->errors)) != NULL) {
+			vector_push(env->errors, errmsg);
+		}
+		template_destroy(tmpl);
+		ok = false;
+	} else {
+		env_add(env, tmpl);
+	}
+	parser_destroy(parser);
+	return ok;
+}
+
+bool
+roscha_env_add_template(struct roscha_env *env, char *name, char *body)
+{
+	/* Templates outlive requests, so they are never parsed into a heap */
+	struct roscha_heap *heap = roscha_heap_leave();
+	bool                ok   = env_add_parsed(env, parser_new(name, body));
+	roscha_heap_enter(heap);
+	return ok;
+}
+
+bool
+roscha_env_add_template_stream(struct roscha_env *env, char *name,
+                               roscha_read_f read, void *ctx)
+{
+	struct roscha_heap *heap = roscha_heap_leave();
+	bool ok = env_add_parsed(env, parser_new_stream(name, read, ctx));
+	roscha_heap_enter(heap);
+	return ok;
+}
+
+bool
+roscha_env_specialize(struct roscha_env *env, const char *name, char *spec_name,
+                      struct roscha_object *consts)
+{
+	struct roscha_heap *heap  = roscha_heap_leave();
+	struct slice        sname = slice_whole(name);
+	struct template    *tmpl  = hmap_gets(env->internal->templates, &sname);
+	bool                ok    = false;
+	if (consts->type != ROSCHA_HMAP) {
+		vector_push(env->errors,
+		            sdscatfmt(sdsempty(), "consts should be of type %s, got %s",
+		                      roscha_type_print(ROSCHA_HMAP),
+		                      roscha_type_print(consts->type)));
+		free(spec_name);
+	} else if (tmpl == NULL) {
+		template_not_found(env, &sname);
+		free(spec_name);
+	} else {
+		/* Folded on a copy, so the original is left as is */
+		env->internal->consts = consts;
+		env_add(env, template_clone(tmpl, spec_name));
+		env->internal->consts = NULL;
+		ok                    = true;
+	}
+	roscha_heap_enter(heap);
+
+	return ok;
+}
+
+static ssize_t
+read_fd(void *ctx, char *buf, size_t len)
+{
+	return read(*(int *)ctx, buf, len);
+}
+
+bool
 roscha_env_load_dir(struct roscha_env *env, const char *path)
 {
 	DIR *dir = opendir(path);
@@ -552,7 +2309,9 @@ roscha_env_load_dir(struct roscha_env *env, const char *path)
 		vector_push(env->errors, errmsg);
 		return false;
 	}
+	bool           ok = true;
 	struct dirent *ent;
+	env->internal->loading = true;
 	while ((ent = readdir(dir))) {
 		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
 			continue;
@@ -564,48 +2323,71 @@ roscha_env_load_dir(struct roscha_env *env, const char *path)
 			sds errmsg = sdscatfmt(sdsempty(),
 			                       "unable to stat file %s, error %s", fpath, strerror(errno));
 			vector_push(env->errors, errmsg);
-			closedir(dir);
-			return false;
+			sdsfree(fpath);
+			ok = false;
+			break;
+		}
+		if (S_ISDIR(fstats.st_mode)) {
+			sdsfree(fpath);
+			continue;
+		}
+
+		int fd = open(fpath, O_RDONLY);
+		if (fd < 0) {
+			sds errmsg = sdscatfmt(sdsempty(),
+			                       "unable to open file %s, error %s", fpath, strerror(errno));
+			vector_push(env->errors, errmsg);
+			sdsfree(fpath);
+			ok = false;
+			break;
 		}
-		if (S_ISDIR(fstats.st_mode)) continue;
+		sdsfree(fpath);
 
 		char *name = malloc(strlen(ent->d_name) + 1);
 		strcpy(name, ent->d_name);
 
-		int    fd = open(fpath, O_RDONLY);
-		char   buf[BUFSIZE];
-		sds    body = sdsempty();
-		size_t nread;
-		while ((nread = read(fd, buf, BUFSIZE)) > 0) {
-			buf[nread] = '\0';
-			body       = sdscat(body, buf);
-		}
+		/* Files are streamed, only their literals are kept */
+		ok = roscha_env_add_template_stream(env, name, read_fd, &fd);
 		close(fd);
-		if (nread < 0) {
-			sds errmsg = sdscatfmt(sdsempty(),
-			                       "unable to read file %s, error %s", fpath, strerror(errno));
-			vector_push(env->errors, errmsg);
-			goto fileerr;
-		}
-		if (!roscha_env_add_template(env, name, body)) {
-			goto fileerr;
-		}
-		continue;
-fileerr:
-		closedir(dir);
-		sdsfree(body);
-		return false;
+		if (!ok) break;
 	}
+	env->internal->loading = false;
+	/* Resolve the templates loaded so far, even after an error */
+	env_resolve(env);
 
 	closedir(dir);
-	return true;
+	return ok;
+}
+
+void
+roscha_env_add_filter(struct roscha_env *env, const char *name,
+                      const struct roscha_filter *filter)
+{
+	hmap_sets(env->internal->filters, slice_whole(name), (void *)filter);
+	/* Renders using the filter it replaces are stale */
+	env_clear_memos(env);
 }
 
 sds
 roscha_env_render(struct roscha_env *env, const char *name)
 {
 	struct slice sname = slice_whole(name);
-	return eval_template(env, &sname, NULL);
+	if (env->render_cache != NULL) {
+		return eval_memoized(env, &sname);
+	}
+	return eval_template(env, &sname);
+}
+
+sds
+roscha_env_render_incremental(struct roscha_env *env, const char *name,
+                              struct vector *changes)
+{
+	/* The segments are kept across requests */
+	struct roscha_heap *heap  = roscha_heap_leave();
+	struct slice        sname = slice_whole(name);
+	sds                 r     = eval_incremental(env, &sname, changes);
+	roscha_heap_enter(heap);
+	return r;
 }
 
 struct vector *
@@ -626,6 +2408,16 @@ roscha_env_destroy(struct roscha_env *env)
 	vector_free(env->errors);
 	roscha_object_unref(env->vars);
 	hmap_destroy(env->internal->templates, roscha_env_destroy_templates_cb);
-	free(env->internal);
-	free(env);
+	hmap_free(env->internal->filters);
+	hmap_free(env->internal->block_ids);
+	hmap_destroy(env->internal->memos, memo_destroy_cb);
+	hmap_destroy(env->internal->patchdocs, patchdoc_destroy_cb);
+	sds name;
+	vector_foreach (env->internal->block_names, i, name) {
+		sdsfree(name);
+	}
+	vector_free(env->internal->block_names);
+	vector_free(env->internal->shadowed);
+	roscha_free(env->internal);
+	roscha_free(env);
 }
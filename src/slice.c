@@ -1,8 +1,47 @@
 #include "slice.h"
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+/*
+ * Unaligned loads; memcpy of a constant size compiles down to a single mov.
+ * Only the hash depends on the byte order, and it is never stored.
+ */
+static inline uint64_t
+load64(const char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t
+load32(const char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* Fold the 128 bit product of a and b into 64 bits */
+static inline uint64_t
+mix(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = (__uint128_t)a * b;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+	uint64_t ha = a >> 32, la = (uint32_t)a;
+	uint64_t hb = b >> 32, lb = (uint32_t)b;
+	uint64_t hh = ha * hb, hl = ha * lb, lh = la * hb, ll = la * lb;
+	uint64_t t  = ll + (hl << 32);
+	uint64_t lo = t + (lh << 32);
+	uint64_t hi = hh + (hl >> 32) + (lh >> 32) + (t < ll) + (lo < t);
+	return lo ^ hi;
+#endif
+}
+
 struct slice
 slice_new(const char *str, size_t start, size_t end)
 {
@@ -29,6 +68,17 @@ slice_len(const struct slice *slice)
 	return slice->end - slice->start;
 }
 
+static inline int
+bytes_cmp(const char *a, const char *b, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		int cmp = (a[i] > b[i]) - (a[i] < b[i]);
+		if (cmp) return cmp;
+	}
+
+	return 0;
+}
+
 int
 slice_cmp(const struct slice *restrict a, const struct slice *restrict b)
 {
@@ -38,13 +88,89 @@ slice_cmp(const struct slice *restrict a, const struct slice *restrict b)
 		return lencmp;
 	}
 
-	for (size_t i = 0; i < lena; i++) {
-		char ca = a->str[a->start + i], cb = b->str[b->start + i];
-		int cmp = (ca > cb) - (ca < cb);
-		if (cmp) return cmp;
+	const char *pa = a->str + a->start, *pb = b->str + b->start;
+	size_t i = 0;
+	/* Skip over equal words, then order by the first differing byte */
+	for (; i + 8 <= lena; i += 8) {
+		if (load64(pa + i) != load64(pb + i)) {
+			return bytes_cmp(pa + i, pb + i, 8);
+		}
 	}
 
-	return 0;
+	return bytes_cmp(pa + i, pb + i, lena - i);
+}
+
+bool
+slice_eq(const struct slice *restrict a, const struct slice *restrict b)
+{
+	size_t len = slice_len(a);
+	if (len != slice_len(b)) {
+		return false;
+	}
+
+	const char *pa = a->str + a->start, *pb = b->str + b->start;
+	if (len >= 8) {
+		size_t i = 0;
+		for (; i + 16 <= len; i += 16) {
+			uint64_t d = (load64(pa + i) ^ load64(pb + i))
+			           | (load64(pa + i + 8) ^ load64(pb + i + 8));
+			if (d) return false;
+		}
+		/* The remaining bytes, overlapping with the ones already seen */
+		if (len - i > 8 && load64(pa + i) != load64(pb + i)) {
+			return false;
+		}
+		return load64(pa + len - 8) == load64(pb + len - 8);
+	}
+	if (len >= 4) {
+		return load32(pa) == load32(pb)
+		    && load32(pa + len - 4) == load32(pb + len - 4);
+	}
+
+	return memcmp(pa, pb, len) == 0;
+}
+
+/*
+ * Based on wyhash: keys of up to 16 bytes are read as at most four loads and
+ * mixed with a single multiplication, longer ones 16 bytes per round.
+ */
+size_t
+slice_hash(const struct slice *slice)
+{
+	static const uint64_t s0 = 0xa0761d6478bd642full;
+	static const uint64_t s1 = 0xe7037ed1a0b428dbull;
+	static const uint64_t s2 = 0x8ebc6af09c88c6e3ull;
+
+	const char *p = slice->str + slice->start;
+	size_t len = slice_len(slice);
+	uint64_t seed = s0, a, b;
+
+	if (len <= 16) {
+		if (len >= 4) {
+			size_t off = (len >> 3) << 2;
+			a = (load32(p) << 32) | load32(p + off);
+			b = (load32(p + len - 4) << 32) | load32(p + len - 4 - off);
+		} else if (len > 0) {
+			const unsigned char *u = (const unsigned char *)p;
+			a = ((uint64_t)u[0] << 16) | ((uint64_t)u[len >> 1] << 8)
+			  | u[len - 1];
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		size_t i = len;
+		while (i > 16) {
+			seed = mix(load64(p) ^ s1, load64(p + 8) ^ seed);
+			p += 16;
+			i -= 16;
+		}
+		/* The last 16 bytes, overlapping with the previous round */
+		a = load64(p + i - 16);
+		b = load64(p + i - 8);
+	}
+
+	return mix(s1 ^ len, mix(a ^ s1, b ^ seed) ^ s2);
 }
 
 void
@@ -0,0 +1,47 @@
+#include "tests/tests.h"
+#include "format.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+static void
+test_format_int(void)
+{
+	int64_t tests[] = {
+		0, 1, -1, 9, 10, 99, 100, 101, 999, 1000, 12345, -12345, 99999999,
+		100000000, 1234567890123, INT64_MAX, INT64_MIN, INT64_MIN + 1,
+	};
+	char expected[32];
+	sds  got = sdsnew("x");
+	for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		sdsclear(got);
+		got = format_int(got, tests[i]);
+		snprintf(expected, sizeof(expected), "%lld", (long long)tests[i]);
+		asserteq(strcmp(got, expected), 0);
+		asserteq(sdslen(got), strlen(expected));
+	}
+	/* Appends to what is already there */
+	got = format_int(got, 42);
+	asserteq(strcmp(got + sdslen(got) - 2, "42"), 0);
+	sdsfree(got);
+}
+
+static void
+test_format_digits(void)
+{
+	uint64_t pow = 1;
+	for (unsigned n = 1; n < 20; n++, pow *= 10) {
+		asserteq(format_digits(pow), n);
+		asserteq(format_digits(pow * 10 - 1), n);
+	}
+	asserteq(format_digits(UINT64_MAX), 20);
+}
+
+int
+main(void)
+{
+	INIT_TESTS();
+	RUN_TEST(test_format_int);
+	RUN_TEST(test_format_digits);
+}
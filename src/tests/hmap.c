@@ -0,0 +1,133 @@
+#include "tests/tests.h"
+#include "alloc.h"
+#include "hmap.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* Count the heap allocations made by the code under test */
+static size_t nallocs = 0;
+static size_t nfrees  = 0;
+
+static void *
+count_malloc(void *ctx, size_t size)
+{
+	nallocs++;
+	return malloc(size);
+}
+
+static void *
+count_realloc(void *ctx, void *ptr, size_t size)
+{
+	if (ptr == NULL) nallocs++;
+	return realloc(ptr, size);
+}
+
+static void
+count_free(void *ctx, void *ptr)
+{
+	nfrees++;
+	free(ptr);
+}
+
+static const struct roscha_allocator count_allocator = {
+	.malloc  = count_malloc,
+	.realloc = count_realloc,
+	.free    = count_free,
+};
+
+static void
+test_hmap_order(void)
+{
+	char *keys[] = { "zeta", "alpha", "mu", "beta", "omega", NULL };
+	struct hmap *hm = hmap_new();
+	for (size_t i = 0; keys[i] != NULL; i++) {
+		asserteq(hmap_set(hm, keys[i], keys[i]), NULL);
+	}
+	hmap_remove(hm, "mu");
+	hmap_set(hm, "mu", keys[2]);
+
+	char *expected[] = { "zeta", "alpha", "beta", "omega", "mu", NULL };
+	const struct slice *key;
+	void               *val;
+	struct hmap_iter    iter;
+	size_t              i = 0;
+	hmap_iter_init(&iter, hm);
+	hmap_iter_foreach (&iter, &key, &val) {
+		struct slice exp = slice_whole(expected[i]);
+		asserteq(slice_cmp(key, &exp), 0);
+		asserteq(strcmp(val, expected[i]), 0);
+		i++;
+	}
+	asserteq(i, 4 + 1);
+	hmap_free(hm);
+}
+
+static void
+test_hmap_grow(void)
+{
+	char         buf[4096 * 8];
+	struct slice keys[4096];
+	struct hmap *hm = hmap_new_with_cap(8);
+	for (size_t i = 0; i < 4096; i++) {
+		int n   = sprintf(buf + i * 8, "k%zu", i);
+		keys[i] = slice_new(buf + i * 8, 0, n);
+		hmap_sets(hm, keys[i], &keys[i]);
+	}
+	asserteq(hm->size, 4096);
+	for (size_t i = 0; i < 4096; i += 2) {
+		asserteq(hmap_removes(hm, &keys[i]), &keys[i]);
+	}
+	asserteq(hm->size, 2048);
+	for (size_t i = 0; i < 4096; i++) {
+		void *exp = i % 2 ? &keys[i] : NULL;
+		asserteq(hmap_gets(hm, &keys[i]), exp);
+	}
+	/* setting and removing over and over should not grow the map */
+	size_t cap = hm->cap;
+	for (size_t i = 0; i < 100000; i++) {
+		hmap_sets(hm, keys[i % 4096 & ~1], NULL);
+		hmap_removes(hm, &keys[i % 4096 & ~1]);
+	}
+	asserteq(hm->cap, cap);
+	asserteq(hm->size, 2048);
+	hmap_free(hm);
+}
+
+static void
+test_hmap_iter_alloc(void)
+{
+	size_t       allocs = nallocs, frees = nfrees;
+	struct hmap *hm     = hmap_new();
+	hmap_set(hm, "foo", "1");
+	hmap_set(hm, "bar", "2");
+	hmap_set(hm, "baz", "3");
+	assertneq(nallocs, allocs);
+
+	size_t              count  = 0;
+	size_t              before = nallocs;
+	const struct slice *key;
+	void               *val;
+	struct hmap_iter    iter;
+	for (size_t i = 0; i < 1000; i++) {
+		hmap_iter_init(&iter, hm);
+		hmap_iter_foreach (&iter, &key, &val) {
+			count++;
+		}
+	}
+	asserteq(count, 3000);
+	asserteq(nallocs, before);
+
+	hmap_free(hm);
+	asserteq(nallocs - allocs, nfrees - frees);
+}
+
+int
+main(void)
+{
+	roscha_set_allocator(&count_allocator);
+	INIT_TESTS();
+	RUN_TEST(test_hmap_order);
+	RUN_TEST(test_hmap_grow);
+	RUN_TEST(test_hmap_iter_alloc);
+}
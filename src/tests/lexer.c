@@ -3,6 +3,7 @@
 
 #include <string.h>
 
+#include "sds/sds.h"
 #include "slice.h"
 #include "token.h"
 
@@ -34,7 +35,6 @@ test_next_token(void)
 				  "{{ 5 and 5 }}\n"
 				  "{{ 5 or 5 }}\n";
 
-	token_init_keywords();
 	struct lexer *lexer = lexer_new(input);
 	struct token expected[] = {
 		{ TOKEN_LBRACE, slice_whole("{"), 1, 1 },
@@ -235,7 +235,195 @@ test_next_token(void)
 	} while (expected[i].type != TOKEN_EOF);
 
 	lexer_destroy(lexer);
-	token_free_keywords();
+}
+
+static void
+test_content_position(void)
+{
+	char input[256];
+	memset(input, 'a', 40);
+	input[40] = '\n';
+	memset(input + 41, 'b', 50);
+	input[91] = '\n';
+	memset(input + 92, 'c', 10);
+	strcpy(input + 102, "{{ x }}");
+	memset(input + 109, 'd', 40);
+	strcpy(input + 149, "{{ y }}");
+
+	struct lexer *lexer = lexer_new(input);
+	struct token expected[] = {
+		{ TOKEN_CONTENT, slice_whole(""), 1, 1 },
+		{ TOKEN_LBRACE, slice_whole("{"), 3, 11 },
+		{ TOKEN_LBRACE, slice_whole("{"), 3, 12 },
+		{ TOKEN_IDENT, slice_whole("x"), 3, 13 },
+		{ TOKEN_RBRACE, slice_whole("}"), 3, 15 },
+		{ TOKEN_RBRACE, slice_whole("}"), 3, 17 },
+		{ TOKEN_CONTENT, slice_whole(""), 3, 18 },
+		{ TOKEN_LBRACE, slice_whole("{"), 3, 58 },
+		{ TOKEN_EOF, },
+	};
+	size_t i = 0;
+
+	do {
+		struct token token = lexer_next_token(lexer);
+		asserteq(token.type, expected[i].type);
+		asserteq(token.line, expected[i].line);
+		asserteq(token.column, expected[i].column);
+		i++;
+	} while (expected[i].type != TOKEN_EOF);
+
+	lexer_destroy(lexer);
+}
+
+struct reader {
+	const char *s;
+	size_t      pos;
+	size_t      step;
+};
+
+static ssize_t
+read_step(void *ctx, char *buf, size_t len)
+{
+	struct reader *r = ctx;
+	size_t         n = strlen(r->s + r->pos);
+	if (n > r->step) n = r->step;
+	if (n > len) n = len;
+	memcpy(buf, r->s + r->pos, n);
+	r->pos += n;
+	return n;
+}
+
+static void
+test_stream(void)
+{
+	char input[512] = "{% extends \"template\" %}\n"
+					  "{%- block rooster -%}  \n"
+					  "{{ a.long_identifier_name[10] | upper }}\n"
+					  "{% if x >= -1 and y != \"some long string\" %}";
+	size_t len = strlen(input);
+	memset(input + len, ' ', 20);
+	memset(input + len + 20, 'a', 100);
+	memset(input + len + 120, '\n', 20);
+	strcpy(input + len + 140, "{{ v }}\ntrailing content");
+
+	struct reader r      = {input, 0, 5};
+	struct lexer *whole  = lexer_new(input);
+	struct lexer *stream = lexer_new_stream(read_step, &r, 16);
+	sds           wcont  = sdsempty();
+	sds           scont  = sdsempty();
+	size_t        wruns = 0, sruns = 0;
+	struct token  wtok, stok;
+	do {
+		while ((wtok = lexer_next_token(whole)).type == TOKEN_CONTENT) {
+			wcont = slice_string(&wtok.literal, wcont);
+			wruns++;
+		}
+		while ((stok = lexer_next_token(stream)).type == TOKEN_CONTENT) {
+			scont = slice_string(&stok.literal, scont);
+			sruns++;
+		}
+		asserteq(strcmp(wcont, scont), 0);
+		asserteq(stok.type, wtok.type);
+		asserteq(slice_cmp(&stok.literal, &wtok.literal), 0);
+		asserteq(stok.line, wtok.line);
+		asserteq(stok.column, wtok.column);
+	} while (wtok.type != TOKEN_EOF);
+	/* The long content doesn't fit in the buffer */
+	bool split = sruns > wruns;
+	asserteq(split, true);
+	asserteq(stream->read_error, false);
+
+	sdsfree(wcont);
+	sdsfree(scont);
+	lexer_destroy(whole);
+	lexer_destroy(stream);
+}
+
+/* Inputs that end inside a tag, after whitespace */
+static void
+test_stream_eof(void)
+{
+	struct {
+		const char     *input;
+		enum token_type last;
+	} tests[] = {
+		{ "{{ ", TOKEN_LBRACE },
+		{ "{% if x ", TOKEN_IDENT },
+	};
+	for (size_t i = 0; i < sizeof(tests) / sizeof(*tests); i++) {
+		struct reader r      = {tests[i].input, 0, 5};
+		struct lexer *stream = lexer_new_stream(read_step, &r, 16);
+		struct token  prev   = {0};
+		struct token  token;
+		while ((token = lexer_next_token(stream)).type != TOKEN_EOF) {
+			prev = token;
+		}
+		asserteq(prev.type, tests[i].last);
+		/* And stays at the end */
+		asserteq(lexer_next_token(stream).type, TOKEN_EOF);
+		lexer_destroy(stream);
+	}
+}
+
+/* Whitespace runs longer than the buffer are a single token */
+static void
+test_stream_space(void)
+{
+	char input[256];
+	memset(input, ' ', 100);
+	memset(input + 100, '\n', 100);
+	strcpy(input + 200, "{%- x %}");
+
+	struct reader r      = {input, 0, 5};
+	struct lexer *stream = lexer_new_stream(read_step, &r, 16);
+	struct token  token  = lexer_next_token(stream);
+	asserteq(token.type, TOKEN_CONTENT);
+	asserteq(slice_len(&token.literal), 200);
+	asserteq(lexer_next_token(stream).type, TOKEN_LBRACE);
+	asserteq(token.line, 1);
+	lexer_destroy(stream);
+}
+
+static void
+test_keywords(void)
+{
+	struct {
+		char           *ident;
+		enum token_type type;
+	} tests[] = {
+		{ "and", TOKEN_AND },
+		{ "or", TOKEN_OR },
+		{ "not", TOKEN_NOT },
+		{ "for", TOKEN_FOR },
+		{ "in", TOKEN_IN },
+		{ "break", TOKEN_BREAK },
+		{ "endfor", TOKEN_ENDFOR },
+		{ "true", TOKEN_TRUE },
+		{ "false", TOKEN_FALSE },
+		{ "if", TOKEN_IF },
+		{ "elif", TOKEN_ELIF },
+		{ "else", TOKEN_ELSE },
+		{ "endif", TOKEN_ENDIF },
+		{ "extends", TOKEN_EXTENDS },
+		{ "include", TOKEN_INCLUDE },
+		{ "macro", TOKEN_MACRO },
+		{ "endmacro", TOKEN_ENDMACRO },
+		{ "cache", TOKEN_CACHE },
+		{ "endcache", TOKEN_ENDCACHE },
+		{ "block", TOKEN_BLOCK },
+		{ "endblock", TOKEN_ENDBLOCK },
+		{ "i", TOKEN_IDENT },
+		{ "iff", TOKEN_IDENT },
+		{ "Else", TOKEN_IDENT },
+		{ "endfo", TOKEN_IDENT },
+		{ "blocks", TOKEN_IDENT },
+		{ "endblocks", TOKEN_IDENT },
+		{ NULL },
+	};
+	for (size_t i = 0; tests[i].ident != NULL; i++) {
+		struct slice ident = slice_whole(tests[i].ident);
+		asserteq(token_lookup_ident(&ident), tests[i].type);
+	}
 }
 
 int
@@ -243,4 +431,9 @@ main(void)
 {
 	INIT_TESTS();
 	RUN_TEST(test_next_token);
+	RUN_TEST(test_content_position);
+	RUN_TEST(test_stream);
+	RUN_TEST(test_stream_eof);
+	RUN_TEST(test_stream_space);
+	RUN_TEST(test_keywords);
 }
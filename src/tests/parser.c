@@ -5,6 +5,7 @@
 #include "ast.h"
 #include "slice.h"
 
+#include <pthread.h>
 #include <string.h>
 
 enum value_type {
@@ -457,6 +458,22 @@ test_operator_precedence(void)
 			"{{ foo.bar + bar[0].baz * foo.bar.baz }}",
 			"{{ (foo.bar + (bar[0].baz * foo.bar.baz)) }}",
 		},
+		{
+			"{{ a + foo.bar | upper }}",
+			"{{ (a + (foo.bar | upper)) }}",
+		},
+		{
+			"{{ a | trim | truncate(b + 1, \"~\") }}",
+			"{{ ((a | trim) | truncate((b + 1), ~)) }}",
+		},
+		{
+			"{{ a | length > 0 }}",
+			"{{ ((a | length) > 0) }}",
+		},
+		{
+			"{{ a | lower | safe }}",
+			"{{ (a | lower) | safe }}",
+		},
 		{0},
 	};
 	for (size_t i = 0; tests[i].input != NULL; i++) {
@@ -622,22 +639,169 @@ test_tblock_tag(void)
 	template_destroy(tmpl);
 }
 
-static void
-init(void)
+static inline void
+test_include_tag(void)
+{
+	char            *input  = "{% include \"card.html\" %}{% include name %}";
+	struct slice     name   = slice_whole("card.html");
+	struct slice     ident  = slice_whole("name");
+	struct parser   *parser = parser_new(strdup("test"), input);
+	struct template *tmpl   = parser_parse_template(parser);
+	check_parser_errors(parser);
+
+	assertneq(tmpl, NULL);
+	asserteq(tmpl->blocks->len, 2);
+	struct block *blk = tmpl->blocks->values[0];
+	asserteq(blk->type, BLOCK_TAG);
+	asserteq(blk->tag.type, TAG_INCLUDE);
+	test_string_literal(blk->tag.include.name, &name);
+	asserteq(blk->tag.include.tmpl, NULL);
+	blk = tmpl->blocks->values[1];
+	asserteq(blk->tag.type, TAG_INCLUDE);
+	test_identifier(blk->tag.include.name, &ident);
+
+	asserteq(tmpl->includes->len, 2);
+	asserteq(tmpl->includes->values[1], &blk->tag.include);
+
+	parser_destroy(parser);
+	template_destroy(tmpl);
+}
+
+static inline void
+test_cache_tag(void)
+{
+	char *input = "{% cache user.id, 60 %}{{ user.name }}{% endcache %}"
+				  "{% cache \"nav\" %}nav{% endcache %}";
+	struct parser   *parser = parser_new(strdup("test"), input);
+	struct template *tmpl   = parser_parse_template(parser);
+	check_parser_errors(parser);
+
+	assertneq(tmpl, NULL);
+	asserteq(tmpl->blocks->len, 2);
+	struct block *blk = tmpl->blocks->values[0];
+	asserteq(blk->type, BLOCK_TAG);
+	asserteq(blk->tag.type, TAG_CACHE);
+	struct fragment *frag = &blk->tag.fragment;
+	asserteq(frag->key->type, EXPRESSION_MAPKEY);
+	test_integer_literal(frag->ttl, 60);
+	asserteq(strcmp(frag->prefix, "test:1:3:"), 0);
+	asserteq(frag->subblocks->len, 2);
+	blk = tmpl->blocks->values[1];
+	asserteq(blk->tag.type, TAG_CACHE);
+	asserteq(blk->tag.fragment.ttl, NULL);
+	assertneq(strcmp(blk->tag.fragment.prefix, frag->prefix), 0);
+
+	parser_destroy(parser);
+	template_destroy(tmpl);
+}
+
+static inline void
+test_macro_tag(void)
+{
+	char *input = "{{ row(1, x | upper) + 2 }}"
+				  "{% macro row(a, b) %}{{ a + c }}{% endmacro %}";
+	struct slice     name   = slice_whole("row");
+	struct parser   *parser = parser_new(strdup("test"), input);
+	struct template *tmpl   = parser_parse_template(parser);
+	check_parser_errors(parser);
+
+	assertneq(tmpl, NULL);
+	asserteq(tmpl->blocks->len, 2);
+	struct block *blk = tmpl->blocks->values[1];
+	asserteq(blk->type, BLOCK_TAG);
+	asserteq(blk->tag.type, TAG_MACRO);
+	struct macro *macro = &blk->tag.macro;
+	asserteq(slice_cmp(&macro->name.token.literal, &name), 0);
+	asserteq(macro->params->len, 2);
+	asserteq(macro->subblocks->len, 2);
+	struct block *body = macro->subblocks->values[0];
+	asserteq(body->type, BLOCK_VARIABLE);
+	struct infix *sum = &body->variable.expression->infix;
+	asserteq(sum->left->ident.slot, 1);
+	asserteq(sum->right->ident.slot, 0);
+
+	/* Calls bind tighter than filters and operators */
+	blk        = tmpl->blocks->values[0];
+	sds output = block_string(blk, sdsempty());
+	asserteq(strcmp(output, "{{ (row(1, (x | upper)) + 2) }}"), 0);
+	sdsfree(output);
+	struct expression *call = blk->variable.expression->infix.left;
+	asserteq(call->type, EXPRESSION_CALL);
+	asserteq(call->call.macro, macro);
+
+	parser_destroy(parser);
+	template_destroy(tmpl);
+
+	char *errors[][2] = {
+		{ "{{ nope(1) }}", "test:1:3: unknown macro nope" },
+		{ "{% macro m(a) %}{% endmacro %}{{ m(1, 2) }}",
+		  "test:1:33: macro m takes 1 arguments, got 2" },
+		{ "{{ a.b(1) }}", "test:1:7: a.b is not a macro" },
+		{ "{{ range(1, 2, 3, 4) }}",
+		  "test:1:3: range takes 1 to 3 arguments, got 4" },
+	};
+	for (size_t i = 0; i < sizeof(errors) / sizeof(*errors); i++) {
+		parser = parser_new(strdup("test"), errors[i][0]);
+		tmpl   = parser_parse_template(parser);
+		asserteq(parser->errors->len, 1);
+		asserteq(strcmp(parser->errors->values[0], errors[i][1]), 0);
+		parser_destroy(parser);
+		template_destroy(tmpl);
+	}
+}
+
+#define NTHREADS 4
+
+static char *thread_input = "{% for v in list %}{{ a + b * c | upper }}"
+							"{% endfor %}"
+							"{% if x.y[0] >= 1 %}{{ -x }}{% endif %}";
+
+static sds
+parse_to_string(void)
+{
+	struct parser   *parser = parser_new(strdup("test"), thread_input);
+	struct template *tmpl   = parser_parse_template(parser);
+	sds              output = NULL;
+	if (parser->errors->len == 0) {
+		output = template_string(tmpl, sdsempty());
+	}
+	parser_destroy(parser);
+	template_destroy(tmpl);
+	return output;
+}
+
+static void *
+parse_many(void *expected)
 {
-	parser_init();
+	for (int i = 0; i < 1000; i++) {
+		sds  output = parse_to_string();
+		bool ok     = output && strcmp(output, expected) == 0;
+		sdsfree(output);
+		if (!ok) return "unexpected output";
+	}
+	return NULL;
 }
 
 static void
-cleanup(void)
+test_parse_threads(void)
 {
-	parser_deinit();
+	sds expected = parse_to_string();
+	assertneq(expected, NULL);
+	pthread_t threads[NTHREADS];
+	for (int i = 0; i < NTHREADS; i++) {
+		asserteq(pthread_create(&threads[i], NULL, parse_many, expected), 0);
+	}
+	for (int i = 0; i < NTHREADS; i++) {
+		void *res;
+		pthread_join(threads[i], &res);
+		asserteq(res, NULL);
+	}
+	sdsfree(expected);
 }
 
 int
 main(void)
 {
-	init();
 	INIT_TESTS();
 	RUN_TEST(test_literal_variables);
 	RUN_TEST(test_prefix_variables);
@@ -649,5 +813,8 @@ main(void)
 	RUN_TEST(test_cond_tag);
 	RUN_TEST(test_parent_tag);
 	RUN_TEST(test_tblock_tag);
-	cleanup();
+	RUN_TEST(test_include_tag);
+	RUN_TEST(test_cache_tag);
+	RUN_TEST(test_macro_tag);
+	RUN_TEST(test_parse_threads);
 }
@@ -2,7 +2,10 @@
 #include "tests/tests.h"
 #include "roscha.h"
 
+#include <pthread.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 static void
 check_env_errors(struct roscha_env *env, const char *file, int line,
@@ -137,6 +140,33 @@ test_eval_loop(void)
 	roscha_object_unref(foo);
 }
 
+static void
+test_eval_loop_hmap(void)
+{
+	char *input = "{% for v in foo %}"
+				  "{{ loop.index }}"
+				  "{{ v }}"
+				  "{% endfor %}";
+	char *expected = "1c2a3b";
+
+	struct roscha_object *foo = roscha_object_new(hmap_new());
+	roscha_hmap_set_new(foo, "c", (slice_whole("c")));
+	roscha_hmap_set_new(foo, "a", (slice_whole("a")));
+	roscha_hmap_set_new(foo, "b", (slice_whole("b")));
+
+	struct roscha_env *env = roscha_env_new();
+	roscha_env_add_template(env, strdup("test"), input);
+	check_env_errors(env);
+	roscha_hmap_set(env->vars, "foo", foo);
+	sds got = roscha_env_render(env, "test");
+	check_env_errors(env);
+	asserteq(strcmp(got, expected), 0);
+
+	sdsfree(got);
+	roscha_env_destroy(env);
+	roscha_object_unref(foo);
+}
+
 static void
 test_eval_child(void)
 {
@@ -164,6 +194,1056 @@ test_eval_child(void)
 	roscha_env_destroy(env);
 }
 
+static void
+test_eval_inheritance(void)
+{
+	char *base = "<{% block head %}Head{% endblock %}|"
+				 "{% block body %}Body{% endblock %}>";
+	char *layout = "{% extends \"base\" %}"
+				   "{% block body %}[{% block main %}Main{% endblock %}]"
+				   "{% endblock %}";
+	char *page = "{% extends \"layout\" %}"
+				 "{% block main %}Page{% endblock %}";
+	char *layout2 = "{% extends \"base\" %}"
+					"{% block head %}Title{% endblock %}"
+					"{% block body %}({% block main %}Main{% endblock %})"
+					"{% endblock %}";
+	char *cycle = "{% extends \"cycle\" %}";
+
+	struct roscha_env *env = roscha_env_new();
+	/* Children can be added before their parents */
+	roscha_env_add_template(env, strdup("page"), page);
+	roscha_env_add_template(env, strdup("layout"), layout);
+	check_env_errors(env);
+	sds got = roscha_env_render(env, "page");
+	asserteq(got, NULL);
+	asserteq(env->errors->len, 1);
+	asserteq(strcmp(env->errors->values[0], "template \"base\" not found"), 0);
+	sdsfree(vector_pop(env->errors));
+
+	roscha_env_add_template(env, strdup("base"), base);
+	check_env_errors(env);
+	got = roscha_env_render(env, "page");
+	check_env_errors(env);
+	asserteq(strcmp(got, "<Head|[Page]>"), 0);
+	sdsfree(got);
+	got = roscha_env_render(env, "layout");
+	check_env_errors(env);
+	asserteq(strcmp(got, "<Head|[Main]>"), 0);
+	sdsfree(got);
+
+	/* Replacing a template re-resolves the ones extending it */
+	roscha_env_add_template(env, strdup("layout"), layout2);
+	check_env_errors(env);
+	got = roscha_env_render(env, "page");
+	check_env_errors(env);
+	asserteq(strcmp(got, "<Title|(Page)>"), 0);
+	sdsfree(got);
+
+	roscha_env_add_template(env, strdup("cycle"), cycle);
+	check_env_errors(env);
+	got = roscha_env_render(env, "cycle");
+	asserteq(got, NULL);
+	asserteq(env->errors->len, 1);
+	asserteq(strcmp(env->errors->values[0],
+	                "template \"cycle\" extends itself"), 0);
+	sdsfree(vector_pop(env->errors));
+
+	roscha_env_destroy(env);
+}
+
+static void
+test_eval_include(void)
+{
+	char *page = "<{% for v in list %}{% include \"item\" %}{% endfor %}"
+				 "{% include name %}>";
+	char *item = "[{{ v }}]";
+	char *foot = "{% extends \"base\" %}{% block b %}foot{% endblock %}";
+	char *base = "({% block b %}{% endblock %})";
+	char *loop = "{% include \"loop2\" %}";
+	char *loop2 = "{% include \"loop\" %}";
+
+	struct roscha_env *env = roscha_env_new();
+	/* Static includes are resolved whenever their templates are added */
+	roscha_env_add_template(env, strdup("page"), page);
+	roscha_env_add_template(env, strdup("item"), item);
+	roscha_env_add_template(env, strdup("foot"), foot);
+	roscha_env_add_template(env, strdup("base"), base);
+	roscha_env_add_template(env, strdup("loop"), loop);
+	roscha_env_add_template(env, strdup("loop2"), loop2);
+	check_env_errors(env);
+	struct roscha_object *list = roscha_object_new(vector_new());
+	roscha_vector_push_new(list, 1);
+	roscha_vector_push_new(list, 2);
+	roscha_hmap_set(env->vars, "list", list);
+	roscha_hmap_set_new(env->vars, "name", sdsnew("foot"));
+
+	sds got = roscha_env_render(env, "page");
+	check_env_errors(env);
+	asserteq(strcmp(got, "<[1][2](foot)>"), 0);
+	sdsfree(got);
+
+	got = roscha_env_render(env, "loop");
+	asserteq(env->errors->len, 1);
+	asserteq(strcmp(env->errors->values[0],
+	                "loop:1:3: cyclic include of template \"loop2\""), 0);
+	sdsfree(vector_pop(env->errors));
+	sdsfree(got);
+
+	roscha_object_unref(
+		roscha_hmap_set_new(env->vars, "name", sdsnew("nope")));
+	got = roscha_env_render(env, "page");
+	asserteq(env->errors->len, 1);
+	asserteq(strcmp(env->errors->values[0], "template \"nope\" not found"), 0);
+	sdsfree(vector_pop(env->errors));
+	sdsfree(got);
+
+	roscha_env_destroy(env);
+	roscha_object_unref(list);
+}
+
+static void
+test_eval_load_dir(void)
+{
+	const char *files[][2] = {
+		{ "base", "<{% block body %}{% endblock %}>" },
+		{ "page", "{% extends \"base\" %}{% block body %}"
+		          "{% macro m(x) %}[{{ x | upper }}]{% endmacro %}"
+		          "{{ m(lang) }}{% include \"part\" %}{% endblock %}" },
+		{ "part", "part" },
+	};
+	char dir[] = "/tmp/roscha-test-XXXXXX";
+	assertneq(mkdtemp(dir), NULL);
+	for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		sds   path = sdscatfmt(sdsempty(), "%s/%s", dir, files[i][0]);
+		FILE *f    = fopen(path, "w");
+		assertneq(f, NULL);
+		fputs(files[i][1], f);
+		fclose(f);
+		sdsfree(path);
+	}
+
+	/* Resolved once all of them are loaded, whatever the order */
+	struct roscha_env *env = roscha_env_new();
+	asserteq(roscha_env_load_dir(env, dir), true);
+	check_env_errors(env);
+	roscha_hmap_set_new(env->vars, "lang", sdsnew("de"));
+	sds got = roscha_env_render(env, "page");
+	check_env_errors(env);
+	asserteq(strcmp(got, "<[DE]part>"), 0);
+	sdsfree(got);
+
+	/* Streamed templates can be specialized, and outlive the original */
+	struct roscha_object *consts = roscha_object_new(hmap_new());
+	roscha_hmap_set_new(consts, "lang", sdsnew("en"));
+	asserteq(roscha_env_specialize(env, "page", strdup("page.en"), consts),
+	         true);
+	check_env_errors(env);
+	roscha_env_add_template(env, strdup("page"), "gone");
+	got = roscha_env_render(env, "page.en");
+	check_env_errors(env);
+	asserteq(strcmp(got, "<[EN]part>"), 0);
+	sdsfree(got);
+	roscha_object_unref(consts);
+	roscha_env_destroy(env);
+
+	for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		sds path = sdscatfmt(sdsempty(), "%s/%s", dir, files[i][0]);
+		unlink(path);
+		sdsfree(path);
+	}
+	rmdir(dir);
+}
+
+static void
+test_eval_macro(void)
+{
+	char *input = "{% macro row(name, n) %}<{{ name }}:{{ n }}>"
+				  "{% endmacro %}"
+				  "{% macro wrap(x) %}[{{ row(x, 1) }}]{% endmacro %}"
+				  "{% for v in list %}{{ row(v, loop.index) }}{% endfor %}"
+				  "{{ wrap(\"&\") }}{{ row(\"a\") }}{{ row(name) | length }}|"
+				  "{% macro each(v) %}{% for v in list %}{{ v }},{% endfor %}"
+				  "{{ v }}{% endmacro %}{{ each(\"z\") }}|"
+				  "{% macro em(a) %} <i>{{ a }}</i> {% endmacro %}"
+				  "{{ em(\"&\") | trim }}{{ em(\"&\") | upper | trim }}";
+	char *expected = "<x:0><y:1>[<&amp;:1>]<a:null>13|x,y,z|"
+					 "<i>&amp;</i><I>&AMP;</I>";
+
+	struct roscha_env *env = roscha_env_new();
+	env->autoescape        = true;
+	roscha_env_add_template(env, strdup("test"), input);
+	check_env_errors(env);
+	struct roscha_object *list = roscha_object_new(vector_new());
+	roscha_vector_push_new(list, sdsnew("x"));
+	roscha_vector_push_new(list, sdsnew("y"));
+	roscha_hmap_set(env->vars, "list", list);
+	roscha_hmap_set_new(env->vars, "name", sdsnew("global"));
+	sds got = roscha_env_render(env, "test");
+	check_env_errors(env);
+	asserteq(strcmp(got, expected), 0);
+
+	sdsfree(got);
+	roscha_env_destroy(env);
+	roscha_object_unref(list);
+}
+
+static void
+test_eval_range(void)
+{
+	char *input = "{% for i in range(3) %}{{ i }}{% endfor %}|"
+				  "{% for i in range(n, 0, -3) %}{{ i }},{% endfor %}|"
+				  "{% for i in range(2, n) %}{% if i > 3 %}{% break %}"
+				  "{% endif %}{{ i }}{% endfor %}|"
+				  "{{ range(0, n, 2) | length }}{{ range(5, 1) | length }}|"
+				  "{{ range(1, n, 2)[2] }}{{ pages[10] }}{{ pages[1] }}|"
+				  "{{ range(n) }}|"
+				  "{% if range(0) %}y{% else %}n{% endif %}"
+				  "{% if not range(n, n) %}e{% endif %}"
+				  "{% if range(0, 1, 256) and range(n) %}t{% endif %}";
+	char *expected = "012|10,7,4,1,|23|50|5null90|range(0, 10, 1)|net";
+
+	struct roscha_env *env = roscha_env_new();
+	roscha_env_add_template(env, strdup("test"), input);
+	roscha_env_add_template(env, strdup("step"),
+	                        "{% for i in range(1, 2, 0) %}{% endfor %}");
+	check_env_errors(env);
+	roscha_hmap_set_new(env->vars, "n", 10);
+	hmap_set(env->vars->hmap, "pages", roscha_object_new_range(100, 0, -10));
+	sds got = roscha_env_render(env, "test");
+	check_env_errors(env);
+	asserteq(strcmp(got, expected), 0);
+	sdsfree(got);
+
+	got = roscha_env_render(env, "step");
+	asserteq(env->errors->len, 1);
+	asserteq(strcmp(env->errors->values[0], "step:1:12: range step can't be 0"),
+	         0);
+	sdsfree(got);
+	sdsfree(vector_pop(env->errors));
+
+	/* The items of a range aren't kept, in a request heap either */
+	roscha_env_add_template(env, strdup("loop"),
+	                        "{% for i in range(10000) %}{% endfor %}");
+	check_env_errors(env);
+	struct roscha_heap *heap = roscha_heap_new();
+	roscha_heap_enter(heap);
+	got = roscha_env_render(env, "loop");
+	check_env_errors(env);
+	asserteq(got[0], '\0');
+	bool reused = roscha_heap_size(heap) < 10000 * sizeof(struct roscha_object);
+	asserteq(reused, true);
+	asserteq(roscha_heap_leave(), heap);
+	roscha_heap_destroy(heap);
+
+	roscha_env_destroy(env);
+}
+
+static void
+test_eval_fold(void)
+{
+	char *input = "a{% if true %}b{{ 1 + 2 }}{% else %}x{% endif %}c"
+				  "{{ \"<\" }}{{ \"<\" | safe }}"
+				  "{% if not true %}{% include \"none\" %}{% endif %}"
+				  "{% for v in list %}"
+				  "{% if 1 > 2 %}e{% elif v %}{{ v }}{% else %}-{% endif %}"
+				  "{% endfor %}";
+
+	struct roscha_env *env = roscha_env_new();
+	roscha_env_add_template(env, strdup("test"), input);
+	roscha_env_add_template(env, strdup("error"), "a{{ 1 + \"b\" }}");
+	check_env_errors(env);
+	struct roscha_object *list = roscha_object_new(vector_new());
+	roscha_vector_push_new(list, 0);
+	roscha_vector_push_new(list, 1);
+	roscha_hmap_set(env->vars, "list", list);
+
+	sds got = roscha_env_render(env, "test");
+	check_env_errors(env);
+	asserteq(strcmp(got, "ab3c<<-1"), 0);
+	sdsfree(got);
+
+	/* Folded output doesn't skip escaping */
+	env->autoescape = true;
+	got             = roscha_env_render(env, "test");
+	check_env_errors(env);
+	asserteq(strcmp(got, "ab3c&lt;<-1"), 0);
+	sdsfree(got);
+
+	/* Nor errors, which are reported when rendering */
+	got = roscha_env_render(env, "error");
+	asserteq(env->errors->len, 1);
+	asserteq(strcmp(env->errors->values[0],
+	                "error:1:6: types mismatch: int + slice"),
+	         0);
+	sdsfree(got);
+
+	roscha_env_destroy(env);
+	roscha_object_unref(list);
+}
+
+static void
+test_eval_short_circuit(void)
+{
+	char *input = "{% if user and user.admin %}a{% else %}b{% endif %}"
+				  "{% if v or 1 + \"x\" %}c{% endif %}"
+				  "{% if 1 or 1 + \"x\" %}d{% endif %}"
+				  "{% if false and v.x %}e{% elif v %}{{ v }}"
+				  "{% elif true %}f{% else %}g{% endif %}";
+
+	struct roscha_env *env = roscha_env_new();
+	roscha_env_add_template(env, strdup("test"), input);
+	check_env_errors(env);
+	roscha_hmap_set_new(env->vars, "v", 2);
+
+	sds got = roscha_env_render(env, "test");
+	check_env_errors(env);
+	asserteq(strcmp(got, "bcd2"), 0);
+	sdsfree(got);
+
+	struct roscha_object *user = roscha_object_new(hmap_new());
+	roscha_hmap_set_new(user, "admin", 1);
+	roscha_hmap_set(env->vars, "user", user);
+	got = roscha_env_render(env, "test");
+	check_env_errors(env);
+	asserteq(strcmp(got, "acd2"), 0);
+	sdsfree(got);
+
+	/* The right side is still evaluated when the left doesn't decide */
+	roscha_object_unref(roscha_hmap_set_new(env->vars, "v", 0));
+	got = roscha_env_render(env, "test");
+	asserteq(env->errors->len, 1);
+	asserteq(strcmp(env->errors->values[0],
+	                "test:1:64: types mismatch: int + slice"),
+	         0);
+	sdsfree(got);
+
+	roscha_env_destroy(env);
+	roscha_object_unref(user);
+}
+
+static void
+test_eval_specialize(void)
+{
+	char *input = "{% if flags.beta %}<b>{{ site.name }}</b>"
+				  "{% else %}old{% endif %}|{{ user }}|"
+				  "{% for site in xs %}{{ site }}{% endfor %}|"
+				  "{{ site.name | upper }}|{{ n + 1 }}|"
+				  "{% if n > 40 and user %}u{% endif %}";
+
+	struct roscha_env *env = roscha_env_new();
+	roscha_env_add_template(env, strdup("page"), input);
+	check_env_errors(env);
+	struct roscha_object *consts = roscha_object_new(hmap_new());
+	struct roscha_object *flags  = roscha_object_new(hmap_new());
+	struct roscha_object *site   = roscha_object_new(hmap_new());
+	roscha_hmap_set_new(flags, "beta", 1);
+	roscha_hmap_set_new(site, "name", sdsnew("Tom & Jerry"));
+	roscha_hmap_set(consts, "flags", flags);
+	roscha_hmap_set(consts, "site", site);
+	roscha_hmap_set_new(consts, "n", 41);
+	asserteq(roscha_env_specialize(env, "page", strdup("page.en"), consts),
+	         true);
+	check_env_errors(env);
+
+	/* The variables don't change the substituted consts */
+	struct roscha_object *xs = roscha_object_new(vector_new());
+	roscha_vector_push_new(xs, 1);
+	roscha_vector_push_new(xs, 2);
+	roscha_hmap_set(env->vars, "xs", xs);
+	roscha_hmap_set_new(env->vars, "user", sdsnew("ann"));
+	roscha_hmap_set_new(env->vars, "n", 0);
+	roscha_object_unref(roscha_hmap_set_new(site, "name", sdsnew("other")));
+	roscha_hmap_set(env->vars, "site", site);
+	roscha_hmap_set_new(env->vars, "flags", hmap_new());
+
+	sds got = roscha_env_render(env, "page");
+	check_env_errors(env);
+	asserteq(strcmp(got, "old|ann|12|OTHER|1|"), 0);
+	sdsfree(got);
+	got = roscha_env_render(env, "page.en");
+	check_env_errors(env);
+	asserteq(strcmp(got, "<b>Tom & Jerry</b>|ann|12|TOM & JERRY|42|u"), 0);
+	sdsfree(got);
+	env->autoescape = true;
+	got             = roscha_env_render(env, "page.en");
+	check_env_errors(env);
+	asserteq(strcmp(got, "<b>Tom &amp; Jerry</b>|ann|12|TOM &amp; JERRY|42|u"),
+	         0);
+	sdsfree(got);
+
+	asserteq(roscha_env_specialize(env, "none", strdup("none.en"), consts),
+	         false);
+	asserteq(env->errors->len, 1);
+	asserteq(strcmp(env->errors->values[0], "template \"none\" not found"),
+	         0);
+
+	roscha_env_destroy(env);
+	roscha_object_unref(consts);
+	roscha_object_unref(flags);
+	roscha_object_unref(site);
+	roscha_object_unref(xs);
+}
+
+static void
+test_eval_cache(void)
+{
+	char *input = "{% for v in list %}"
+				  "{% cache v %}<{{ v }}:{{ n }}>{% endcache %}"
+				  "{% endfor %}"
+				  "{% cache \"total\", 60 %}{{ n }}{% endcache %}";
+
+	struct roscha_env *env = roscha_env_new();
+	roscha_env_add_template(env, strdup("test"), input);
+	roscha_env_add_template(env, strdup("ttl"),
+	                        "{% cache 1 \"a\" %}x{% endcache %}");
+	roscha_env_add_template(env, strdup("negttl"),
+	                        "{% cache 1, -1 %}x{% endcache %}");
+	roscha_env_add_template(env, strdup("esc"),
+	                        "{% cache 1 %}{{ html }}{% endcache %}");
+	check_env_errors(env);
+	struct roscha_object *list = roscha_object_new(vector_new());
+	roscha_vector_push_new(list, sdsnew("x"));
+	roscha_vector_push_new(list, sdsnew("y"));
+	roscha_hmap_set(env->vars, "list", list);
+	roscha_hmap_set_new(env->vars, "n", 1);
+
+	/* Rendered every time without a cache */
+	sds got = roscha_env_render(env, "test");
+	check_env_errors(env);
+	asserteq(strcmp(got, "<x:1><y:1>1"), 0);
+	sdsfree(got);
+
+	struct roscha_cache_stats stats;
+	env->cache = roscha_cache_new(1 << 20);
+	got        = roscha_env_render(env, "test");
+	check_env_errors(env);
+	asserteq(strcmp(got, "<x:1><y:1>1"), 0);
+	sdsfree(got);
+	roscha_cache_stats(env->cache, &stats);
+	asserteq(stats.misses, 3);
+	asserteq(stats.entries, 3);
+
+	roscha_object_unref(roscha_hmap_set_new(env->vars, "n", 2));
+	got = roscha_env_render(env, "test");
+	check_env_errors(env);
+	asserteq(strcmp(got, "<x:1><y:1>1"), 0);
+	sdsfree(got);
+	roscha_cache_stats(env->cache, &stats);
+	asserteq(stats.hits, 3);
+
+	/*
+	 * Only two entries fit: x is the least recently used, then each one that
+	 * is rendered again evicts the next.
+	 */
+	roscha_cache_set_max_size(env->cache, stats.size - 1);
+	got = roscha_env_render(env, "test");
+	check_env_errors(env);
+	asserteq(strcmp(got, "<x:2><y:2>2"), 0);
+	sdsfree(got);
+	roscha_cache_stats(env->cache, &stats);
+	asserteq(stats.evictions, 4);
+	asserteq(stats.entries, 2);
+
+	roscha_cache_clear(env->cache);
+	roscha_object_unref(roscha_hmap_set_new(env->vars, "n", 3));
+	got = roscha_env_render(env, "test");
+	check_env_errors(env);
+	asserteq(strcmp(got, "<x:3><y:3>3"), 0);
+	sdsfree(got);
+
+	/* Escaped and unescaped outputs are cached apart */
+	roscha_hmap_set_new(env->vars, "html", (slice_whole("<b>")));
+	got = roscha_env_render(env, "esc");
+	check_env_errors(env);
+	asserteq(strcmp(got, "<b>"), 0);
+	sdsfree(got);
+	env->autoescape = true;
+	got             = roscha_env_render(env, "esc");
+	check_env_errors(env);
+	asserteq(strcmp(got, "&lt;b&gt;"), 0);
+	sdsfree(got);
+
+	got = roscha_env_render(env, "ttl");
+	asserteq(strcmp(env->errors->values[0],
+	                "ttl:1:3: cache ttl must be an int, got slice"),
+	         0);
+	sdsfree(got);
+	sdsfree(vector_pop(env->errors));
+	got = roscha_env_render(env, "negttl");
+	asserteq(strcmp(env->errors->values[0],
+	                "negttl:1:3: cache ttl can't be negative, got -1"),
+	         0);
+	sdsfree(got);
+
+	roscha_cache_destroy(env->cache);
+	roscha_env_destroy(env);
+	roscha_object_unref(list);
+}
+
+static sds
+filter_reverse(sds out, struct roscha_object *in, struct vector *args)
+{
+	struct slice str;
+	if (args->len > 0 || !roscha_object_slice(in, &str)) return NULL;
+	for (size_t i = str.end; i > str.start; i--) {
+		out = sdscatlen(out, str.str + i - 1, 1);
+	}
+	return out;
+}
+
+static void
+test_eval_memoize(void)
+{
+	char *input = "{% if user.admin %}<{{ user.email }}>{% endif %}"
+				  "{{ user.name | upper }}:"
+				  "{% for v in items %}{{ v }}{% endfor %}";
+
+	struct roscha_env *env = roscha_env_new();
+	env->render_cache      = roscha_cache_new(1 << 20);
+	roscha_env_add_template(env, strdup("page"), input);
+	check_env_errors(env);
+	struct roscha_object *user = roscha_object_new(hmap_new());
+	roscha_hmap_set_new(user, "name", sdsnew("ann"));
+	roscha_hmap_set_new(user, "email", sdsnew("ann@example.com"));
+	roscha_hmap_set_new(user, "admin", 0);
+	struct roscha_object *items = roscha_object_new(vector_new());
+	roscha_vector_push_new(items, 1);
+	roscha_vector_push_new(items, 2);
+	roscha_hmap_set(env->vars, "user", user);
+	roscha_hmap_set(env->vars, "items", items);
+
+	struct {
+		const char *expected;
+		size_t      hits;
+	} renders[] = {
+		{ "ANN:12", 0 },
+		{ "ANN:12", 1 },
+		/* Not read unless user.admin */
+		{ "ANN:12", 2 },
+		{ "BOB:12", 2 },
+		{ "<bob@example.com>BOB:12", 2 },
+		{ "BOB:12", 3 },
+		{ "<bob@example.com>BOB:12", 4 },
+	};
+	struct roscha_cache_stats stats;
+	for (size_t i = 0; i < sizeof(renders) / sizeof(renders[0]); i++) {
+		switch (i) {
+		case 2:
+			roscha_object_unref(roscha_hmap_set_new(
+				user, "email", sdsnew("bob@example.com")));
+			break;
+		case 3:
+			roscha_object_unref(
+				roscha_hmap_set_new(user, "name", sdsnew("bob")));
+			break;
+		case 4:
+		case 6:
+			roscha_object_unref(roscha_hmap_set_new(user, "admin", 1));
+			break;
+		case 5:
+			roscha_object_unref(roscha_hmap_set_new(user, "admin", 0));
+			break;
+		}
+		sds got = roscha_env_render(env, "page");
+		check_env_errors(env);
+		asserteq(strcmp(got, renders[i].expected), 0);
+		sdsfree(got);
+		roscha_cache_stats(env->render_cache, &stats);
+		asserteq(stats.hits, renders[i].hits);
+	}
+	asserteq(stats.entries, 3);
+
+	/* Adding templates invalidates the cached renders */
+	roscha_env_add_template(env, strdup("page"), "{{ items | length }}");
+	sds got = roscha_env_render(env, "page");
+	check_env_errors(env);
+	asserteq(strcmp(got, "2"), 0);
+	sdsfree(got);
+	roscha_cache_stats(env->render_cache, &stats);
+	asserteq(stats.hits, 4);
+
+	/* So do escaping the output and replacing filters */
+	static const struct roscha_filter reverse = { .write = filter_reverse };
+	roscha_hmap_set_new(env->vars, "html", (slice_whole("<b>")));
+	roscha_env_add_template(env, strdup("esc"), "{{ html | upper }}");
+	const char *escaped[] = { "<B>", "&lt;B&gt;", "&gt;b&lt;" };
+	for (size_t i = 0; i < sizeof(escaped) / sizeof(escaped[0]); i++) {
+		if (i == 1) env->autoescape = true;
+		if (i == 2) roscha_env_add_filter(env, "upper", &reverse);
+		got = roscha_env_render(env, "esc");
+		check_env_errors(env);
+		asserteq(strcmp(got, escaped[i]), 0);
+		sdsfree(got);
+	}
+	roscha_cache_stats(env->render_cache, &stats);
+	asserteq(stats.hits, 4);
+
+	roscha_cache_destroy(env->render_cache);
+	roscha_env_destroy(env);
+	roscha_object_unref(user);
+	roscha_object_unref(items);
+}
+
+/* Apply the changes to doc from the last to the first, freeing them */
+static sds
+apply_changes(sds doc, struct vector *changes)
+{
+	struct roscha_change *change;
+	while ((change = vector_pop(changes)) != NULL) {
+		sds patched = sdsnewlen(doc, change->start);
+		patched     = sdscatsds(patched, change->text);
+		patched     = sdscat(patched, doc + change->start + change->len);
+		sdsfree(doc);
+		sdsfree(change->text);
+		roscha_free(change);
+		doc = patched;
+	}
+
+	return doc;
+}
+
+static void
+test_eval_incremental(void)
+{
+	char *base  = "<h1>{{ title }}</h1>{% block body %}{% endblock %}"
+				  "<footer>{{ year }}</footer>";
+	char *child = "{% extends \"base\" %}{% block body %}"
+				  "<p>{{ user.name }}</p>"
+				  "<ul>{% for v in items %}<li>{{ v }}</li>{% endfor %}</ul>"
+				  "{% endblock %}";
+
+	struct roscha_env *env = roscha_env_new();
+	roscha_env_add_template(env, strdup("base"), base);
+	roscha_env_add_template(env, strdup("child"), child);
+	check_env_errors(env);
+	struct roscha_object *user = roscha_object_new(hmap_new());
+	roscha_hmap_set_new(user, "name", sdsnew("ann"));
+	struct roscha_object *items = roscha_object_new(vector_new());
+	roscha_vector_push_new(items, 1);
+	roscha_hmap_set(env->vars, "user", user);
+	roscha_hmap_set(env->vars, "items", items);
+	roscha_hmap_set_new(env->vars, "title", sdsnew("Hi"));
+	roscha_hmap_set_new(env->vars, "year", 2024);
+
+	struct vector *changes = vector_new();
+	asserteq(roscha_env_render_incremental(env, "child", changes), NULL);
+	check_env_errors(env);
+	sds doc = apply_changes(sdsempty(), changes);
+	sds exp = roscha_env_render(env, "child");
+	asserteq(strcmp(doc, exp), 0);
+	sdsfree(exp);
+
+	/* Nothing changed */
+	roscha_env_render_incremental(env, "child", changes);
+	asserteq(changes->len, 0);
+
+	roscha_object_unref(roscha_hmap_set_new(user, "name", sdsnew("bob")));
+	roscha_env_render_incremental(env, "child", changes);
+	check_env_errors(env);
+	asserteq(changes->len, 1);
+	struct roscha_change *change = changes->values[0];
+	asserteq(strncmp(doc + change->start, "ann", change->len), 0);
+	asserteq(strcmp(change->text, "bob"), 0);
+	doc = apply_changes(doc, changes);
+
+	roscha_vector_push_new(items, 2);
+	roscha_object_unref(roscha_hmap_set_new(env->vars, "year", 2025));
+	roscha_env_render_incremental(env, "child", changes);
+	check_env_errors(env);
+	asserteq(changes->len, 2);
+	doc = apply_changes(doc, changes);
+	exp = "<h1>Hi</h1><p>bob</p><ul><li>1</li><li>2</li></ul>"
+		  "<footer>2025</footer>";
+	asserteq(strcmp(doc, exp), 0);
+	sds got = roscha_env_render_incremental(env, "child", NULL);
+	asserteq(strcmp(got, exp), 0);
+	sdsfree(got);
+
+	sdsfree(doc);
+	vector_free(changes);
+	roscha_env_destroy(env);
+	roscha_object_unref(user);
+	roscha_object_unref(items);
+}
+
+#define NTHREADS 4
+
+static void *
+render_cached(void *cache)
+{
+	struct roscha_env *env = roscha_env_new();
+	env->cache             = cache;
+	roscha_env_add_template(env, strdup("test"),
+	                        "{% cache k %}[{{ k }}]{% endcache %}");
+	char *res = NULL;
+	for (int i = 0; i < 10000 && res == NULL; i++) {
+		roscha_object_unref(roscha_hmap_set_new(env->vars, "k", i % 16));
+		sds got = roscha_env_render(env, "test");
+		sds exp = sdscatfmt(sdsempty(), "[%i]", i % 16);
+		if (got == NULL || strcmp(got, exp) != 0) res = "unexpected output";
+		sdsfree(exp);
+		sdsfree(got);
+	}
+	roscha_env_destroy(env);
+	return res;
+}
+
+static void
+test_eval_cache_threads(void)
+{
+	/* Small enough to keep evicting */
+	struct roscha_cache *cache = roscha_cache_new(512);
+	pthread_t            threads[NTHREADS];
+	for (int i = 0; i < NTHREADS; i++) {
+		asserteq(pthread_create(&threads[i], NULL, render_cached, cache), 0);
+	}
+	for (int i = 0; i < NTHREADS; i++) {
+		void *res;
+		pthread_join(threads[i], &res);
+		asserteq(res, NULL);
+	}
+	struct roscha_cache_stats stats;
+	roscha_cache_stats(cache, &stats);
+	asserteq(stats.hits + stats.misses, NTHREADS * 10000);
+	assertneq(stats.evictions, 0);
+	roscha_cache_destroy(cache);
+}
+
+static void
+test_eval_sstr(void)
+{
+	char *input = "{% for v in foo %}"
+				  "{% if v == \"world\" %}"
+				  "{{ v }}"
+				  "{% endif %}"
+				  "{% endfor %}"
+				  "{% if empty %}empty{% endif %}"
+				  "{{ long }}";
+	char *expected = "world"
+					 "this string is too long to be inlined";
+
+	struct roscha_object *foo = roscha_object_new(vector_new());
+	vector_push(foo->vector, roscha_object_new_sstr("hello", 5));
+	vector_push(foo->vector, roscha_object_new_sstr("world", 5));
+	struct roscha_object *empty = roscha_object_new_sstr("", 0);
+	char                 *lstr  = "this string is too long to be inlined";
+	struct roscha_object *lobj  = roscha_object_new_sstr(lstr, strlen(lstr));
+	asserteq(((struct roscha_object *)foo->vector->values[0])->type,
+	         ROSCHA_SSTR);
+	asserteq(lobj->type, ROSCHA_STRING);
+
+	struct roscha_env *env = roscha_env_new();
+	roscha_env_add_template(env, strdup("test"), input);
+	check_env_errors(env);
+	roscha_hmap_set(env->vars, "foo", foo);
+	roscha_hmap_set(env->vars, "empty", empty);
+	roscha_hmap_set(env->vars, "long", lobj);
+	sds got = roscha_env_render(env, "test");
+	check_env_errors(env);
+	asserteq(strcmp(got, expected), 0);
+
+	sdsfree(got);
+	roscha_env_destroy(env);
+	roscha_object_unref(foo);
+	roscha_object_unref(empty);
+	roscha_object_unref(lobj);
+}
+
+static void
+test_eval_autoescape(void)
+{
+	char *input = "{{ short }}|{{ long }}|{{ long | safe }}|{{ n }}";
+	char *expected = "&lt;b&gt;&amp;|"
+					 "say &quot;hi&quot; &amp; it&#39;s done, "
+					 "for a long enough string&lt;/p&gt;|"
+					 "say \"hi\" & it's done, for a long enough string</p>|"
+					 "42";
+
+	struct roscha_env *env = roscha_env_new();
+	env->autoescape        = true;
+	roscha_env_add_template(env, strdup("test"), input);
+	check_env_errors(env);
+	roscha_hmap_set_new(env->vars, "short", (slice_whole("<b>&")));
+	roscha_hmap_set_new(env->vars, "long",
+	                    (slice_whole("say \"hi\" & it's done, "
+	                                 "for a long enough string</p>")));
+	roscha_hmap_set_new(env->vars, "n", 42);
+	sds got = roscha_env_render(env, "test");
+	check_env_errors(env);
+	asserteq(strcmp(got, expected), 0);
+
+	sdsfree(got);
+	roscha_env_destroy(env);
+}
+
+static void
+test_eval_trim(void)
+{
+	char *input = "<ul>\n"
+				  "  {%- for v in list -%}\n"
+				  "  <li>{{- v -}}  </li>\n"
+				  "  {%- endfor %}\n"
+				  "</ul>\n"
+				  "{{ 3 -1 }}{{-2 }}";
+	char *expected = "<ul><li>1</li><li>2</li></ul>\n22";
+	char *blocks = "<ul>\n"
+				   "  {% for v in list %}\n"
+				   "  <li>{{ v }}</li>\n"
+				   "  {% endfor %}\n"
+				   "</ul>\n";
+	char *expected_blocks = "<ul>\n"
+							"  <li>1</li>\n"
+							"  <li>2</li>\n"
+							"</ul>\n";
+
+	struct roscha_env *env = roscha_env_new();
+	env->trim_blocks       = true;
+	env->lstrip_blocks     = true;
+	roscha_env_add_template(env, strdup("test"), input);
+	roscha_env_add_template(env, strdup("blocks"), blocks);
+	check_env_errors(env);
+	struct roscha_object *list = roscha_object_new(vector_new());
+	roscha_vector_push_new(list, 1);
+	roscha_vector_push_new(list, 2);
+	roscha_hmap_set(env->vars, "list", list);
+	sds got = roscha_env_render(env, "test");
+	check_env_errors(env);
+	asserteq(strcmp(got, expected), 0);
+	sdsfree(got);
+	got = roscha_env_render(env, "blocks");
+	check_env_errors(env);
+	asserteq(strcmp(got, expected_blocks), 0);
+
+	sdsfree(got);
+	roscha_env_destroy(env);
+	roscha_object_unref(list);
+}
+
+struct reader {
+	const char *s;
+	size_t      pos;
+};
+
+/* Hands out the template a few bytes at a time, like a pipe would */
+static ssize_t
+read_chunk(void *ctx, char *buf, size_t len)
+{
+	struct reader *r = ctx;
+	size_t         n = strlen(r->s + r->pos);
+	if (n > 7) n = 7;
+	if (n > len) n = len;
+	memcpy(buf, r->s + r->pos, n);
+	r->pos += n;
+	return n;
+}
+
+static void
+test_eval_stream(void)
+{
+	/* Longer than the stream buffer, so the content is split */
+	size_t pad   = 100000;
+	char  *input = malloc(pad + 128);
+	memset(input, 'a', pad);
+	strcpy(input + pad, "  \n  {%- for v in list %}\n"
+	                    "  <li>{{ v | upper }}</li>\n"
+	                    "  {% endfor -%}\n\n"
+	                    "{{ \"end\" }}");
+
+	struct roscha_env *env = roscha_env_new();
+	env->trim_blocks       = true;
+	env->lstrip_blocks     = true;
+	struct reader r        = {input, 0};
+	roscha_env_add_template(env, strdup("whole"), input);
+	roscha_env_add_template_stream(env, strdup("stream"), read_chunk, &r);
+	check_env_errors(env);
+	struct roscha_object *list = roscha_object_new(vector_new());
+	roscha_vector_push_new(list, sdsnew("x"));
+	roscha_vector_push_new(list, sdsnew("y"));
+	roscha_hmap_set(env->vars, "list", list);
+	sds want = roscha_env_render(env, "whole");
+	sds got  = roscha_env_render(env, "stream");
+	check_env_errors(env);
+	asserteq(strcmp(got, want), 0);
+	asserteq(strcmp(want + pad, "  <li>X</li>\n  <li>Y</li>\nend"), 0);
+
+	sdsfree(want);
+	sdsfree(got);
+
+	/* Whitespace longer than the buffer is trimmed whole */
+	memset(input, ' ', pad);
+	strcpy(input + pad, "\n{%- if true -%}\n\nx{% endif %}");
+	r = (struct reader){input, 0};
+	roscha_env_add_template(env, strdup("whole"), input);
+	roscha_env_add_template_stream(env, strdup("stream"), read_chunk, &r);
+	check_env_errors(env);
+	want = roscha_env_render(env, "whole");
+	got  = roscha_env_render(env, "stream");
+	check_env_errors(env);
+	asserteq(strcmp(want, "x"), 0);
+	asserteq(strcmp(got, want), 0);
+	sdsfree(want);
+	sdsfree(got);
+
+	/* Ending inside a tag is a parse error */
+	r = (struct reader){"{% if x ", 0};
+	asserteq(roscha_env_add_template_stream(env, strdup("eof"), read_chunk, &r),
+	         false);
+	assertneq(env->errors->len, 0);
+
+	roscha_env_destroy(env);
+	roscha_object_unref(list);
+	free(input);
+}
+
+static void
+test_eval_filters(void)
+{
+	char *input = "{{ s | upper }}|{{ s | lower }}|{{ pad | trim }}|"
+				  "{{ s | truncate(5) }}|{{ s | truncate(5, \"~\") }}|"
+				  "{{ s | truncate(64) }}|{{ s | replace(\"o\", \"0\") }}|"
+				  "{{ n | replace(\"1\", \"one\") }}|{{ s | length }}|"
+				  "{{ v | length }}|{% if v | length > 1 %}many{% endif %}|"
+				  "{{ pad | trim | upper | reverse }}|{{ html | upper | safe }}|"
+				  "{{ html | lower }}";
+	char *expected = "HELLO WORLD|hello world|padded|"
+					 "Hello...|Hello~|"
+					 "Hello World|Hell0 W0rld|"
+					 "one2one|11|"
+					 "2|many|"
+					 "DEDDAP|<B>|"
+					 "&lt;b&gt;";
+	static const struct roscha_filter reverse = { .write = filter_reverse };
+
+	struct roscha_env *env = roscha_env_new();
+	env->autoescape        = true;
+	roscha_env_add_filter(env, "reverse", &reverse);
+	roscha_env_add_template(env, strdup("test"), input);
+	check_env_errors(env);
+	struct roscha_object *v = roscha_object_new(vector_new());
+	roscha_vector_push_new(v, 1);
+	roscha_vector_push_new(v, 2);
+	roscha_hmap_set_new(env->vars, "s", (slice_whole("Hello World")));
+	roscha_hmap_set_new(env->vars, "pad", (slice_whole(" \tpadded\n ")));
+	roscha_hmap_set_new(env->vars, "html", (slice_whole("<b>")));
+	roscha_hmap_set_new(env->vars, "n", 121);
+	roscha_hmap_set(env->vars, "v", v);
+	sds got = roscha_env_render(env, "test");
+	check_env_errors(env);
+	asserteq(strcmp(got, expected), 0);
+	sdsfree(got);
+
+	/* Rendering stops at the first error */
+	roscha_env_add_template(env, strdup("bad"), "{{ s | upper(1) }}{{ s | nope }}");
+	check_env_errors(env);
+	got = roscha_env_render(env, "bad");
+	asserteq(env->errors->len, 1);
+
+	sdsfree(got);
+	roscha_env_destroy(env);
+	roscha_object_unref(v);
+}
+
+static size_t nallocs = 0;
+static size_t nfrees  = 0;
+
+static void *
+count_malloc(void *ctx, size_t size)
+{
+	nallocs++;
+	return malloc(size);
+}
+
+static void *
+count_realloc(void *ctx, void *ptr, size_t size)
+{
+	if (ptr == NULL) nallocs++;
+	return realloc(ptr, size);
+}
+
+static void
+count_free(void *ctx, void *ptr)
+{
+	nfrees++;
+	free(ptr);
+}
+
+static void
+test_eval_allocator(void)
+{
+	struct roscha_allocator count_allocator = {
+		.malloc  = count_malloc,
+		.realloc = count_realloc,
+		.free    = count_free,
+	};
+	char *input    = "{% for v in foo %}{{ v }}{% endfor %}";
+	char *expected = "hello, world";
+	roscha_set_allocator(&count_allocator);
+
+	struct roscha_object *foo = roscha_object_new(vector_new());
+	roscha_vector_push_new(foo, sdsnew("hello"));
+	roscha_vector_push_new(foo, sdsnew(", world"));
+	struct roscha_env *env = roscha_env_new();
+	roscha_env_add_template(env, strdup("test"), input);
+	check_env_errors(env);
+	roscha_hmap_set(env->vars, "foo", foo);
+	sds got = roscha_env_render(env, "test");
+	check_env_errors(env);
+	asserteq(strcmp(got, expected), 0);
+	assertneq(nallocs, 0);
+
+	sdsfree(got);
+	roscha_env_destroy(env);
+	roscha_object_unref(foo);
+	asserteq(nallocs, nfrees);
+	roscha_set_allocator(NULL);
+}
+
+static void
+test_eval_heap(void)
+{
+	char *input    = "{% for u in users %}{{ u.name }}:{{ u.id }} {% endfor %}";
+	char *expected = "ana:0 bob:1 ";
+	char *names[]  = { "ana", "bob" };
+
+	struct roscha_env *env = roscha_env_new();
+	roscha_env_add_template(env, strdup("test"), input);
+	check_env_errors(env);
+
+	struct roscha_heap *heap = roscha_heap_new();
+	roscha_heap_enter(heap);
+	struct roscha_object *users = roscha_object_new(vector_new());
+	for (int i = 0; i < 2; i++) {
+		struct roscha_object *u = roscha_object_new(hmap_new());
+		roscha_hmap_set_new(u, "name", (slice_whole(names[i])));
+		roscha_hmap_set_new(u, "id", i);
+		vector_push(users->vector, u);
+	}
+	asserteq(users->heap, true);
+	roscha_hmap_set(env->vars, "users", users);
+	sds got = roscha_env_render(env, "test");
+	check_env_errors(env);
+	asserteq(strcmp(got, expected), 0);
+	assertneq(roscha_heap_size(heap), 0);
+	sdsfree(got);
+
+	struct roscha_object *kept = roscha_object_persist(users);
+	roscha_hmap_unset(env->vars, "users");
+	roscha_object_unref(users);
+	asserteq(roscha_heap_leave(), heap);
+	roscha_heap_destroy(heap);
+
+	asserteq(kept->heap, false);
+	roscha_hmap_set(env->vars, "users", kept);
+	got = roscha_env_render(env, "test");
+	check_env_errors(env);
+	asserteq(strcmp(got, expected), 0);
+
+	sdsfree(got);
+	roscha_env_destroy(env);
+	roscha_object_unref(kept);
+}
+
 static void
 init(void)
 {
@@ -184,6 +1264,26 @@ main(void)
 	RUN_TEST(test_eval_variable);
 	RUN_TEST(test_eval_cond);
 	RUN_TEST(test_eval_loop);
+	RUN_TEST(test_eval_loop_hmap);
 	RUN_TEST(test_eval_child);
+	RUN_TEST(test_eval_inheritance);
+	RUN_TEST(test_eval_include);
+	RUN_TEST(test_eval_load_dir);
+	RUN_TEST(test_eval_macro);
+	RUN_TEST(test_eval_range);
+	RUN_TEST(test_eval_fold);
+	RUN_TEST(test_eval_specialize);
+	RUN_TEST(test_eval_short_circuit);
+	RUN_TEST(test_eval_cache);
+	RUN_TEST(test_eval_cache_threads);
+	RUN_TEST(test_eval_memoize);
+	RUN_TEST(test_eval_incremental);
+	RUN_TEST(test_eval_sstr);
+	RUN_TEST(test_eval_autoescape);
+	RUN_TEST(test_eval_filters);
+	RUN_TEST(test_eval_trim);
+	RUN_TEST(test_eval_stream);
+	RUN_TEST(test_eval_allocator);
+	RUN_TEST(test_eval_heap);
 	cleanup();
 }
@@ -19,6 +19,37 @@ test_slice_cmp(void)
 	asserteq(slice_cmp(&s1a, &s1b), 0);
 }
 
+static void
+test_slice_eq(void)
+{
+	char a[40], b[41];
+	for (size_t i = 0; i < sizeof(a); i++) {
+		a[i] = 'a' + i % 26;
+	}
+	memcpy(b + 1, a, sizeof(a));
+	/* Every length up to and past the word size, at different alignments */
+	for (size_t len = 0; len <= sizeof(a); len++) {
+		struct slice sa = slice_new(a, 0, len);
+		struct slice sb = slice_new(b, 1, len + 1);
+		asserteq(slice_eq(&sa, &sb), true);
+		asserteq(slice_cmp(&sa, &sb), 0);
+		asserteq(slice_hash(&sa), slice_hash(&sb));
+		for (size_t i = 0; i < len; i++) {
+			b[i + 1] = (char)0x80;
+			asserteq(slice_eq(&sa, &sb), false);
+			asserteq(slice_cmp(&sa, &sb), 1);
+			assertneq(slice_hash(&sa), slice_hash(&sb));
+			b[i + 1] = '~';
+			asserteq(slice_cmp(&sa, &sb), -1);
+			b[i + 1] = a[i];
+		}
+	}
+	struct slice shorter = slice_whole("zzz");
+	struct slice longer  = slice_whole("aaaa");
+	asserteq(slice_cmp(&shorter, &longer), -1);
+	asserteq(slice_eq(&shorter, &longer), false);
+}
+
 static void
 test_slice_string(void)
 {
@@ -28,8 +59,9 @@ test_slice_string(void)
 		.end = 11,
 	};
 	sds str = sdsempty();
-	slice_string(&slice, str);
+	str = slice_string(&slice, str);
 	asserteq(strcmp("world", str), 0);
+	sdsfree(str);
 }
 
 int
@@ -37,5 +69,6 @@ main(void)
 {
 	INIT_TESTS();
 	RUN_TEST(test_slice_cmp);
+	RUN_TEST(test_slice_eq);
 	RUN_TEST(test_slice_string);
 }
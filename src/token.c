@@ -2,48 +2,7 @@
 
 #include <stdio.h>
 #include <stddef.h>
-
-#include "hmap.h"
-
-static struct hmap *keywords = NULL;
-static const char  *keys[]   = {
-	   "and",
-	   "or",
-	   "not",
-	   "for",
-	   "in",
-	   "break",
-	   "endfor",
-	   "true",
-	   "false",
-	   "if",
-	   "elif",
-	   "else",
-	   "endif",
-	   "extends",
-	   "block",
-	   "endblock",
-	   NULL,
-};
-enum token_type values[] = {
-	TOKEN_AND,
-	TOKEN_OR,
-	TOKEN_NOT,
-	TOKEN_FOR,
-	TOKEN_IN,
-	TOKEN_BREAK,
-	TOKEN_ENDFOR,
-	TOKEN_TRUE,
-	TOKEN_FALSE,
-	TOKEN_IF,
-	TOKEN_ELIF,
-	TOKEN_ELSE,
-	TOKEN_ENDIF,
-	TOKEN_EXTENDS,
-	TOKEN_BLOCK,
-	TOKEN_ENDBLOCK,
-	TOKEN_EOF,
-};
+#include <string.h>
 
 const char *token_types[] = {
 	[TOKEN_ILLEGAL] = "ILLEGAL",
@@ -80,6 +39,8 @@ const char *token_types[] = {
 	[TOKEN_RBRACKET] = "]",
 	[TOKEN_POUND]    = "#",
 	[TOKEN_PERCENT]  = "%",
+	[TOKEN_PIPE]     = "|",
+	[TOKEN_TRIM]     = "TRIM",
 	/* Keywords */
 	[TOKEN_FOR]      = "for",
 	[TOKEN_IN]       = "in",
@@ -92,29 +53,63 @@ const char *token_types[] = {
 	[TOKEN_ELSE]     = "else",
 	[TOKEN_ENDIF]    = "endif",
 	[TOKEN_EXTENDS]  = "extends",
+	[TOKEN_INCLUDE]  = "include",
 	[TOKEN_BLOCK]    = "block",
 	[TOKEN_ENDBLOCK] = "endblock",
+	[TOKEN_MACRO]    = "macro",
+	[TOKEN_ENDMACRO] = "endmacro",
+	[TOKEN_CACHE]    = "cache",
+	[TOKEN_ENDCACHE] = "endcache",
 	/* The document content */
 	[TOKEN_CONTENT] = "CONTENT",
 };
 
-void
-token_init_keywords(void)
-{
-	if (keywords == NULL) {
-		keywords = hmap_new();
-		for (size_t i = 0; keys[i] != NULL; i++) {
-			hmap_set(keywords, keys[i], values + i);
-		}
-	}
-}
+#define keyword_is(s, kw) (memcmp(s, kw, sizeof(kw) - 1) == 0)
 
 enum token_type
 token_lookup_ident(const struct slice *ident)
 {
-	enum token_type *t = hmap_gets(keywords, ident);
-	if (t) {
-		return *t;
+	/*
+	 * Keywords are told apart by their length first, leaving only a handful
+	 * of fixed size comparisons.
+	 */
+	const char *s = ident->str + ident->start;
+	switch (slice_len(ident)) {
+	case 2:
+		if (keyword_is(s, "or")) return TOKEN_OR;
+		if (keyword_is(s, "in")) return TOKEN_IN;
+		if (keyword_is(s, "if")) return TOKEN_IF;
+		break;
+	case 3:
+		if (keyword_is(s, "and")) return TOKEN_AND;
+		if (keyword_is(s, "not")) return TOKEN_NOT;
+		if (keyword_is(s, "for")) return TOKEN_FOR;
+		break;
+	case 4:
+		if (keyword_is(s, "true")) return TOKEN_TRUE;
+		if (keyword_is(s, "elif")) return TOKEN_ELIF;
+		if (keyword_is(s, "else")) return TOKEN_ELSE;
+		break;
+	case 5:
+		if (keyword_is(s, "false")) return TOKEN_FALSE;
+		if (keyword_is(s, "break")) return TOKEN_BREAK;
+		if (keyword_is(s, "endif")) return TOKEN_ENDIF;
+		if (keyword_is(s, "block")) return TOKEN_BLOCK;
+		if (keyword_is(s, "macro")) return TOKEN_MACRO;
+		if (keyword_is(s, "cache")) return TOKEN_CACHE;
+		break;
+	case 6:
+		if (keyword_is(s, "endfor")) return TOKEN_ENDFOR;
+		break;
+	case 7:
+		if (keyword_is(s, "extends")) return TOKEN_EXTENDS;
+		if (keyword_is(s, "include")) return TOKEN_INCLUDE;
+		break;
+	case 8:
+		if (keyword_is(s, "endblock")) return TOKEN_ENDBLOCK;
+		if (keyword_is(s, "endmacro")) return TOKEN_ENDMACRO;
+		if (keyword_is(s, "endcache")) return TOKEN_ENDCACHE;
+		break;
 	}
 
 	return TOKEN_IDENT;
@@ -136,9 +131,3 @@ token_string(struct token *token, sds str)
 	sdsfree(slicebuf);
 	return str;
 }
-
-void
-token_free_keywords(void)
-{
-	hmap_free(keywords);
-}
@@ -1,21 +1,22 @@
 #include "vector.h"
+#include "alloc.h"
 
 static inline bool
 vector_grow(struct vector *vec)
 {
 	vec->cap *= 2;
-	vec->values = realloc(vec->values, sizeof(vec->values) * vec->cap);
+	vec->values = roscha_realloc(vec->values, sizeof(vec->values) * vec->cap);
 	return vec->values != NULL;
 }
 
 struct vector *
 vector_new_with_cap(size_t cap)
 {
-	struct vector *vec = malloc(sizeof(*vec));
+	struct vector *vec = roscha_malloc(sizeof(*vec));
 	if (!vec) return NULL;
-	vec->values = malloc(sizeof(vec->values) * cap);
+	vec->values = roscha_malloc(sizeof(vec->values) * cap);
 	if (!vec->values) {
-		free(vec);
+		roscha_free(vec);
 		return NULL;
 	}
 	vec->cap = cap;
@@ -44,6 +45,6 @@ vector_pop(struct vector *vec)
 void
 vector_free(struct vector *vec)
 {
-	free(vec->values);
-	free(vec);
+	roscha_free(vec->values);
+	roscha_free(vec);
 }